@@ -1,21 +1,75 @@
 #include "servers/APIServer.hpp"
 #include "common/UUID.hpp"
+#include "common/Handoff.hpp"
 #include "clients/APIClient.hpp"
 #include "utils/environ.hpp"
+#include "common/Logger.hpp"
 #include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <signal.h>
 
 int main() {
-    long timeout = get_long_env("TIMEOUT", 30);
-    unsigned long api_port = get_ulong_env("API_PORT", 4001);
+    // SIGUSR2 upgrades the server to a new binary, it is waited for by the main thread only
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    APIServerConfig config;
+    config.timeout_seconds = get_long_env("TIMEOUT", 30);
+    config.max_ttl = get_long_env("MAX_TTL", 0);
+    config.port = get_ushort_env("API_PORT", 4001);
+    config.num_threads = get_ushort_env("NUM_THREADS", 0);
+    config.mode = parse_execution_mode(get_string_env("EXECUTION_MODE", "shared"));
+    config.pin_threads = get_bool_env("PIN_THREADS", false);
+    config.replica_address = get_string_env("REPLICA_ADDRESS", "");
+    config.replica_port = get_ushort_env("REPLICA_PORT", 4001);
+    config.token_table_name = get_string_env("TOKEN_SHM_NAME", "");
+    config.token_table_capacity = get_ulong_env("TOKEN_SHM_CAPACITY", 65536);
+    // Group allowed to read the tokens, the segment is private to the API server's user without it
+    config.token_table_group = get_long_env("TOKEN_SHM_GID", -1);
+    std::string upgrade_binary = get_string_env("UPGRADE_BINARY", "");
+    // Repeated log messages printed per second
+    Logger::get().setRateLimit(get_ulong_env("LOG_RATE", 10));
+
+    // Started by the upgrade of a running server: its listening sockets come first, then its tokens
+    auto handoff = Handoff::inherit();
+    Handoff::Message message;
+    if (handoff) {
+        if (!handoff->receive(message) || message.type != Handoff::MessageType::Listeners) {
+            log_error("No listening sockets from the previous process.");
+            return 1;
+        }
+        config.listen_fds = Handoff::listeners(message, "api");
+    }
 
     // Start the API server
-    auto apiServer = std::make_shared<APIServer>(api_port, timeout);
+    auto apiServer = std::make_shared<APIServer>(config);
+    if (handoff) {
+        std::size_t count = 0;
+        while (handoff->receive(message) && message.type == Handoff::MessageType::Tokens) {
+            count += apiServer->restoreTokens(message.payload);
+        }
+        log_info("Restored ", count, " tokens from the previous process.");
+    }
     apiServer->start();
-    // In a container we can't use cin, so we just stop indefinitely
+    if (handoff) {
+        handoff->send(Handoff::MessageType::Ready, "");
+        handoff.reset();
+    }
+    // In a container we can't use cin, the main thread only waits for the upgrade signal
     while (true) {
-        std::this_thread::sleep_for(std::chrono::hours(24 * 365));
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+        log_info("Upgrading the API server.");
+        if (apiServer->upgrade(upgrade_binary)) {
+            break;
+        }
     }
-    return 0;
+    apiServer->stop();
+    // The first process stays the parent of the service, for the supervisor that started it
+    return Handoff::waitForSuccessors();
 }
@@ -0,0 +1,73 @@
+#include "utils/network.hpp"
+#include <boost/asio.hpp>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+// Stub instance for the load generator, started with BASH_COMMAND: echoes everything it receives.
+// It listens on the socket passed as fd 3 (PASS_LISTEN_FD), or on a free port that it announces.
+
+class EchoSession : public std::enable_shared_from_this<EchoSession> {
+public:
+    explicit EchoSession(boost::asio::ip::tcp::socket socket) : socket_(std::move(socket)) {}
+
+    void start() {
+        doRead();
+    }
+
+private:
+    void doRead() {
+        auto self = shared_from_this();
+        socket_.async_read_some(boost::asio::buffer(buffer_),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
+                    return;
+                }
+                boost::asio::async_write(socket_, boost::asio::buffer(buffer_, length),
+                    [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                        if (!ec) {
+                            doRead();
+                        }
+                    });
+            });
+    }
+
+    boost::asio::ip::tcp::socket socket_;
+    std::array<char, 64 * 1024> buffer_;
+};
+
+static void do_accept(boost::asio::ip::tcp::acceptor& acceptor) {
+    acceptor.async_accept([&acceptor](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+        if (!ec) {
+            std::make_shared<EchoSession>(std::move(socket))->start();
+        }
+        do_accept(acceptor);
+    });
+}
+
+int main() {
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::acceptor acceptor(io_context);
+    // Socket activation: the listening socket is fd 3
+    const char* listen_fds = std::getenv("LISTEN_FDS");
+    const char* listen_pid = std::getenv("LISTEN_PID");
+    bool activated = listen_fds && listen_pid && std::string(listen_fds) == "1" && std::atoi(listen_pid) == getpid();
+    unsigned short port = 0;
+    int fd = activated ? 3 : create_listen_socket(port);
+    if (fd < 0) {
+        std::cerr << "Failed to listen" << std::endl;
+        return 1;
+    }
+    acceptor.assign(boost::asio::ip::tcp::v4(), fd);
+    if (!activated) {
+        std::printf("Listening on port: %u\n", port);
+        std::fflush(stdout);
+    }
+    do_accept(acceptor);
+    io_context.run();
+    return 0;
+}
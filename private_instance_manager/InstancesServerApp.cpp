@@ -2,50 +2,147 @@
 #include "utils/environ.hpp"
 #include "clients/APIClient.hpp"
 #include "utils/strings.hpp"
+#include "backends/CommandBackend.hpp"
+#include "common/Logger.hpp"
 #include <unordered_map>
 #include <mutex>
+#include <sstream>
 #include <thread>
 #include <iostream>
 
+// Parse a comma-separated list of backends, each written as address[|docker_host[|capacity]]
+static std::vector<std::shared_ptr<InstanceBackend>> parse_backends(const std::string& spec, const std::string& stop_command,
+                                                                    const std::string& list_command,
+                                                                    const std::string& rename_command,
+                                                                    const std::string& inspect_command) {
+    std::vector<std::shared_ptr<InstanceBackend>> backends;
+    std::istringstream list(spec);
+    std::string backend_spec;
+    while (std::getline(list, backend_spec, ',')) {
+        std::istringstream fields(backend_spec);
+        std::string address, docker_host, capacity;
+        std::getline(fields, address, '|');
+        std::getline(fields, docker_host, '|');
+        std::getline(fields, capacity, '|');
+        if (address.empty()) {
+            continue;
+        }
+        backends.push_back(std::make_shared<CommandBackend>(address, address,
+            capacity.empty() ? 0 : static_cast<unsigned int>(std::stoul(capacity)),
+            stop_command, docker_host, list_command, rename_command, inspect_command));
+    }
+    return backends;
+}
+
 int main() {
-    long timeout = get_long_env("TIMEOUT", 30);
-    unsigned short server_port = get_ushort_env("SERVER_PORT", 4000);
+    std::string challenges_config = get_string_env("CHALLENGES_CONFIG", "");
     std::string api_address = get_string_env("API_ADDRESS", "127.0.0.1");
     unsigned short api_port = get_ushort_env("API_PORT", 4001);
     std::string docker_command = get_string_env("DOCKER_COMMAND", "");
     std::string bash_command = get_string_env("BASH_COMMAND", "");
-    std::string challenge_address = get_string_env("CHALLENGE_ADDRESS", "127.0.0.1");
     std::string instances_address = get_string_env("INSTANCES_ADDRESS", "this_container"); // Name of the container that runs the instance
-    std::string challenge_port = get_string_env("CHALLENGE_PORT", "8080");
     unsigned int user_id = get_uint_env("USER_UID", 1000);
     unsigned int group_id = get_uint_env("USER_GID", 1000);
-    bool ssl = get_bool_env("SSL", false);
+    unsigned int num_threads = get_uint_env("NUM_THREADS", 0);
+    ExecutionMode mode = parse_execution_mode(get_string_env("EXECUTION_MODE", "shared"));
+    bool pin_threads = get_bool_env("PIN_THREADS", false);
+    std::string backends_spec = get_string_env("BACKENDS", "");
+    SchedulingPolicy policy = parse_scheduling_policy(get_string_env("SCHEDULER", "least_loaded"));
+    unsigned int max_instances = get_uint_env("MAX_INSTANCES", 0);
+    std::string stop_command = remove_quotes(get_string_env("STOP_COMMAND", "docker stop %s"));
+    long reconcile_interval = get_long_env("RECONCILE_INTERVAL", 60);
+    std::string list_command = remove_quotes(get_string_env("LIST_COMMAND", "docker ps --format '{{.Names}}'"));
+    std::string cgroup_parent = get_string_env("CGROUP_PARENT", "");
+    std::string rename_command = remove_quotes(get_string_env("RENAME_COMMAND", "docker rename %s %s"));
+    std::string inspect_command = remove_quotes(get_string_env("INSPECT_COMMAND",
+                                                               "docker inspect -f '{{.HostConfig.ReadonlyRootfs}}' %s"));
+    // Settings of the single challenge, and defaults of those of the config file
+    ChallengeConfig defaults;
+    defaults.name = "default";
+    defaults.port = get_ushort_env("SERVER_PORT", 4000);
+    defaults.timeout = get_long_env("TIMEOUT", 30);
+    defaults.challenge_address = get_string_env("CHALLENGE_ADDRESS", "127.0.0.1");
+    defaults.challenge_port = get_string_env("CHALLENGE_PORT", "8080");
+    defaults.ssl = get_bool_env("SSL", false);
+    defaults.ready_timeout = get_long_env("READY_TIMEOUT", 10);
+    defaults.pass_listen_fd = get_bool_env("PASS_LISTEN_FD", false);
+    defaults.zygote = get_bool_env("ZYGOTE", false);
+    defaults.zygote_template = get_string_env("ZYGOTE_TEMPLATE", "");
+    defaults.limits.cpus = std::strtod(get_string_env("INSTANCE_CPUS", "0").c_str(), nullptr);
+    defaults.limits.memory = get_ulong_env("INSTANCE_MEMORY_MB", 0) * 1024 * 1024;
+    defaults.limits.pids = get_ulong_env("INSTANCE_PIDS", 0);
+    defaults.recycle_command = get_string_env("RECYCLE_COMMAND", "");
+    if (!defaults.recycle_command.empty()) {
+        defaults.recycle_command = remove_quotes(defaults.recycle_command);
+    }
+    defaults.recycle_pool = get_uint_env("RECYCLE_POOL", 10);
+    // Repeated log messages printed per second
+    Logger::get().setRateLimit(get_ulong_env("LOG_RATE", 10));
 
-    // If none of the commands are provided, exit
-    if (docker_command.empty() && bash_command.empty()) {
-        std::cerr << "No command provided. Exiting..." << std::endl;
-        return 1;
+    std::vector<ChallengeConfig> configs;
+    if (!challenges_config.empty()) {
+        // Every challenge of the file has its own port and command
+        defaults.port = 0;
+        auto loaded = load_challenges(challenges_config, defaults);
+        if (!loaded) {
+            log_error("Invalid challenges config. Exiting...");
+            return 1;
+        }
+        configs = std::move(*loaded);
+    } else {
+        // If none of the commands are provided, exit
+        if (docker_command.empty() && bash_command.empty()) {
+            log_error("No command provided. Exiting...");
+            return 1;
+        }
+        // Determine the command, without its quotes
+        if (!docker_command.empty()) {
+            defaults.cmd_type = CommandType::Docker;
+            defaults.command = remove_quotes(docker_command);
+        } else {
+            defaults.cmd_type = CommandType::Bash;
+            defaults.command = remove_quotes(bash_command);
+        }
+        configs.push_back(defaults);
     }
-    // Remove quotes from the commands
-    docker_command = remove_quotes(docker_command);
-    bash_command = remove_quotes(bash_command);
-    // Determine the command
-    std::string command;
-    CommandType cmd_type;
-    if (!docker_command.empty()) {
-        cmd_type = CommandType::Docker;
-        command = docker_command;
-    } else if (!bash_command.empty()) {
-        cmd_type = CommandType::Bash;
-        command = bash_command;
+    // Docker instances of every challenge run on the configured backends, or on the local daemon
+    std::vector<std::shared_ptr<InstanceBackend>> backends;
+    if (!backends_spec.empty()) {
+        backends = parse_backends(backends_spec, stop_command, list_command, rename_command, inspect_command);
     } else {
-        std::cerr << "Invalid command provided. Exiting..." << std::endl;
+        backends.push_back(std::make_shared<CommandBackend>("local", instances_address, max_instances, stop_command, "",
+                                                            list_command, rename_command, inspect_command));
+    }
+    if (backends.empty()) {
+        log_error("Invalid backends provided. Exiting...");
         return 1;
     }
+    auto scheduler = std::make_shared<InstanceScheduler>(backends, policy);
+    // The zygotes must be forked while the process is still single-threaded
+    std::vector<Challenge> challenges;
+    for (auto& config : configs) {
+        Challenge challenge;
+        challenge.config = std::move(config);
+        if (challenge.config.cmd_type == CommandType::Bash && challenge.config.zygote) {
+            challenge.zygote = Zygote::start(challenge.config.command, challenge.config.zygote_template);
+            if (!challenge.zygote) {
+                log_error("Failed to start the zygote of ", challenge.config.name, ". Exiting...");
+                return 1;
+            }
+        }
+        challenges.push_back(std::move(challenge));
+    }
+    // Bash instances get their own cgroup when they have limits
+    for (auto& challenge : challenges) {
+        const CgroupLimits& limits = challenge.config.limits;
+        if (challenge.config.cmd_type == CommandType::Bash && (limits.cpus > 0 || limits.memory > 0 || limits.pids > 0)) {
+            challenge.cgroups = CgroupManager::create(cgroup_parent, limits);
+        }
+    }
     // Start the API server
-    std::shared_ptr<InstancesServer> server = std::make_shared<InstancesServer>(server_port, api_address, api_port, timeout, 
-                           instances_address, command, challenge_address, challenge_port,
-                           ssl, cmd_type, user_id, group_id);
+    std::shared_ptr<InstancesServer> server = std::make_shared<InstancesServer>(std::move(challenges), api_address, api_port,
+                           instances_address, user_id, group_id, num_threads, mode, pin_threads, scheduler,
+                           reconcile_interval);
     server->start();
     while (true) {
         std::this_thread::sleep_for(std::chrono::hours(24 * 365));
@@ -0,0 +1,39 @@
+#include "clients/LoadGenerator.hpp"
+#include "utils/environ.hpp"
+#include <iostream>
+
+// Simulated players against a running instances server and tunnel server, see LoadGenerator
+int main() {
+    LoadGenerator::Config config;
+    config.instances_address = get_string_env("INSTANCES_SERVER_ADDRESS", "127.0.0.1");
+    config.instances_port = get_ushort_env("SERVER_PORT", 4000);
+    config.tunnel_address = get_string_env("TUNNEL_ADDRESS", "127.0.0.1");
+    config.tunnel_port = get_ushort_env("TUNNEL_PORT", 4002);
+    config.players = get_ulong_env("PLAYERS", 100);
+    config.concurrency = get_ulong_env("CONCURRENCY", 100);
+    config.ramp_up = std::strtod(get_string_env("RAMP_UP", "0").c_str(), nullptr);
+    config.sessions_per_player = get_ulong_env("SESSIONS", 1);
+    config.interactive_messages = get_ulong_env("INTERACTIVE_MESSAGES", 10);
+    config.message_size = get_ulong_env("MESSAGE_SIZE", 64);
+    config.think_time = get_long_env("THINK_TIME_MS", 0);
+    config.bulk_bytes = get_ulong_env("BULK_BYTES", 1024 * 1024);
+    config.step_timeout = get_long_env("STEP_TIMEOUT", 30);
+    config.num_threads = get_uint_env("NUM_THREADS", 0);
+
+    if (config.players == 0 || config.concurrency == 0) {
+        std::cerr << "PLAYERS and CONCURRENCY must be positive. Exiting..." << std::endl;
+        return 1;
+    }
+    std::cout << "Running " << config.players << " players, " << config.concurrency << " at a time, against "
+              << config.instances_address << ":" << config.instances_port << " and "
+              << config.tunnel_address << ":" << config.tunnel_port << "." << std::endl;
+    LoadGenerator generator(config);
+    try {
+        generator.run();
+    } catch (const boost::system::system_error& e) {
+        std::cerr << "Load generator error: " << e.what() << std::endl;
+        return 1;
+    }
+    generator.report(std::cout);
+    return 0;
+}
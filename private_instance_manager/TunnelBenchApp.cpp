@@ -0,0 +1,101 @@
+#include "servers/TunnelSession.hpp"
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Forwarding benchmark of a single tunnel session: a client and an instance exchange chunks through
+// a pooled TunnelSession over loopback, and every heap allocation made while they do is counted.
+// Once warmed up the forwarding loop must not allocate, the benchmark fails otherwise.
+
+static std::atomic<std::size_t> allocations(0);
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, std::size_t /*size*/) noexcept {
+    std::free(pointer);
+}
+
+static std::size_t env_size(const char* name, std::size_t default_value) {
+    const char* value = std::getenv(name);
+    return value ? std::stoul(value) : default_value;
+}
+
+// Send a chunk from one end and read it back at the other, through the session
+static void transfer(boost::asio::ip::tcp::socket& from, boost::asio::ip::tcp::socket& to,
+                     const std::vector<char>& chunk, std::vector<char>& received) {
+    boost::asio::write(from, boost::asio::buffer(chunk));
+    boost::asio::read(to, boost::asio::buffer(received));
+}
+
+int main() {
+    std::size_t chunk_size = env_size("CHUNK_SIZE", TunnelSession::BUFFER_SIZE);
+    std::size_t warmup = env_size("WARMUP_CHUNKS", 1000);
+    std::size_t chunks = env_size("CHUNKS", 100000);
+
+    boost::asio::io_context io_context;
+    auto pool = std::make_shared<TunnelSessionPool>(io_context);
+    boost::asio::ip::tcp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+    boost::asio::ip::tcp::acceptor tunnel_acceptor(io_context, loopback);
+    boost::asio::ip::tcp::acceptor instance_acceptor(io_context, loopback);
+
+    // The client and the instance use blocking sockets of their own io_context
+    boost::asio::io_context peers_context;
+    boost::asio::ip::tcp::socket client(peers_context);
+    boost::asio::ip::tcp::socket instance(peers_context);
+    client.connect(tunnel_acceptor.local_endpoint());
+    auto session = pool->acquire(tunnel_acceptor.accept());
+    session->getInstanceSocket().connect(instance_acceptor.local_endpoint());
+    instance_acceptor.accept(instance);
+    client.set_option(boost::asio::ip::tcp::no_delay(true));
+    instance.set_option(boost::asio::ip::tcp::no_delay(true));
+
+    boost::asio::post(session->getStrand(), [session]() {
+        session->startForwarding();
+    });
+    std::thread io_thread([&io_context]() {
+        io_context.run();
+    });
+
+    std::vector<char> chunk(chunk_size, 'x');
+    std::vector<char> received(chunk_size);
+    for (std::size_t i = 0; i < warmup; ++i) {
+        transfer(client, instance, chunk, received);
+        transfer(instance, client, chunk, received);
+    }
+
+    std::size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < chunks; ++i) {
+        transfer(client, instance, chunk, received);
+        transfer(instance, client, chunk, received);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::size_t allocated = allocations.load() - before;
+
+    client.close();
+    instance.close();
+    io_thread.join();
+
+    double forwarded = 2.0 * chunks;
+    std::cout << "Forwarded " << static_cast<std::size_t>(forwarded) << " chunks of " << chunk_size << " bytes in "
+              << elapsed << " s (" << forwarded * chunk_size / elapsed / (1024 * 1024) << " MiB/s, "
+              << elapsed * 1e6 / forwarded << " us per chunk)" << std::endl;
+    std::cout << "Heap allocations: " << allocated << " (" << allocated / forwarded << " per chunk)" << std::endl;
+    return allocated == 0 ? 0 : 1;
+}
@@ -1,8 +1,9 @@
 #include "utils/environ.hpp"
 #include "clients/APIClient.hpp"
 #include "servers/TunnelServer.hpp"
+#include "common/Handoff.hpp"
+#include "common/Logger.hpp"
 #include <boost/asio.hpp>
-#include <iostream>
 #include <signal.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -10,16 +11,93 @@
 
 // Forking server that tunnels the connection to a private instance
 int main() {
+    // SIGUSR2 upgrades the server to a new binary, it is waited for by the main thread only
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
     std::string instance_endpoint = get_string_env("INSTANCE_ADDRESS", "127.0.0.1");
-    unsigned short port = get_ushort_env("TUNNEL_PORT", 4002);
-    std::string api_endpoint = get_string_env("API_ADDRESS", "127.0.0.1");
-    unsigned short api_port = get_ushort_env("API_PORT", 4001);
+    TunnelServerConfig config;
+    config.port = get_ushort_env("TUNNEL_PORT", 4002);
+    config.api_address = get_string_env("API_ADDRESS", "127.0.0.1");
+    config.api_port = get_ushort_env("API_PORT", 4001);
+    config.num_threads = get_ushort_env("NUM_THREADS", 0);
+    config.mode = parse_execution_mode(get_string_env("EXECUTION_MODE", "shared"));
+    config.pin_threads = get_bool_env("PIN_THREADS", false);
+    config.idle_timeout = get_long_env("IDLE_TIMEOUT", 300);
+    config.session_rate = get_ulong_env("SESSION_RATE", 0);
+    config.token_rate = get_ulong_env("TOKEN_RATE", 0);
+    config.global_rate = get_ulong_env("GLOBAL_RATE", 0);
+    config.stats_port = get_ushort_env("STATS_PORT", 0);
+    config.token_table_name = get_string_env("TOKEN_SHM_NAME", "");
+    config.mux_max_streams = get_ulong_env("MUX_MAX_STREAMS", 256);
+    config.mux_spare_connections = get_ulong_env("MUX_SPARE_CONNECTIONS", 0);
+    config.udp_port = get_ushort_env("UDP_PORT", 0);
+    config.http_port = get_ushort_env("HTTP_PORT", 0);
+    config.http_token_cookie = get_string_env("HTTP_TOKEN_COOKIE", "token");
+    std::string tls_certificate = get_string_env("TLS_CERT", "");
+    std::string tls_key = get_string_env("TLS_KEY", "");
+    bool ktls = get_bool_env("KTLS", true);
+    std::string upgrade_binary = get_string_env("UPGRADE_BINARY", "");
+    bool session_handoff = get_bool_env("SESSION_HANDOFF", true);
+    long drain_timeout = get_long_env("DRAIN_TIMEOUT", 300);
+    // Repeated log messages printed per second
+    Logger::get().setRateLimit(get_ulong_env("LOG_RATE", 10));
+
+    // TLS is terminated here when a certificate is given
+    if (!tls_certificate.empty()) {
+        try {
+            config.tls = std::make_shared<TlsContext>(tls_certificate, tls_key.empty() ? tls_certificate : tls_key, ktls);
+        } catch (const boost::system::system_error& e) {
+            log_error("Failed to load the TLS certificate: ", e.what());
+            return 1;
+        }
+    }
+
+    // Started by the upgrade of a running server: its listening sockets come first
+    std::shared_ptr<Handoff> handoff = Handoff::inherit();
+    if (handoff) {
+        Handoff::Message message;
+        if (!handoff->receive(message) || message.type != Handoff::MessageType::Listeners) {
+            log_error("No listening sockets from the previous process.");
+            return 1;
+        }
+        config.listen_fds = Handoff::listeners(message, "tunnel");
+        auto stats_fds = Handoff::listeners(message, "stats");
+        if (!stats_fds.empty()) {
+            config.stats_fd = stats_fds.front();
+        }
+        config.udp_fds = Handoff::listeners(message, "udp");
+        config.http_fds = Handoff::listeners(message, "http");
+    }
 
     // Start the tunnel server
-    std::shared_ptr<TunnelServer> server = std::make_shared<TunnelServer>(port, api_endpoint, api_port);
+    std::shared_ptr<TunnelServer> server = std::make_shared<TunnelServer>(config);
     server->start();
+    if (handoff) {
+        handoff->send(Handoff::MessageType::Ready, "");
+        // The previous process sends its live sessions until it has drained
+        std::thread([server, handoff]() {
+            Handoff::Message message;
+            while (handoff->receive(message)) {
+                if (message.type == Handoff::MessageType::Session) {
+                    server->adoptSession(message.payload, message.fds);
+                }
+            }
+        }).detach();
+    }
     while (true) {
-        std::this_thread::sleep_for(std::chrono::hours(24 * 365));
+        int signal;
+        if (sigwait(&signals, &signal) != 0) {
+            continue;
+        }
+        log_info("Upgrading the tunnel server.");
+        if (server->upgrade(upgrade_binary, session_handoff, std::chrono::seconds(drain_timeout))) {
+            break;
+        }
     }
-    return 0;
+    server->stop();
+    // The first process stays the parent of the service, for the supervisor that started it
+    return Handoff::waitForSuccessors();
 }
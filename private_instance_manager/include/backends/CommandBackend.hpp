@@ -0,0 +1,44 @@
+#ifndef COMMAND_BACKEND_HPP
+#define COMMAND_BACKEND_HPP
+
+#include <string>
+#include "backends/InstanceBackend.hpp"
+
+// Backend driven by shell commands. The launch command, given by the challenge, is formatted with the port (%d) and the
+// token (%s), the stop command with the token (%s), or with several tokens separated by spaces to
+// stop them at once. The list command prints the names of the running instances, one per line.
+// With a docker host the commands run with DOCKER_HOST pointing to it, so that a single server
+// can drive the daemons of several hosts. The rename command is formatted with the current and
+// the new name of a recycled instance, and the inspect command with its name, printing "true" when
+// its root filesystem is read-only.
+class CommandBackend : public InstanceBackend {
+public:
+    CommandBackend(const std::string& name, const std::string& address, unsigned int capacity,
+                   const std::string& stop_command = "docker stop %s",
+                   const std::string& docker_host = "",
+                   const std::string& list_command = "docker ps --format '{{.Names}}'",
+                   const std::string& rename_command = "docker rename %s %s",
+                   const std::string& inspect_command = "docker inspect -f '{{.HostConfig.ReadonlyRootfs}}' %s");
+
+    bool launch(const std::string& command, unsigned short port, const std::string& token) override;
+    bool stop(const std::string& token) override;
+    std::optional<std::vector<std::string>> listInstances() override;
+    bool stopAll(const std::vector<std::string>& tokens) override;
+    bool recycle(const std::string& command, const std::string& token) override;
+    bool rename(const std::string& token, const std::string& new_token) override;
+    bool isReadOnly(const std::string& token) override;
+
+private:
+    bool run(const std::string& command);
+    // Lines printed by the command, nullopt if it failed
+    std::optional<std::vector<std::string>> output(const std::string& command);
+    std::string withDockerHost(const std::string& command) const;
+
+    std::string stop_command_;
+    std::string docker_host_;
+    std::string list_command_;
+    std::string rename_command_;
+    std::string inspect_command_;
+};
+
+#endif // COMMAND_BACKEND_HPP
@@ -0,0 +1,58 @@
+#ifndef INSTANCE_BACKEND_HPP
+#define INSTANCE_BACKEND_HPP
+
+#include <atomic>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A host able to run instances. Implementations decide how instances are started and stopped,
+// the base class keeps track of the capacity and of the live instances.
+class InstanceBackend {
+public:
+    // A capacity of 0 means unlimited
+    InstanceBackend(const std::string& name, const std::string& address, unsigned int capacity);
+    virtual ~InstanceBackend() = default;
+
+    // Start an instance named after the token, reachable at getAddress():port. The command is the
+    // launch command of the challenge, as backends are shared by the challenges of a server
+    virtual bool launch(const std::string& command, unsigned short port, const std::string& token) = 0;
+    // Stop the instance named after the token
+    virtual bool stop(const std::string& token) = 0;
+    // Pick the port of a new instance. Returns 0 on failure
+    virtual unsigned short allocatePort();
+    // Names of the instances running on the backend, nullopt if they can't be listed
+    virtual std::optional<std::vector<std::string>> listInstances();
+    // Stop several instances at once. True if all of them were stopped
+    virtual bool stopAll(const std::vector<std::string>& tokens);
+    // Reset the instance with the recycle command of its challenge. False if the backend can't
+    virtual bool recycle(const std::string& command, const std::string& token);
+    // Rename the instance after the token of its next user
+    virtual bool rename(const std::string& token, const std::string& new_token);
+    // True if the root filesystem of the instance is read-only, so that a reset leaves nothing of
+    // its previous user. False if the backend can't tell
+    virtual bool isReadOnly(const std::string& token);
+
+    // Name used in the logs
+    const std::string& getName() const;
+    // Address of the instances, registered in the API so that the tunnel can reach them
+    const std::string& getAddress() const;
+    unsigned int getCapacity() const;
+    unsigned int getLiveInstances() const;
+    // Load between 0 and 1 for backends with a capacity, the number of live instances otherwise
+    double getLoad() const;
+    // Take a slot for a new instance, fails if the backend is full
+    bool tryReserve();
+    // Take a slot for an instance that is already running, even if the backend is full
+    void adopt();
+    // Give back a slot taken with tryReserve or adopt
+    void release();
+
+private:
+    std::string name_;
+    std::string address_;
+    unsigned int capacity_;
+    std::atomic<unsigned int> live_instances_;
+};
+
+#endif // INSTANCE_BACKEND_HPP
@@ -0,0 +1,36 @@
+#ifndef INSTANCE_SCHEDULER_HPP
+#define INSTANCE_SCHEDULER_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "backends/InstanceBackend.hpp"
+
+enum class SchedulingPolicy {
+    // Scan every backend and pick the one with the lowest load
+    LeastLoaded,
+    // Pick two random backends and keep the one with the lowest load
+    PowerOfTwoChoices
+};
+
+// Parse "least_loaded" or "power_of_two" (anything else falls back to least loaded)
+SchedulingPolicy parse_scheduling_policy(const std::string& policy);
+
+// Spreads the new instances across several backends
+class InstanceScheduler {
+public:
+    InstanceScheduler(std::vector<std::shared_ptr<InstanceBackend>> backends,
+                      SchedulingPolicy policy = SchedulingPolicy::LeastLoaded);
+    // Pick a backend and reserve a slot on it. Returns nullptr if every backend is full
+    std::shared_ptr<InstanceBackend> acquire();
+    const std::vector<std::shared_ptr<InstanceBackend>>& getBackends() const;
+
+private:
+    std::shared_ptr<InstanceBackend> acquireLeastLoaded();
+    std::shared_ptr<InstanceBackend> acquirePowerOfTwo();
+
+    std::vector<std::shared_ptr<InstanceBackend>> backends_;
+    SchedulingPolicy policy_;
+};
+
+#endif // INSTANCE_SCHEDULER_HPP
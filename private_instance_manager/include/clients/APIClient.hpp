@@ -3,28 +3,70 @@
 
 #include <string>
 #include <boost/asio.hpp>
+#include <chrono>
 #include <optional>
+#include <vector>
 #include "common/NetworkInfo.hpp"
 
+// A single API server and what the client knows about its health
+struct APINode {
+    std::string address;
+    unsigned short port;
+    bool healthy = true;
+    std::chrono::steady_clock::time_point last_check;
+};
+
+// A slice of the token space, served by a primary and optionally by a read replica
+struct APIShard {
+    APINode primary;
+    std::optional<APINode> replica;
+};
 
 class APIClient {
 public:
+    // The address can be a single host or a comma-separated list of shards, each written as
+    // host[:port][|replica_host[:port]]. The port is used for the nodes that don't specify one.
     APIClient(const std::string& api_address, unsigned short api_port);
+    explicit APIClient(std::vector<APIShard> shards);
     ~APIClient();
 
     bool apiPing();
     std::optional<std::tuple<unsigned short, long, std::string>> apiGetInfo(const std::string& uuid_str);
-    std::optional<std::string> apiAddService(const std::string& service_address, unsigned short service_port);
+    // A ttl of 0 gives the token the default timeout of the API
+    std::optional<std::string> apiAddService(const std::string& service_address, unsigned short service_port, long ttl = 0);
+    // Store a token chosen by the caller on the shard owning it. True if the token is stored
+    bool apiPutService(const std::string& uuid_str, const std::string& service_address, unsigned short service_port, long time_remaining);
+    // Give more time to a token. Returns the new time remaining
+    std::optional<long> apiExtendService(const std::string& uuid_str, long seconds);
+    // Invalidate a token before its expiration. True if the token was removed
+    bool apiRevokeService(const std::string& uuid_str);
+
+    // Parse a list of shards as accepted by the constructor
+    static std::vector<APIShard> parseShards(const std::string& api_address, unsigned short api_port);
 
 private:
-    std::string sendRequest(const std::string& message);
-    void connect();
+    std::string sendRequest(APINode& node, const std::string& message);
+    // Send a request modifying a token to the primary of its shard, then of the next shard
+    std::string sendTokenUpdate(const std::string& uuid_str, const std::string& message);
+    void connect(const APINode& node);
     void disconnect();
 
-    std::string api_address_;
-    unsigned short api_port_;
+    // Consistent hashing of the tokens on the shards
+    void buildRing();
+    std::size_t shardFor(const std::string& uuid_str) const;
+    // Shards where the token is stored and looked up: its owner, then the next shard, which takes
+    // the tokens issued while the owner is down
+    std::vector<std::size_t> probeSequence(const std::string& uuid_str) const;
+    // Whether requests can be sent to the node, down nodes are probed with PING once in a while.
+    // Always true with a single node
+    bool isAvailable(APINode& node);
+    bool pingNode(APINode& node);
+
+    std::vector<APIShard> shards_;
+    // Sorted (hash, shard index) pairs, several virtual points per shard
+    std::vector<std::pair<std::uint64_t, std::size_t>> ring_;
     boost::asio::io_context io_context_;
     boost::asio::ip::tcp::socket socket_;
 };
 
-#endif // APICLIENT_HPP
\ No newline at end of file
+#endif // APICLIENT_HPP
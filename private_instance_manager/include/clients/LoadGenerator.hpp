@@ -0,0 +1,105 @@
+#ifndef LOADGENERATOR_HPP
+#define LOADGENERATOR_HPP
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "common/IOContextPool.hpp"
+
+// Samples of a metric, summarized with percentiles at the end of the run
+class Samples {
+public:
+    void add(double value);
+    std::size_t count() const;
+    // Value below which the given fraction of the samples fall, 0 without samples
+    double percentile(double fraction) const;
+    double max() const;
+
+private:
+    mutable std::mutex mutex_;
+    mutable std::vector<double> values_;
+    mutable bool sorted_ = true;
+};
+
+// Simulated players against the whole stack. Every player asks the instances server for an
+// instance, opens tunnel sessions to it with its token, exchanges small messages (interactive
+// traffic) and echoes a large payload (bulk traffic) on every session, then stops its instance.
+// The instance must echo what it receives, like EchoInstanceApp.
+class LoadGenerator {
+public:
+    struct Config {
+        std::string instances_address = "127.0.0.1";
+        unsigned short instances_port = 4000;
+        std::string tunnel_address = "127.0.0.1";
+        unsigned short tunnel_port = 4002;
+        // Players in total, and players running at the same time
+        std::size_t players = 100;
+        std::size_t concurrency = 100;
+        // Seconds over which the first players are started
+        double ramp_up = 0;
+        std::size_t sessions_per_player = 1;
+        // Round trips of interactive messages of message_size bytes, per session
+        std::size_t interactive_messages = 10;
+        std::size_t message_size = 64;
+        // Milliseconds between two interactive messages
+        long think_time = 0;
+        // Bytes echoed per session
+        std::size_t bulk_bytes = 1024 * 1024;
+        // Seconds given to every step of a player before it fails
+        long step_timeout = 30;
+        unsigned int num_threads = 0;
+    };
+
+    explicit LoadGenerator(const Config& config);
+    // Run every player, returns once they are all done
+    void run();
+    // Latency, throughput and error summary of the run
+    void report(std::ostream& os) const;
+
+private:
+    struct Player;
+
+    void startPlayer();
+    void provision(std::shared_ptr<Player> player);
+    void readProvisioning(std::shared_ptr<Player> player);
+    void openSession(std::shared_ptr<Player> player);
+    void exchangeMessage(std::shared_ptr<Player> player);
+    void sendBulk(std::shared_ptr<Player> player);
+    void stopInstance(std::shared_ptr<Player> player);
+    // Arm the timer of the player's current step, its sockets are closed when it fires
+    void armStep(std::shared_ptr<Player> player);
+    void fail(std::shared_ptr<Player> player, const std::string& reason);
+    void finish(std::shared_ptr<Player> player, bool succeeded);
+
+    Config config_;
+    IOContextPool pool_;
+    boost::asio::ip::tcp::resolver::results_type instances_endpoints_;
+    boost::asio::ip::tcp::resolver::results_type tunnel_endpoints_;
+    // Sent by every session in its bulk phase
+    std::string bulk_payload_;
+
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::size_t started_ = 0;
+    std::size_t finished_ = 0;
+    std::size_t succeeded_ = 0;
+    std::map<std::string, std::size_t> errors_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point end_;
+    std::uint64_t bulk_total_ = 0;
+
+    Samples provisioning_;
+    Samples tunnel_setup_;
+    Samples round_trip_;
+    Samples bulk_rate_;
+    Samples stop_;
+};
+
+#endif // LOADGENERATOR_HPP
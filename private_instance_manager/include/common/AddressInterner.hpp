@@ -0,0 +1,28 @@
+#ifndef ADDRESS_INTERNER_HPP
+#define ADDRESS_INTERNER_HPP
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Maps the service addresses to small reference-counted ids, so that the tokens of the
+// same service share a single copy of the address. Not thread-safe.
+class AddressInterner {
+public:
+    // Id of the address, adding a reference to it
+    std::uint32_t intern(const std::string& address);
+    // Drop a reference, the id is reused once the address is not referenced anymore
+    void release(std::uint32_t id);
+    const std::string& get(std::uint32_t id) const;
+    // Number of distinct addresses currently referenced
+    std::size_t size() const;
+
+private:
+    std::unordered_map<std::string, std::uint32_t> ids_;
+    std::vector<std::string> addresses_;
+    std::vector<std::uint32_t> references_;
+    std::vector<std::uint32_t> free_ids_;
+};
+
+#endif // ADDRESS_INTERNER_HPP
@@ -0,0 +1,74 @@
+#ifndef CGROUP_HPP
+#define CGROUP_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Resource limits of a single instance, 0 means unlimited
+struct CgroupLimits {
+    // CPU time, in cores (0.5 is half a core)
+    double cpus = 0;
+    // Memory, in bytes. The whole instance is killed when it runs out of memory
+    std::uint64_t memory = 0;
+    // Processes and threads
+    std::uint64_t pids = 0;
+};
+
+// Resources used by an instance
+struct CgroupUsage {
+    std::chrono::microseconds cpu{0};
+    std::uint64_t memory = 0;
+    std::uint64_t pids = 0;
+};
+
+// cgroup v2 child of a single instance. The process joins it by writing to procsFd() before it
+// drops its privileges, so that it never runs outside of its limits.
+class Cgroup {
+public:
+    Cgroup(std::string path, int procs_fd);
+    ~Cgroup();
+    Cgroup(const Cgroup&) = delete;
+    Cgroup& operator=(const Cgroup&) = delete;
+
+    // Descriptor of cgroup.procs (close-on-exec), to be handed to the new process
+    int procsFd() const;
+    // Move the calling process to the cgroup of procs_fd. Async-signal-safe, for forked children
+    static bool join(int procs_fd);
+    std::optional<CgroupUsage> usage() const;
+    // Why the instance must be killed before its token expires, empty while it is healthy
+    std::string limitExceeded() const;
+    // Kill every process of the cgroup and remove it. Waits up to a second for the processes to
+    // leave, the teardowns run it on the blocking threads of the server
+    void destroy();
+
+private:
+    std::string path_;
+    int procs_fd_;
+    bool destroyed_ = false;
+};
+
+// Creates the cgroups of the instances under a parent cgroup the server was delegated
+class CgroupManager {
+public:
+    // The parent defaults to the cgroup of the server. Returns nullptr when cgroup v2 is not
+    // available or the parent can't be written, the instances then run without limits
+    static std::shared_ptr<CgroupManager> create(const std::string& parent, const CgroupLimits& limits);
+    // Create the cgroup of a new instance. Returns nullptr on failure
+    std::shared_ptr<Cgroup> createInstance();
+
+private:
+    CgroupManager(std::string parent, const CgroupLimits& limits, std::vector<std::string> controllers);
+    // Remove the cgroups left empty by instances that are gone
+    void removeStale();
+
+    std::string parent_;
+    CgroupLimits limits_;
+    // Controllers enabled for the instances
+    std::vector<std::string> controllers_;
+};
+
+#endif // CGROUP_HPP
@@ -0,0 +1,102 @@
+#ifndef HANDLER_ALLOCATOR_HPP
+#define HANDLER_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Memory for the handler of one asynchronous operation at a time. Asio frees the memory of an
+// operation before calling its handler, so a chain of operations (read, write, read...) where
+// each one starts the next keeps reusing the same block. Requests that don't fit, or that come
+// while the block is in use, fall back to the heap.
+class HandlerMemory {
+public:
+    static constexpr std::size_t SIZE = 1024;
+
+    HandlerMemory() = default;
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(std::size_t size) {
+        if (!in_use_ && size <= SIZE) {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        if (pointer == &storage_) {
+            in_use_ = false;
+        } else {
+            ::operator delete(pointer);
+        }
+    }
+
+private:
+    typename std::aligned_storage<SIZE, alignof(std::max_align_t)>::type storage_;
+    bool in_use_ = false;
+};
+
+// Allocator handing out the HandlerMemory, found by Asio as the associated allocator of the handler
+template <typename T>
+class HandlerAllocator {
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : memory_(&memory) {}
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    T* allocate(std::size_t n) const {
+        return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t /*n*/) const {
+        memory_->deallocate(pointer);
+    }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U>& other) const noexcept {
+        return memory_ == other.memory_;
+    }
+
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U>& other) const noexcept {
+        return memory_ != other.memory_;
+    }
+
+private:
+    template <typename> friend class HandlerAllocator;
+    HandlerMemory* memory_;
+};
+
+// Handler allocating the operations it completes from a HandlerMemory
+template <typename Handler>
+class AllocHandler {
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    AllocHandler(HandlerMemory& memory, Handler handler) : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(memory_);
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+AllocHandler<typename std::decay<Handler>::type> make_alloc_handler(HandlerMemory& memory, Handler&& handler) {
+    return AllocHandler<typename std::decay<Handler>::type>(memory, std::forward<Handler>(handler));
+}
+
+#endif // HANDLER_ALLOCATOR_HPP
@@ -0,0 +1,79 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Channel between a running server and the new binary replacing it. The old process starts the
+// new one with spawn(), which finds the other end with inherit(), then hands it its listening
+// sockets (and whatever state the server can pass on) as SOCK_SEQPACKET messages carrying
+// descriptors with SCM_RIGHTS. The sockets stay open the whole time, so connections that arrive
+// during the swap wait in the backlog instead of being refused.
+//
+// The first process of a server stays alive once it handed over: its successors run in a process
+// group of their own, and it waits for them and forwards them its signals, so that a supervisor
+// watching it (docker, when it is PID 1) keeps the service up across upgrades.
+class Handoff {
+public:
+    enum class MessageType : char {
+        // Listening sockets, the payload names their roles separated by spaces
+        Listeners = 'L',
+        // Chunk of the token table, "<uuid> <service_name> <port> <time_remaining>" lines
+        Tokens = 'T',
+        // A live tunnel session, its client and instance sockets
+        Session = 'S',
+        // End of the state sent before the new process starts serving
+        Done = 'D',
+        // From the new process: it is serving
+        Ready = 'R'
+    };
+
+    struct Message {
+        MessageType type;
+        std::string payload;
+        // Close-on-exec, owned by the receiver
+        std::vector<int> fds;
+    };
+
+    // Largest payload of a single message
+    static constexpr std::size_t MAX_PAYLOAD = 60000;
+
+    // Start the binary (empty: the path of the running executable) with the current environment
+    // and the other end of the channel in HANDOFF_FD. Returns nullptr on failure
+    static std::unique_ptr<Handoff> spawn(const std::string& binary);
+    // Once the server handed over and stopped: in the first process, close everything but the
+    // standard streams and wait until the successors are all gone, forwarding them SIGTERM, SIGINT,
+    // SIGHUP, SIGQUIT, SIGUSR1 and SIGUSR2. Returns the exit status of the last one, to exit with.
+    // Returns 0 right away in a successor, whose own successor is adopted by the first process
+    static int waitForSuccessors();
+    // In the new process, the channel to the process it replaces, nullptr when not started by spawn
+    static std::unique_ptr<Handoff> inherit();
+    ~Handoff();
+    Handoff(const Handoff&) = delete;
+    Handoff& operator=(const Handoff&) = delete;
+
+    // Thread-safe. False if the peer is gone or the payload is too large
+    bool send(MessageType type, const std::string& payload, const std::vector<int>& fds = {});
+    // Wait for the next message, false once the peer is gone or after the timeout (zero waits forever)
+    bool receive(Message& message, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+    // Process of the new binary, 0 in the new process
+    pid_t getPeer() const;
+    // Kill the new process and wait for it, when it failed to take over
+    void terminate();
+
+    // Descriptors of a Listeners message with the given role, in order
+    static std::vector<int> listeners(const Message& message, const std::string& role);
+
+private:
+    Handoff(int socket, pid_t peer);
+
+    int socket_;
+    pid_t peer_;
+    std::mutex send_mutex_;
+};
+
+#endif // HANDOFF_HPP
@@ -0,0 +1,55 @@
+#ifndef IO_CONTEXT_POOL_HPP
+#define IO_CONTEXT_POOL_HPP
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+
+enum class ExecutionMode {
+    // All the threads run a single shared io_context with a single acceptor
+    Shared,
+    // Every thread runs its own io_context with its own SO_REUSEPORT acceptor
+    PerCore
+};
+
+// Parse "shared" or "per_core" (anything else falls back to shared)
+ExecutionMode parse_execution_mode(const std::string& mode);
+
+// Cancel the pending accept of the acceptor from its strand and wait for it. The socket stays
+// open, the connections that arrive from now on wait in its backlog
+void cancel_acceptor(boost::asio::ip::tcp::acceptor& acceptor);
+
+class IOContextPool {
+public:
+    // A number of threads equal to 0 means one thread per hardware core
+    IOContextPool(ExecutionMode mode, unsigned int num_threads = 0, bool pin_threads = false);
+    ~IOContextPool();
+    // Number of io_contexts owned by the pool
+    std::size_t size() const;
+    // Number of threads running the io_contexts
+    unsigned int getNumThreads() const;
+    // Execution mode of the pool
+    ExecutionMode getMode() const;
+    // Get the io_context at the given index
+    boost::asio::io_context& getIOContext(std::size_t index = 0);
+    // Create one listening acceptor per io_context bound to the given port, each with its own strand.
+    // Listening sockets inherited from a previous process are used first, spread over the io_contexts
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> createAcceptors(unsigned short port,
+                                                                                 const std::vector<int>& listen_fds = {});
+    // Start the threads
+    void run();
+    // Stop the io_contexts and wait for all the threads to finish
+    void stop();
+
+private:
+    void pinThread(std::thread& thread, unsigned int index);
+
+    ExecutionMode mode_;
+    unsigned int num_threads_;
+    bool pin_threads_;
+    std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts_;
+    std::vector<std::thread> threads_;
+};
+
+#endif // IO_CONTEXT_POOL_HPP
@@ -0,0 +1,229 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Informational messages go to stdout, errors to stderr
+enum class LogLevel : std::uint8_t { Info, Error };
+
+// Structured field of a message, printed as " key=value" after its text
+struct LogField {
+    LogField(const char* field_key, std::string_view field_value) : key(field_key), text(field_value) {}
+    template <typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+    LogField(const char* field_key, Integer field_value)
+        : key(field_key), number(static_cast<std::int64_t>(field_value)), is_number(true) {}
+
+    const char* key;
+    std::string_view text;
+    std::int64_t number = 0;
+    bool is_number = false;
+};
+
+// Asynchronous logger. Every thread formats its messages into a ring buffer of its own, without
+// locking or allocating, and a background thread drains the rings every few milliseconds and
+// writes the messages in the order they were logged. A message is the concatenation of its parts,
+// strings and integers, followed by its fields.
+//
+// Messages with the same text (the fields left aside) are rate limited: past the limit within a
+// second, they are counted and summed up in one line instead. When the ring of a thread is full,
+// its messages are dropped and counted as well, the workers never wait for the output.
+class Logger {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Longest message, longer ones are truncated
+    static constexpr std::size_t MAX_MESSAGE = 480;
+    // Messages a thread can queue before they are drained
+    static constexpr std::size_t RING_SIZE = 256;
+
+    struct Record {
+        Clock::time_point time;
+        LogLevel level;
+        // Size of the text, then of the text and the fields
+        std::uint16_t text_size;
+        std::uint16_t size;
+        std::array<char, MAX_MESSAGE> data;
+    };
+
+    static Logger& get();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    template <typename... Parts>
+    void log(LogLevel level, const Parts&... parts) {
+        Record* record;
+        Record local;
+        Ring* ring = nullptr;
+        // The background thread doesn't exist in a forked child, it writes its messages itself
+        if (forked_.load(std::memory_order_relaxed)) {
+            record = &local;
+        } else {
+            ring = &threadRing();
+            record = ring->reserve();
+            if (!record) {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        record->time = Clock::now();
+        record->level = level;
+        record->size = 0;
+        record->text_size = 0;
+        bool fields = false;
+        (append(*record, fields, parts), ...);
+        if (!fields) {
+            record->text_size = record->size;
+        }
+        if (ring) {
+            ring->publish();
+        } else {
+            writeNow(*record);
+        }
+    }
+    // Messages with the same text printed per second, 0 disables the limit
+    void setRateLimit(std::size_t per_second);
+    // Wait until everything logged so far was written
+    void flush();
+
+private:
+    // Single producer, single consumer ring of records
+    class Ring {
+    public:
+        Record* reserve() {
+            std::size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) == RING_SIZE) {
+                return nullptr;
+            }
+            return &records_[tail % RING_SIZE];
+        }
+        void publish() {
+            tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        // Consumer side, calls the function with every published record
+        template <typename Function>
+        void drain(Function&& function) {
+            std::size_t head = head_.load(std::memory_order_relaxed);
+            std::size_t tail = tail_.load(std::memory_order_acquire);
+            for (; head != tail; ++head) {
+                function(records_[head % RING_SIZE]);
+            }
+            head_.store(head, std::memory_order_release);
+        }
+        bool empty() const {
+            return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+        std::atomic<std::uint64_t> dropped{0};
+        // Set when the thread owning the ring exits
+        std::atomic<bool> closed{false};
+
+    private:
+        alignas(64) std::atomic<std::size_t> head_{0};
+        alignas(64) std::atomic<std::size_t> tail_{0};
+        std::array<Record, RING_SIZE> records_;
+    };
+
+    // A message drained from a ring
+    struct Entry {
+        Clock::time_point time;
+        LogLevel level;
+        std::string text;
+        std::size_t text_size;
+    };
+
+    // Rate limit of the messages sharing a text
+    struct Window {
+        Clock::time_point start;
+        LogLevel level;
+        std::size_t count = 0;
+        std::size_t suppressed = 0;
+    };
+
+    Logger();
+    Ring& threadRing();
+    void run();
+    // Drain the rings and write their messages, then the summaries of the windows that ended
+    void drain(std::vector<std::shared_ptr<Ring>>& rings, bool flushing);
+    void writeNow(const Record& record);
+
+    static void append(Record& record, std::string_view text) {
+        std::size_t length = std::min(text.size(), MAX_MESSAGE - record.size);
+        text.copy(record.data.data() + record.size, length);
+        record.size += static_cast<std::uint16_t>(length);
+    }
+    static void append(Record& record, bool& /*fields*/, std::string_view text) {
+        append(record, text);
+    }
+    static void append(Record& record, bool& fields, const char* text) {
+        append(record, fields, std::string_view(text));
+    }
+    static void append(Record& record, bool& fields, const std::string& text) {
+        append(record, fields, std::string_view(text));
+    }
+    static void append(Record& record, bool& fields, char character) {
+        append(record, fields, std::string_view(&character, 1));
+    }
+    template <typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+    static void append(Record& record, bool& /*fields*/, Integer number) {
+        char* begin = record.data.data() + record.size;
+        auto result = std::to_chars(begin, record.data.data() + MAX_MESSAGE, number);
+        if (result.ec == std::errc()) {
+            record.size += static_cast<std::uint16_t>(result.ptr - begin);
+        }
+    }
+    static void append(Record& record, bool& fields, const LogField& field) {
+        if (!fields) {
+            record.text_size = record.size;
+            fields = true;
+        }
+        // Fields that are not known yet, like the token of a session still authenticating, are left out
+        if (!field.is_number && field.text.empty()) {
+            return;
+        }
+        append(record, " ");
+        append(record, field.key);
+        append(record, "=");
+        if (field.is_number) {
+            append(record, fields, field.number);
+        } else {
+            append(record, field.text);
+        }
+    }
+
+    std::atomic<bool> forked_;
+    std::atomic<std::size_t> rate_limit_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_condition_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+    // Whether the background thread is running
+    bool started_;
+    std::uint64_t flush_requests_;
+    std::uint64_t flushed_;
+    // Used by the background thread only
+    std::unordered_map<std::string, Window> windows_;
+};
+
+template <typename... Parts>
+void log_info(const Parts&... parts) {
+    Logger::get().log(LogLevel::Info, parts...);
+}
+
+template <typename... Parts>
+void log_error(const Parts&... parts) {
+    Logger::get().log(LogLevel::Error, parts...);
+}
+
+#endif // LOGGER_HPP
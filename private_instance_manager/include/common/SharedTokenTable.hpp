@@ -0,0 +1,70 @@
+#ifndef SHARED_TOKEN_TABLE_HPP
+#define SHARED_TOKEN_TABLE_HPP
+
+#include <boost/uuid/uuid.hpp>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+// Token table published by the API server in a POSIX shared memory segment, so that co-located
+// tunnel servers can resolve tokens without a TCP round-trip. It is an open-addressing table of
+// fixed-size records, each protected by a seqlock: there is a single writer (the API server,
+// under its tokens mutex) and any number of readers, whose lookups never block and do a bounded
+// amount of work. Readers fall back to the API whenever a lookup is not conclusive.
+class SharedTokenTable {
+public:
+    // Longest service address that fits in a record
+    static constexpr std::size_t MAX_ADDRESS_LENGTH = 63;
+
+    struct Entry {
+        std::string address;
+        unsigned short port;
+        // Expiration time, in seconds since the UNIX epoch
+        std::int64_t expires_at;
+    };
+
+    // Create the segment for the writer, replacing any previous one with the same name. The tokens
+    // are credentials: the segment is only readable by the owner (0600), or by the group too
+    // (0640) when a group id is given, which must then be the group of the tunnel servers
+    static std::unique_ptr<SharedTokenTable> create(const std::string& name, std::uint32_t capacity, long group = -1);
+    // Map an existing segment read-only. Returns nullptr if it does not exist
+    static std::unique_ptr<SharedTokenTable> open(const std::string& name);
+    ~SharedTokenTable();
+    SharedTokenTable(const SharedTokenTable&) = delete;
+    SharedTokenTable& operator=(const SharedTokenTable&) = delete;
+
+    // Writer: insert or update a token. Fails if the table is too crowded or the address too long
+    bool put(const boost::uuids::uuid& uuid, const std::string& address, unsigned short port, std::int64_t expires_at);
+    // Writer: remove a token
+    void erase(const boost::uuids::uuid& uuid);
+    // Writer: tell the readers that the table is still maintained
+    void heartbeat();
+
+    // Reader: look a token up. nullopt means "not found or not sure", never "invalid token"
+    std::optional<Entry> lookup(const boost::uuids::uuid& uuid) const;
+    // Reader: whether the writer refreshed the heartbeat in the last max_age seconds
+    bool isAlive(std::int64_t max_age) const;
+
+private:
+    struct Header;
+    struct Slot;
+    struct Record;
+
+    SharedTokenTable(const std::string& name, void* memory, std::size_t size, bool writer);
+    Slot& slotAt(std::uint32_t index) const;
+    std::uint32_t homeSlot(const boost::uuids::uuid& uuid) const;
+    // Seqlock protected accesses to a slot
+    bool readRecord(const Slot& slot, Record& record) const;
+    void writeRecord(Slot& slot, const Record& record);
+
+    std::string name_;
+    void* memory_;
+    std::size_t size_;
+    bool writer_;
+    Header* header_;
+    Slot* slots_;
+};
+
+#endif // SHARED_TOKEN_TABLE_HPP
@@ -0,0 +1,50 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Hashed timing wheel driven by a single steady_timer. It replaces one timer per
+// entry with one timer per wheel, so thousands of sessions cost a vector slot each.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Called when an entry is due. Returns the next time it is due, or nullopt to drop it
+    using Callback = std::function<std::optional<Clock::time_point>()>;
+
+    TimerWheel(boost::asio::io_context& io_context, Clock::duration tick = std::chrono::seconds(1),
+               std::size_t num_slots = 512);
+    // Start ticking
+    void start();
+    // Stop ticking and drop all the entries
+    void stop();
+    // Schedule a callback to run at (or shortly after) the given time
+    void schedule(Clock::time_point when, Callback callback);
+    // Number of scheduled entries
+    std::size_t size();
+
+private:
+    struct Entry {
+        Clock::time_point when;
+        Callback callback;
+    };
+
+    void scheduleTick();
+    void onTick();
+    std::size_t slotFor(Clock::time_point when) const;
+
+    boost::asio::steady_timer timer_;
+    Clock::duration tick_;
+    Clock::time_point origin_;
+    // Number of ticks processed since origin_
+    std::uint64_t ticks_;
+    std::vector<std::vector<Entry>> slots_;
+    std::size_t size_;
+    std::mutex mutex_;
+};
+
+#endif // TIMER_WHEEL_HPP
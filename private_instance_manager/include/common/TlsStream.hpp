@@ -0,0 +1,130 @@
+#ifndef TLS_STREAM_HPP
+#define TLS_STREAM_HPP
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/ssl.h>
+#include <cstddef>
+#include <string>
+#include <utility>
+
+// Server side TLS configuration: certificate, session cache and session tickets, shared by every
+// connection so that clients can resume their sessions on any thread
+class TlsContext {
+public:
+    // Throws boost::system::system_error when the certificate or the key can't be loaded.
+    // With ktls, OpenSSL moves the record layer to the kernel when it supports the cipher
+    TlsContext(const std::string& certificate_file, const std::string& key_file, bool ktls, long session_cache_size = 20480);
+    SSL_CTX* nativeHandle();
+    bool ktls() const;
+
+private:
+    boost::asio::ssl::context context_;
+    bool ktls_;
+};
+
+// TLS over a TCP socket. Unlike Asio's ssl::stream, which encrypts into a memory BIO, OpenSSL reads
+// and writes the socket itself, so that it can hand the record layer over to the kernel (kTLS) once
+// the handshake is done. A direction offloaded to the kernel is plain socket I/O, the others retry
+// SSL_read and SSL_write whenever the socket is ready. At most one read and one write may be pending,
+// started from the same strand.
+class TlsStream {
+public:
+    using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+    explicit TlsStream(boost::asio::ip::tcp::socket& socket);
+    ~TlsStream();
+    TlsStream(const TlsStream&) = delete;
+    TlsStream& operator=(const TlsStream&) = delete;
+
+    // Start a new connection on the socket, false if OpenSSL fails
+    bool reset(TlsContext& context);
+    // Forget the connection
+    void clear();
+    executor_type get_executor();
+    // Send close_notify if the socket takes it right away
+    void shutdown();
+    // Directions handled by kernel TLS
+    bool kernelSend() const;
+    bool kernelReceive() const;
+    bool sessionReused() const;
+
+    template <typename Handler>
+    void async_handshake(Handler&& handler);
+    template <typename MutableBufferSequence, typename Handler>
+    void async_read_some(const MutableBufferSequence& buffers, Handler&& handler);
+    template <typename ConstBufferSequence, typename Handler>
+    void async_write_some(const ConstBufferSequence& buffers, Handler&& handler);
+
+private:
+    enum class Operation { Handshake, Read, Write };
+
+    // Outcome of one SSL call: done (bytes or error), or waiting for the socket
+    struct Attempt {
+        boost::system::error_code ec;
+        std::size_t bytes = 0;
+        bool wait = false;
+        boost::asio::socket_base::wait_type wait_type = boost::asio::socket_base::wait_read;
+    };
+
+    Attempt attempt(Operation operation, void* data, std::size_t size);
+    template <typename Handler>
+    void run(Operation operation, void* data, std::size_t size, Handler handler);
+
+    boost::asio::ip::tcp::socket& socket_;
+    SSL* ssl_;
+    bool kernel_send_;
+    bool kernel_receive_;
+};
+
+template <typename Handler>
+void TlsStream::run(Operation operation, void* data, std::size_t size, Handler handler) {
+    Attempt result = attempt(operation, data, size);
+    auto executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+    if (result.wait) {
+        socket_.async_wait(result.wait_type, boost::asio::bind_executor(executor,
+            [this, operation, data, size, handler = std::move(handler)](boost::system::error_code ec) mutable {
+                if (ec) {
+                    handler(ec, std::size_t(0));
+                    return;
+                }
+                run(operation, data, size, std::move(handler));
+            }));
+        return;
+    }
+    // Never complete from within the initiating function
+    boost::asio::post(executor, [handler = std::move(handler), result]() mutable {
+        handler(result.ec, result.bytes);
+    });
+}
+
+template <typename Handler>
+void TlsStream::async_handshake(Handler&& handler) {
+    auto executor = boost::asio::get_associated_executor(handler, socket_.get_executor());
+    run(Operation::Handshake, nullptr, 0, boost::asio::bind_executor(executor,
+        [handler = std::forward<Handler>(handler)](boost::system::error_code ec, std::size_t /*bytes*/) mutable {
+            handler(ec);
+        }));
+}
+
+template <typename MutableBufferSequence, typename Handler>
+void TlsStream::async_read_some(const MutableBufferSequence& buffers, Handler&& handler) {
+    if (kernel_receive_) {
+        socket_.async_read_some(buffers, std::forward<Handler>(handler));
+        return;
+    }
+    boost::asio::mutable_buffer buffer = *boost::asio::buffer_sequence_begin(buffers);
+    run(Operation::Read, buffer.data(), buffer.size(), std::forward<Handler>(handler));
+}
+
+template <typename ConstBufferSequence, typename Handler>
+void TlsStream::async_write_some(const ConstBufferSequence& buffers, Handler&& handler) {
+    if (kernel_send_) {
+        socket_.async_write_some(buffers, std::forward<Handler>(handler));
+        return;
+    }
+    boost::asio::const_buffer buffer = *boost::asio::buffer_sequence_begin(buffers);
+    run(Operation::Write, const_cast<void*>(buffer.data()), buffer.size(), std::forward<Handler>(handler));
+}
+
+#endif // TLS_STREAM_HPP
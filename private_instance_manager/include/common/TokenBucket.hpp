@@ -0,0 +1,40 @@
+#ifndef TOKEN_BUCKET_HPP
+#define TOKEN_BUCKET_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+// Lock-free token bucket implemented as a GCRA: the whole state is the theoretical
+// arrival time of the next byte, updated with a single compare-and-swap. Bytes are
+// charged after they have been transferred, and the returned delay is the time the
+// caller must wait before transferring more.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A rate of 0 bytes per second means unlimited
+    TokenBucket(std::uint64_t rate = 0, std::uint64_t burst = 0);
+    // Change the rate (bytes per second) and the burst size (bytes)
+    void setRate(std::uint64_t rate, std::uint64_t burst);
+    // Follow a rate shared with other buckets instead of its own, must be set before the bucket is used
+    void shareRate(std::shared_ptr<const std::atomic<std::uint64_t>> rate);
+    std::uint64_t getRate() const;
+    bool isUnlimited() const;
+    // Charge the given number of bytes. Returns how long to wait before the next transfer
+    Clock::duration charge(std::size_t bytes, Clock::time_point now = Clock::now());
+    // Charge the bytes only if they fit in the budget now, for traffic that is dropped rather than delayed
+    bool tryCharge(std::size_t bytes, Clock::time_point now = Clock::now());
+
+private:
+    std::uint64_t currentRate() const;
+
+    std::atomic<std::uint64_t> rate_;
+    std::shared_ptr<const std::atomic<std::uint64_t>> shared_rate_;
+    std::atomic<std::uint64_t> burst_;
+    // Theoretical arrival time in nanoseconds since the clock epoch
+    std::atomic<std::int64_t> tat_;
+};
+
+#endif // TOKEN_BUCKET_HPP
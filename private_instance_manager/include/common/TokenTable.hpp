@@ -0,0 +1,76 @@
+#ifndef TOKEN_TABLE_HPP
+#define TOKEN_TABLE_HPP
+
+#include <boost/uuid/uuid.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "common/AddressInterner.hpp"
+
+// Compact record of a live token: 28 bytes, no heap allocation
+struct TokenRecord {
+    std::uint8_t uuid[16];
+    // Id of the service address in the table's interner
+    std::uint32_t address_id;
+    std::uint16_t port;
+    std::uint16_t state;
+    // Expiration, in seconds on the table's monotonic clock
+    std::uint32_t deadline;
+};
+
+// Flat open-addressing (linear probing) table of the live tokens, keyed by the raw UUID.
+// Lookups don't allocate. The table doubles when it is three quarters full, so that 1M
+// tokens fit in 2M slots (about 56MB). Not thread-safe, the API server holds its tokens mutex.
+class TokenTable {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenTable(std::size_t initial_capacity = 1024);
+
+    // Insert a token expiring in ttl seconds. False if the token already exists
+    bool insert(const boost::uuids::uuid& uuid, const std::string& address, unsigned short port, long ttl);
+    // The token record, or nullptr. Expired tokens are returned until they are removed
+    const TokenRecord* find(const boost::uuids::uuid& uuid) const;
+    TokenRecord* find(const boost::uuids::uuid& uuid);
+    bool erase(const boost::uuids::uuid& uuid);
+    // Remove the tokens whose deadline has passed, calling on_remove for each of them first
+    std::size_t removeExpired(const std::function<void(const TokenRecord&)>& on_remove = nullptr);
+    // Visit up to limit tokens from the cursor, in hash order, and return the cursor of the next
+    // call (0 once the whole table has been visited, start from 0 too). The cursor is a position in
+    // the hash space rather than a slot, so it stays valid across inserts, removals and rehashes:
+    // a token present during the whole iteration is visited at least once. A call looks at a number
+    // of slots bounded by the limit, so it may visit fewer tokens, even none, before the end.
+    std::uint64_t scan(std::uint64_t cursor, std::size_t limit, const std::function<void(const TokenRecord&)>& callback) const;
+
+    const std::string& getAddress(const TokenRecord& record) const;
+    // Seconds left before the token expires, zero or negative once it has expired
+    long timeRemaining(const TokenRecord& record) const;
+    // Move the deadline of the token so that it expires in ttl seconds
+    void setTimeRemaining(TokenRecord& record, long ttl) const;
+    std::size_t size() const;
+    std::size_t capacity() const;
+    // Hash of the 16 bytes of a token, well spread even for tokens chosen by the clients
+    static std::uint64_t hashOf(const std::uint8_t* uuid);
+
+private:
+    std::uint32_t now() const;
+    // Slots are indexed by the top bits of the hash, so that the slot order is the hash order
+    std::size_t homeSlot(std::uint64_t hash) const;
+    std::size_t findSlot(const boost::uuids::uuid& uuid) const;
+    void eraseSlot(std::size_t index);
+    void rehash(std::size_t capacity);
+
+    // Start of the monotonic clock of the deadlines
+    Clock::time_point epoch_;
+    std::vector<TokenRecord> slots_;
+    // 64 - log2(capacity)
+    unsigned shift_;
+    std::size_t size_;
+    // Tombstones count as used slots for the load factor
+    std::size_t tombstones_;
+    AddressInterner addresses_;
+};
+
+#endif // TOKEN_TABLE_HPP
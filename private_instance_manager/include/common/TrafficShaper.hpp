@@ -0,0 +1,69 @@
+#ifndef TRAFFIC_SHAPER_HPP
+#define TRAFFIC_SHAPER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "common/TokenBucket.hpp"
+
+// Rate limit and byte counters shared by all the sessions opened with the same token
+struct TokenUsage {
+    TokenBucket bucket;
+    std::atomic<std::uint64_t> bytes_up{0};
+    std::atomic<std::uint64_t> bytes_down{0};
+    std::atomic<std::uint32_t> sessions{0};
+    // Expiry of the token, after which an unused entry is dropped
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// Copy of the counters of a token
+struct TokenUsageSnapshot {
+    std::uint64_t bytes_up;
+    std::uint64_t bytes_down;
+    std::uint32_t sessions;
+    std::uint64_t rate;
+};
+
+// Bandwidth limits applied to every session and to every token. The registry is only locked
+// when sessions are opened and closed, the per-chunk accounting is done with atomics.
+class TrafficShaper {
+public:
+    // Rates are in bytes per second and 0 means unlimited. With a global rate the bandwidth is
+    // shared fairly among the tokens with open sessions, capped by the per-token rate.
+    TrafficShaper(std::uint64_t session_rate, std::uint64_t token_rate, std::uint64_t global_rate,
+                  std::uint64_t burst = 64 * 1024);
+    // Register a new session of the token, the entry lives at least until the deadline
+    std::shared_ptr<TokenUsage> acquire(const std::string& token, std::chrono::steady_clock::time_point deadline);
+    // Unregister a session of the token
+    void release(const std::string& token);
+    // Counters of the token, if it is known
+    std::optional<TokenUsageSnapshot> getUsage(const std::string& token);
+    // Sum of the counters of all the known tokens
+    TokenUsageSnapshot getTotalUsage();
+    // Bucket configuration for a new session
+    std::uint64_t getSessionRate() const;
+    std::uint64_t getBurst() const;
+
+private:
+    // Recompute the fair share followed by the active tokens, must hold mutex_
+    void rebalance();
+    // Drop the expired tokens without sessions, must hold mutex_
+    void prune();
+
+    std::uint64_t session_rate_;
+    std::uint64_t token_rate_;
+    std::uint64_t global_rate_;
+    std::uint64_t burst_;
+    std::unordered_map<std::string, std::shared_ptr<TokenUsage>> tokens_;
+    std::size_t active_tokens_;
+    // Rate of every token when there is a global rate
+    std::shared_ptr<std::atomic<std::uint64_t>> fair_share_;
+    std::chrono::steady_clock::time_point last_prune_;
+    std::mutex mutex_;
+};
+
+#endif // TRAFFIC_SHAPER_HPP
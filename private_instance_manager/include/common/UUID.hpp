@@ -9,7 +9,7 @@
 
 class UUID {
 public:
-    // Default constructor generates a new UUID
+    // Default constructor generates a new random UUID (version 4), from a per-thread batch
     UUID();
     // Constructor that accepts an existing boost::uuids::uuid
     explicit UUID(const boost::uuids::uuid& uuid);
@@ -0,0 +1,49 @@
+#ifndef ZYGOTE_HPP
+#define ZYGOTE_HPP
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/types.h>
+
+// Template process that forks the bash instances. It is started once, before the server starts
+// its threads, and initialized once: with a template library, the library is loaded and its
+// pim_template_init() is called in the zygote, then every instance is a fork of the zygote
+// running pim_template_run() and sharing the initialized memory copy-on-write. Without one,
+// every instance is a fork of the small zygote exec'ing the command.
+class Zygote {
+public:
+    // A process forked by the zygote. The instance's stdout is readable on stdout_fd, and
+    // pidfd refers to the process (-1 if the kernel has no pidfd support)
+    struct Instance {
+        pid_t pid;
+        int pidfd;
+        int stdout_fd;
+    };
+
+    // Fork the zygote. Must be called before any thread is started. Returns nullptr on failure
+    static std::unique_ptr<Zygote> start(const std::string& command, const std::string& template_library = "");
+    ~Zygote();
+    Zygote(const Zygote&) = delete;
+    Zygote& operator=(const Zygote&) = delete;
+
+    // Fork a new instance running with the given user and group. A listen_fd is handed to the
+    // instance as fd 3, announced with LISTEN_FDS/LISTEN_PID. With a cgroup_fd (cgroup.procs of
+    // the instance's cgroup), the instance joins the cgroup before dropping its privileges
+    std::optional<Instance> spawn(uid_t user_id, gid_t group_id, int listen_fd = -1, int cgroup_fd = -1);
+    // Kill the instance, wait for it to exit and close its descriptors
+    static void terminate(Instance& instance);
+
+private:
+    Zygote(pid_t pid, int socket);
+    // Main loop of the zygote process, never returns
+    [[noreturn]] static void serve(int socket, const std::string& command, const std::string& template_library);
+
+    pid_t pid_;
+    // SOCK_SEQPACKET socket to the zygote, one request at a time
+    int socket_;
+    std::mutex mutex_;
+};
+
+#endif // ZYGOTE_HPP
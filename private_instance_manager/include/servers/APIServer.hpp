@@ -10,30 +10,67 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <string>
 #include <memory>
+#include <atomic>
 
-// Assuming UUID and NetworkInfo are defined appropriately
+// Assuming UUID and TokenTable are defined appropriately
 #include "common/UUID.hpp"
-#include "common/NetworkInfo.hpp"
+#include "common/TokenTable.hpp"
+#include "common/Handoff.hpp"
+#include "common/IOContextPool.hpp"
+#include "common/SharedTokenTable.hpp"
 
 enum class StatusCode {
     OK = 200,
     BadRequest = 400,
     NotFound = 404,
+    Conflict = 409,
     Gone = 410,
     InternalServerError = 500
 };
 
+// Settings of an API server
+struct APIServerConfig {
+    unsigned short port = 4001;
+    // Lifetime of the tokens, and the longest one a client can ask for (0: the default lifetime)
+    long timeout_seconds = 30;
+    long max_ttl = 0;
+    // Seconds between two sweeps of the expired tokens
+    long cleanup_interval = 10;
+    unsigned short num_threads = 0;
+    ExecutionMode mode = ExecutionMode::Shared;
+    bool pin_threads = false;
+    // Server receiving a copy of every change to the tokens, none when the address is empty
+    std::string replica_address;
+    unsigned short replica_port = 0;
+    // Token table published in shared memory for a co-located tunnel server, none when the name is
+    // empty. The group allowed to read it (-1: the user of the server only)
+    std::string token_table_name;
+    std::uint32_t token_table_capacity = 65536;
+    long token_table_group = -1;
+    // Listening sockets handed over by the previous process, used instead of the port when set
+    std::vector<int> listen_fds;
+};
+
 class APIServer : public std::enable_shared_from_this<APIServer> {
 public:
-    APIServer(unsigned short port, long timeout_seconds, long cleanup_interval = 10, unsigned short num_threads = 0);
+    explicit APIServer(const APIServerConfig& config);
     void start();
     void stop();
+    // Hand the listening sockets and the tokens over to a new process running the binary. The
+    // connections wait in the backlog of the sockets until it serves them. False if the new process
+    // didn't take over, the server keeps serving then
+    bool upgrade(const std::string& binary);
+    // Insert the tokens of a Tokens message from the previous process, before start(). Returns
+    // the number of tokens restored
+    std::size_t restoreTokens(const std::string& lines);
 
 private:
     // Networking Methods
-    void doAccept();
+    void doAccept(boost::asio::ip::tcp::acceptor& acceptor);
     void handleRequest(boost::asio::ip::tcp::socket socket);
     void scheduleTokenCleanup();
 
@@ -41,26 +78,67 @@ private:
     std::string processCommand(const std::string& command);
     std::string addService(std::stringstream& ss);
     std::string getInfo(std::stringstream& ss);
+    std::string putService(std::stringstream& ss);
+    std::string extendService(std::stringstream& ss);
+    std::string revokeService(std::stringstream& ss);
+    // LIST [cursor] [limit]: stream the tokens in batches, each batch read under the lock
+    void listTokens(std::shared_ptr<boost::asio::ip::tcp::socket> socket, std::stringstream& ss);
+    void sendListBatch(std::shared_ptr<boost::asio::ip::tcp::socket> socket, std::uint64_t cursor, std::size_t remaining);
+
+    // Replication of the token changes to the read replica
+    enum class ReplicationAction {
+        Put,
+        Extend,
+        Revoke
+    };
+    void replicate(ReplicationAction action, const UUID& uuid, const std::string& address = "", unsigned short port = 0,
+                   long seconds = 0);
+    void runReplication();
 
     // Token Management
     void removeExpiredTokens();
+    // Mirror a token in the shared memory table, must be called with the tokens mutex held
+    void publishToken(const UUID& uuid, const std::string& address, unsigned short port, long time_remaining);
 
     // Helper Methods
     std::string statusMessage(StatusCode code);
 
     // Attributes
     unsigned short port_;
+    // Default lifetime of a token, and longest lifetime a token can be given or extended to
     long timeout_seconds_;
+    long max_ttl_;
     long cleanup_interval_;
-    boost::asio::io_context io_context_;
-    boost::asio::ip::tcp::acceptor acceptor_;
+    // Thread pool running the io_contexts, one acceptor per io_context
+    IOContextPool pool_;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors_;
+    // Set while the listening sockets are handed over to a new process
+    std::atomic<bool> draining_;
+    // Connections accepted and not closed yet
+    std::atomic<std::size_t> active_requests_;
     std::shared_ptr<boost::asio::deadline_timer> cleanup_timer_;
-    // Shared map to store tokens and network information
-    std::unordered_map<UUID, NetworkInfo> tokens_;
+    // Shared table of the tokens and the instances they give access to
+    TokenTable tokens_;
     std::mutex tokens_mutex_;
-    // Thread pool
-    unsigned short num_threads_;
-    std::vector<std::thread> threads_;
+    // Copy of the tokens in shared memory for the co-located tunnel servers, written under tokens_mutex_
+    std::unique_ptr<SharedTokenTable> token_table_;
+    // Read replica receiving the changes of the tokens, from a dedicated thread
+    std::string replica_address_;
+    unsigned short replica_port_;
+    struct Replication {
+        ReplicationAction action;
+        std::string uuid;
+        std::string address;
+        unsigned short port;
+        std::chrono::steady_clock::time_point deadline;
+        // Seconds added to the token by EXTEND
+        long extension;
+    };
+    std::deque<Replication> replication_queue_;
+    std::mutex replication_mutex_;
+    std::condition_variable replication_cv_;
+    bool replication_stopped_;
+    std::thread replication_thread_;
 };
 
 #endif // APISERVER_HPP
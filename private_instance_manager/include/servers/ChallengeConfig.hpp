@@ -0,0 +1,49 @@
+#ifndef CHALLENGE_CONFIG_HPP
+#define CHALLENGE_CONFIG_HPP
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "common/Cgroup.hpp"
+
+enum class CommandType {
+    Docker,
+    Bash
+};
+
+// Settings of a challenge served by the instances server, on a port of its own
+struct ChallengeConfig {
+    // Name used in the logs
+    std::string name;
+    unsigned short port = 0;
+    CommandType cmd_type = CommandType::Docker;
+    // Launch command of the instances: formatted with the port (%d) and the token (%s) for docker
+    std::string command;
+    long timeout = 30;
+    // Where the users reach their instance, through the tunnel
+    std::string challenge_address;
+    std::string challenge_port;
+    bool ssl = false;
+    // Live instances of the challenge at most, 0 for unlimited
+    unsigned int max_instances = 0;
+    long ready_timeout = 10;
+    bool pass_listen_fd = false;
+    bool zygote = false;
+    std::string zygote_template;
+    // Limits of every bash instance, unlimited when all are 0
+    CgroupLimits limits;
+    // Resets a docker instance to a clean state, formatted with its name (%s). When set, the
+    // instances of a user are reset and kept for the next users instead of being stopped
+    std::string recycle_command;
+    // Reset instances kept ready for the next users at most
+    unsigned int recycle_pool = 10;
+};
+
+// Read the challenges of a config file. Every challenge is a section named after it, followed by
+// KEY=value lines taking the names of the environment variables of a single challenge
+// (SERVER_PORT, DOCKER_COMMAND or BASH_COMMAND, TIMEOUT, ...). Settings left out of a section are
+// taken from the defaults. Lines starting with '#' or ';' are comments. Returns nullopt with the
+// reason logged when the file can't be read or a challenge is invalid
+std::optional<std::vector<ChallengeConfig>> load_challenges(const std::string& path, const ChallengeConfig& defaults);
+
+#endif // CHALLENGE_CONFIG_HPP
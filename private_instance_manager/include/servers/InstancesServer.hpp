@@ -2,49 +2,148 @@
 #define INSTANCESSERVER_HPP
 
 #include <boost/asio.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "clients/APIClient.hpp"
+#include "common/IOContextPool.hpp"
+#include "backends/InstanceScheduler.hpp"
+#include "common/Zygote.hpp"
+#include "common/Cgroup.hpp"
+#include "servers/ChallengeConfig.hpp"
 
-enum class CommandType {
-    Docker,
-    Bash
+// A challenge served by the instances server, with what its instances need
+struct Challenge {
+    ChallengeConfig config;
+    // Forks the bash instances when set, instead of spawning the command from the server
+    std::shared_ptr<Zygote> zygote;
+    // Creates the cgroup of every bash instance when set
+    std::shared_ptr<CgroupManager> cgroups;
 };
 
+// Serves several challenges, each on its own port. The docker backends, the port allocation and
+// the API clients are shared by all of them
 class InstancesServer : public std::enable_shared_from_this<InstancesServer> {
 public:
-    InstancesServer(unsigned short port, std::string& api_address, unsigned short api_port, long timeout, 
-        std::string& instance_address, std::string& command, std::string& challenge_address, 
-        std::string& challenge_port, bool ssl, CommandType cmd_type, unsigned int user_id, unsigned int group_id, unsigned int num_threads = 0);
+    InstancesServer(std::vector<Challenge> challenges, std::string& api_address, unsigned short api_port,
+        std::string& instance_address, unsigned int user_id, unsigned int group_id, unsigned int num_threads = 0,
+        ExecutionMode mode = ExecutionMode::Shared, bool pin_threads = false,
+        std::shared_ptr<InstanceScheduler> scheduler = nullptr, long reconcile_interval = 60);
     void start();
     void stop();
 
 private:
+    // Port, time remaining and service name of a token, as returned by the API
+    using TokenInfo = std::optional<std::tuple<unsigned short, long, std::string>>;
+
+    // A recycled docker instance, named after the token of its next user
+    struct ReadyInstance {
+        std::shared_ptr<InstanceBackend> backend;
+        unsigned short port;
+        std::string token;
+    };
+
+    // A challenge with its acceptors and the count of its live instances
+    struct ChallengePool {
+        Challenge challenge;
+        std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+        std::atomic<unsigned int> live_instances{0};
+        // Recycled instances waiting for a user, they keep their slot on their backend and count in
+        // live_instances until they are stopped
+        std::mutex ready_mutex;
+        std::vector<ReadyInstance> ready;
+    };
+
     // Method to handle client connections
-    void doAccept();
-    void handleClient(boost::asio::ip::tcp::socket client_socket);
-    void runDockerCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket);
-    void runBashCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket);
+    void doAccept(boost::asio::ip::tcp::acceptor& acceptor, ChallengePool& pool);
+    void handleClient(boost::asio::ip::tcp::socket client_socket, ChallengePool& pool);
+    // Take a slot for a new instance of the challenge, fails if it has max_instances already
+    static bool tryReserve(ChallengePool& pool);
+    // Give the slot back when the instance is torn down
+    static std::function<bool()> releasing(ChallengePool& pool, std::function<bool()> teardown);
+    void runDockerCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool);
+    // Hand the docker instance out once it runs and accepts connections
+    void serveLaunched(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+                       std::shared_ptr<InstanceBackend> backend, unsigned short port, std::shared_ptr<std::string> token);
+    void runBashCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool);
+    // Wait asynchronously for the bash instance to print its port on stdout, unless the port is known
+    void waitForReadiness(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool, int stdout_fd,
+                          unsigned short port, std::function<bool()> teardown, std::shared_ptr<Cgroup> cgroup);
+    void registerBashInstance(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+                              unsigned short port, std::function<bool()> teardown, std::shared_ptr<Cgroup> cgroup);
+    // Message handing the token and the address of the instance out to the user
+    static std::string instanceMessage(const ChallengeConfig& challenge, const std::string& token, bool with_stats);
+    // Connect to the instance until it is served, with a backoff, for at most ready_timeout seconds.
+    // done(true) is called once the instance is ready, done(false) at the deadline
+    void probeReadiness(boost::asio::any_io_executor executor, const std::string& address, unsigned short port,
+                        long ready_timeout, std::function<void(bool)> done);
+    // Run a command of the backends, which forks and waits on docker, on the blocking threads, then
+    // done(result) on the executor
+    void runBlocking(boost::asio::any_io_executor executor, std::function<bool()> command, std::function<void(bool)> done);
+    std::function<bool()> dockerTeardown(std::shared_ptr<InstanceBackend> backend, std::shared_ptr<std::string> token);
+    // Teardown of the instances of a challenge with a recycle command: the instance is reset and
+    // renamed after a new token, and kept for the next user once it is ready again. It is stopped
+    // instead when the reset fails or when the challenge has enough instances waiting, and only then
+    // gives its slot of the challenge back
+    std::function<bool()> recycleTeardown(ChallengePool& pool, std::shared_ptr<InstanceBackend> backend,
+                                          unsigned short port, std::shared_ptr<std::string> token);
+    bool recycleInstance(ChallengePool& pool, std::shared_ptr<InstanceBackend> backend, unsigned short port,
+                         const std::string& token);
+    // Take a recycled instance of the challenge, if one is waiting. It holds its slot already
+    static std::optional<ReadyInstance> takeReady(ChallengePool& pool);
+    // Register the token of a recycled instance and hand it out to the user
+    void serveRecycled(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+                       ReadyInstance instance);
+    // Docker instances supervised by this server, by token
+    bool trackInstance(const std::string& token);
+    void untrackInstance(const std::string& token);
+    bool isTracked(const std::string& token);
+    // Adopt the running docker instances whose token is still valid and reap the others
+    void reconcileInstances();
+    void scheduleReconciliation();
+    // Keep the instance alive while its token is valid. The instance is torn down when the token
+    // expires or is revoked, or when the user sends "stop". The client socket is null for adopted instances.
+    // An instance with a cgroup is also torn down when it goes over its limits or exits
+    void superviseInstance(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket,
+                           std::shared_ptr<std::string> token, long timeout, std::function<bool()> teardown,
+                           std::shared_ptr<Cgroup> cgroup = nullptr);
+    // The tokens of the supervised instances are looked up by a single thread, one after the other
+    // every TOKEN_CHECK_INTERVAL seconds, and on_info is called with the answer of the API
+    void watchToken(const std::string& token, std::function<void(TokenInfo)> on_info);
+    void unwatchToken(const std::string& token);
+    void runTokenChecks();
 
 
     // Attributes
-    unsigned short port_;
     std::string api_address_;
     unsigned short api_port_;
-    long timeout_;
-    boost::asio::io_context io_context_;
-    boost::asio::ip::tcp::acceptor acceptor_;
+    // Thread pool running the io_contexts, one acceptor per io_context and challenge
+    IOContextPool pool_;
+    // Never resized once the server is built, the handlers refer to the pools
+    std::vector<std::unique_ptr<ChallengePool>> challenges_;
     std::string instance_address_;
-    std::string command_;
-    std::string challenge_address_;
-    std::string challenge_port_;
-    bool ssl_;
     uid_t user_id_;
     gid_t group_id_;
-    // Command to run
-    std::function<void(std::shared_ptr<boost::asio::ip::tcp::socket>)> run_command;
-    // Thread pool
-    unsigned int num_threads_;
-    std::vector<std::thread> threads_;
+    // Backends running the docker instances of every challenge
+    std::shared_ptr<InstanceScheduler> scheduler_;
+    std::mutex instances_mutex_;
+    std::unordered_set<std::string> instances_;
+    // Seconds between two looks for orphaned docker instances (0 only looks at startup)
+    long reconcile_interval_;
+    std::shared_ptr<boost::asio::steady_timer> reconcile_timer_;
+    // Token checks of the supervised instances
+    std::unordered_map<std::string, std::function<void(TokenInfo)>> token_checks_;
+    std::mutex token_checks_mutex_;
+    std::condition_variable token_checks_cv_;
+    bool token_checks_stopped_;
+    std::thread token_check_thread_;
+    // Threads running the backend commands and the teardowns, away from the io threads
+    boost::asio::thread_pool blocking_pool_;
 };
 
 #endif // INSTANCESSERVER_HPP
\ No newline at end of file
@@ -0,0 +1,97 @@
+#ifndef MUX_SESSION_HPP
+#define MUX_SESSION_HPP
+
+#include <boost/asio.hpp>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "servers/TunnelSession.hpp"
+
+// Multiplexed tunnel connection: a single authenticated client connection carries many logical
+// streams, each one forwarded to its own connection to the instance.
+//
+// Every frame starts with a 7 byte header: the stream id (4 bytes, big endian), the frame type
+// (1 byte) and the payload length (2 bytes, big endian), followed by the payload.
+//  * OPEN: the client opens a stream with a new id, no payload
+//  * DATA: bytes of a stream, in either direction
+//  * CLOSE: the sender won't send anything more on the stream. The tunnel sends it when the instance
+//    closes the connection, or to refuse an OPEN. The stream is gone once both sides closed it
+//
+// Upstream frames are handled one at a time, reading pauses while a payload is written to the
+// instance, and while the CLOSE refusing an OPEN waits for the client. Downstream, every stream has at
+// most one frame queued for the client. An OPEN for an id that is still in use is a protocol error.
+class MuxSession : public std::enable_shared_from_this<MuxSession> {
+public:
+    enum class FrameType : std::uint8_t { Open = 0, Data = 1, Close = 2 };
+    static constexpr std::size_t HEADER_SIZE = 7;
+    static constexpr std::size_t MAX_PAYLOAD = 65535;
+
+    // Streams of the session are connected to the endpoints of the instance. spare_connections
+    // connections are kept open in advance, so that opening a stream doesn't wait for a connect
+    MuxSession(std::shared_ptr<TunnelSession> session, boost::asio::ip::tcp::resolver::results_type endpoints,
+               std::size_t max_streams, std::size_t spare_connections);
+    // Start serving the frames of the client. Must run on the strand of the session
+    void start();
+
+private:
+    struct Stream {
+        std::uint32_t id;
+        boost::asio::ip::tcp::socket socket;
+        // Header and payload of the next DATA frame for the client
+        std::array<char, HEADER_SIZE + MAX_PAYLOAD> frame;
+        std::size_t frame_size = 0;
+        // Wait imposed by the shaper once the frame is out
+        TunnelSession::Clock::duration delay{};
+        boost::asio::steady_timer throttle_timer;
+        bool client_closed = false;
+        bool instance_closed = false;
+        Stream(std::uint32_t stream_id, boost::asio::ip::tcp::socket stream_socket);
+    };
+
+    // Frame waiting for the client: the DATA frame of a stream, or a CLOSE
+    struct Outgoing {
+        std::shared_ptr<Stream> stream;
+        std::array<char, HEADER_SIZE> header{};
+        bool data = false;
+    };
+
+    void readHeader();
+    void readPayload(std::uint32_t stream_id, FrameType type, std::size_t length);
+    void handleFrame(std::uint32_t stream_id, FrameType type, std::size_t length);
+    void openStream(std::uint32_t stream_id);
+    void writeToInstance(std::shared_ptr<Stream> stream, std::size_t length);
+    void closeFromClient(std::shared_ptr<Stream> stream);
+    // Continue with the next frame of the client, once the shaper allows it
+    void resume(TunnelSession::Clock::duration delay);
+    void readInstance(std::shared_ptr<Stream> stream);
+    void sendClose(std::uint32_t stream_id);
+    void enqueue(Outgoing outgoing);
+    void writeToClient();
+    // Continue with the next frame of the client once every queued frame is written
+    void resumeAfterFlush();
+    // Forget the stream once both sides are done with it
+    void release(std::shared_ptr<Stream> stream);
+    void replenishSpares();
+    // The client connection is gone, close every stream
+    void shutdown();
+
+    std::shared_ptr<TunnelSession> session_;
+    boost::asio::ip::tcp::resolver::results_type endpoints_;
+    std::size_t max_streams_;
+    std::size_t spare_connections_;
+    std::unordered_map<std::uint32_t, std::shared_ptr<Stream>> streams_;
+    std::vector<boost::asio::ip::tcp::socket> spares_;
+    std::size_t connecting_spares_;
+    std::array<char, HEADER_SIZE> header_;
+    std::array<char, MAX_PAYLOAD> payload_;
+    boost::asio::steady_timer throttle_timer_;
+    std::deque<Outgoing> outgoing_;
+    bool writing_;
+    bool read_on_flush_;
+    bool closed_;
+};
+
+#endif // MUX_SESSION_HPP
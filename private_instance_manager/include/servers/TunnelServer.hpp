@@ -3,36 +3,139 @@
 
 #include <boost/asio.hpp>
 #include "clients/APIClient.hpp"
+#include "common/Handoff.hpp"
+#include "common/IOContextPool.hpp"
+#include "common/SharedTokenTable.hpp"
+#include "common/TimerWheel.hpp"
+#include "common/TrafficShaper.hpp"
+#include "servers/MuxSession.hpp"
+#include "servers/TunnelSession.hpp"
+#include "servers/UdpRelay.hpp"
 
 
+// Settings of a tunnel server, 0 disables the optional listeners and limits
+struct TunnelServerConfig {
+    unsigned short port = 4002;
+    // API servers resolving the tokens, a single host or a list of shards (see APIClient)
+    std::string api_address = "127.0.0.1";
+    unsigned short api_port = 4001;
+    unsigned short num_threads = 0;
+    ExecutionMode mode = ExecutionMode::Shared;
+    bool pin_threads = false;
+    // Sessions with no traffic in either direction for this long are closed
+    long idle_timeout = 300;
+    // Bandwidth limits in bytes per second, for a session, for all the sessions of a token and for all sessions
+    std::uint64_t session_rate = 0;
+    std::uint64_t token_rate = 0;
+    std::uint64_t global_rate = 0;
+    unsigned short stats_port = 0;
+    // Token table published by a co-located API server, empty to always ask the API
+    std::string token_table_name;
+    // TLS termination of the client connections, plaintext when null
+    std::shared_ptr<TlsContext> tls;
+    std::size_t mux_max_streams = 0;
+    std::size_t mux_spare_connections = 0;
+    unsigned short udp_port = 0;
+    unsigned short http_port = 0;
+    std::string http_token_cookie = "token";
+    // Listening sockets handed over by the previous process, used instead of the ports when set
+    std::vector<int> listen_fds;
+    int stats_fd = -1;
+    std::vector<int> udp_fds;
+    std::vector<int> http_fds;
+};
+
 class TunnelServer : public std::enable_shared_from_this<TunnelServer> {
 
 public:
-    TunnelServer(unsigned short port, std::string& api_address, unsigned short api_port, unsigned short num_threads = 0);
+    explicit TunnelServer(const TunnelServerConfig& config);
     void start();
     void stop();
+    // Hand the listening sockets over to a new process running the binary, then stop accepting and
+    // wait for the sessions to finish, for drain_timeout at most. The plaintext sessions forwarding
+    // data are handed over as well with handoff_sessions. False if the new process didn't take over,
+    // the server keeps serving then
+    bool upgrade(const std::string& binary, bool handoff_sessions, std::chrono::seconds drain_timeout);
+    // Continue a session handed over by the previous process with a Session message
+    void adoptSession(const std::string& state, const std::vector<int>& fds);
+    // Byte counters of the sessions opened with the token
+    std::optional<TokenUsageSnapshot> getTokenUsage(const std::string& token);
 
 private:
-    void doAccept();
-    void handleClient(boost::asio::ip::tcp::socket socket);
-    void doReadToken(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand);
-    void doResolveInstance(const std::string& token, std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, 
-                           std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand);
-    void startForwarding(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket,
-                         std::shared_ptr<boost::asio::ip::tcp::socket> instance_socket, 
-                         std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand);
-    
-    // Networking components
-    boost::asio::io_context io_context_;
-    boost::asio::ip::tcp::acceptor acceptor_;
-    boost::asio::ip::tcp::resolver resolver_;
+    // Connections of the HTTP listeners (http) are routed by their first request instead of a token prompt
+    void doAccept(boost::asio::ip::tcp::acceptor& acceptor, bool http);
+    void handleClient(boost::asio::ip::tcp::socket socket, bool http);
+    void doHandshake(std::shared_ptr<TunnelSession> session, bool http);
+    void doReadToken(std::shared_ptr<TunnelSession> session);
+    // Read the head of the first request in the upstream buffer of the session, after the filled bytes
+    void doReadHttpRequest(std::shared_ptr<TunnelSession> session, std::size_t filled);
+    // Connect the session to the instance of the token, the buffered bytes of the client go first
+    void doRouteHttpRequest(const std::string& token, std::shared_ptr<TunnelSession> session, std::size_t buffered);
+    // Answer a request that cannot be routed, then close the connection
+    void sendHttpError(std::shared_ptr<TunnelSession> session, int status, const std::string& reason, const std::string& body);
+    // A multiplexed session (MuxSession) is asked for with "MUX <token>" instead of the token
+    void doResolveInstance(const std::string& token, std::shared_ptr<TunnelSession> session, bool mux);
+    // Port, time remaining and address of the instance, from the shared token table when possible
+    std::optional<std::tuple<unsigned short, long, std::string>> resolveToken(const std::string& token);
+    std::optional<std::tuple<unsigned short, long, std::string>> lookupSharedTable(const std::string& token);
+    // Same as resolveToken without blocking the calling thread: a token missing from the shared table
+    // is asked to the API from the lookup threads. done runs on the calling thread or on a lookup thread
+    void resolveTokenAsync(const std::string& token,
+                           std::function<void(std::optional<std::tuple<unsigned short, long, std::string>>)> done);
+    // Register the session in the timer wheel of its io_context. At its deadline the token is
+    // resolved again, so that an EXTEND reaches the sessions already open
+    void watchSession(std::shared_ptr<TunnelSession> session);
+    // Watch the session again if it is still alive, close it otherwise. Must run on its strand
+    void expireSession(std::shared_ptr<TunnelSession> session);
+    // Usage statistics queries: "STATS [token]"
+    void doAcceptStats();
+    // Sessions still open in all the pools
+    std::size_t getActiveCount();
+    // Send the session to the new process once it is parked
+    void handOff(std::shared_ptr<TunnelSession> session, std::shared_ptr<Handoff> handoff);
+    void handleStatsRequest(boost::asio::ip::tcp::socket socket);
+    std::string processStatsCommand(const std::string& command);
+
+    // Thread pool running the io_contexts, one acceptor per io_context
+    IOContextPool pool_;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors_;
+    // One timer wheel per io_context reaping expired and idle sessions
+    std::vector<std::unique_ptr<TimerWheel>> wheels_;
+    // One pool of recycled sessions per io_context
+    std::vector<std::shared_ptr<TunnelSessionPool>> session_pools_;
     // Server configuration
     unsigned short port_;
     std::string api_address_;
     unsigned short api_port_;
-    // Thread pool
-    unsigned short num_threads_;
-    std::vector<std::thread> threads_;
+    // Sessions with no traffic in either direction for this long are closed (0 disables it)
+    std::chrono::seconds idle_timeout_;
+    // Per-session and per-token bandwidth limits and byte counters
+    TrafficShaper shaper_;
+    unsigned short stats_port_;
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> stats_acceptor_;
+    // Token table published by a co-located API server, swapped atomically when it is reopened
+    std::string token_table_name_;
+    std::shared_ptr<const SharedTokenTable> token_table_;
+    std::atomic<std::int64_t> token_table_retry_;
+    // TLS termination of the client connections, plaintext when null
+    std::shared_ptr<TlsContext> tls_;
+    // Streams of a multiplexed session (0 disables multiplexing) and connections opened in advance
+    std::size_t mux_max_streams_;
+    std::size_t mux_spare_connections_;
+    // Relay of the UDP clients, null when the UDP mode is disabled
+    std::shared_ptr<UdpRelay> udp_relay_;
+    unsigned short udp_port_;
+    // Listeners of the HTTP mode, taking the token from the Host subdomain or from a cookie
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> http_acceptors_;
+    unsigned short http_port_;
+    std::string http_token_cookie_;
+    // Set once the listening sockets were handed over to a new process
+    std::atomic<bool> draining_;
+    // Pool receiving the next adopted session
+    std::atomic<std::size_t> next_pool_;
+    // Threads asking the API for the tokens missing from the shared table, off the io threads. Last
+    // member, so that its threads are joined before the rest of the server goes away
+    boost::asio::thread_pool lookup_pool_;
 };
 
 #endif // TUNNEL_SERVER_HPP
\ No newline at end of file
@@ -0,0 +1,189 @@
+#ifndef TUNNEL_SESSION_HPP
+#define TUNNEL_SESSION_HPP
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "common/HandlerAllocator.hpp"
+#include "common/TlsStream.hpp"
+#include "common/TokenBucket.hpp"
+#include "common/TrafficShaper.hpp"
+
+// State of a single tunnel connection: the client socket, the instance socket and
+// the strand serializing their handlers, plus the times at which it must be reaped.
+// A session owns everything its connection needs, buffers and handler memory included, so that
+// forwarding doesn't allocate, and it is recycled by its pool once the connection is over.
+class TunnelSession : public std::enable_shared_from_this<TunnelSession> {
+public:
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::size_t BUFFER_SIZE = 8192;
+    // Gets a parked session and the bytes it read but didn't write yet, in each direction
+    using ParkHandler = std::function<void(TunnelSession& session, const std::string& pending_up,
+                                           const std::string& pending_down)>;
+
+    // The session runs on the given io_context, the one that accepted its sockets
+    explicit TunnelSession(boost::asio::io_context& io_context);
+    ~TunnelSession();
+    TunnelSession(const TunnelSession&) = delete;
+    TunnelSession& operator=(const TunnelSession&) = delete;
+    // Start serving a new client connection
+    void reset(boost::asio::ip::tcp::socket socket);
+    // Number of the connection served by the session, unique in the process, for the logs
+    std::uint64_t getId() const;
+    // Getters for the sockets and the strand
+    boost::asio::ip::tcp::socket& getClientSocket();
+    boost::asio::ip::tcp::socket& getInstanceSocket();
+    Strand& getStrand();
+    boost::asio::io_context& getIOContext() const;
+    // Buffer of the token line, and resolver of the instance address
+    boost::asio::streambuf& getTokenBuffer();
+    boost::asio::ip::tcp::resolver& getResolver();
+    // Terminate TLS on the client socket, before anything is exchanged. False if OpenSSL fails
+    bool startTls(TlsContext& context);
+    bool isTls() const;
+    TlsStream& getTlsStream();
+    // Call the function with the stream the client talks through: the TLS stream or the socket
+    template <typename Function>
+    void withClientStream(Function&& function) {
+        if (tls_) {
+            function(tls_stream_);
+        } else {
+            function(client_socket_);
+        }
+    }
+    // Set the absolute deadline of the session (the expiry of its token)
+    void setDeadline(Clock::time_point deadline);
+    // Record activity on the session, postponing the idle timeout
+    void touch();
+    // Next time at which the session must be checked, or nullopt if it has expired.
+    // A zero idle timeout disables the inactivity check.
+    std::optional<Clock::time_point> nextExpiry(Clock::time_point now, Clock::duration idle_timeout) const;
+    // Time at which the timer wheel checks the session next, the max time while it is not watched
+    void setNextCheck(Clock::time_point when);
+    Clock::time_point getNextCheck() const;
+    // Move the next check from the time of a wheel entry to its next time. False if the entry was
+    // superseded by another one, due earlier
+    bool advanceCheck(Clock::time_point from, Clock::time_point to);
+    // Close both sockets. Must run on the strand
+    void close();
+    bool isClosed() const;
+    // Apply the session and token limits of the shaper to this session
+    void setShaper(TrafficShaper& shaper, const std::string& token, Clock::time_point deadline);
+    // Account for bytes forwarded in one direction. Returns how long to wait before forwarding
+    // more in that direction. Lock-free, it only touches atomics
+    Clock::duration chargeBytes(bool upstream, std::size_t bytes);
+    // Buffer of the data read from the client, where the HTTP mode reads the head of the first request
+    std::array<char, BUFFER_SIZE>& getUpstreamBuffer();
+    // Forward the data in both directions until either side closes, starting with the first
+    // buffered_up bytes of the upstream buffer. Must run on the strand
+    void startForwarding(std::size_t buffered_up = 0);
+    // Stop forwarding to hand the connection over to another process. Once no operation is pending
+    // anymore the handler gets the session, whose sockets are still open, and the session is closed.
+    // Only plaintext sessions forwarding to a single instance connection can be parked, false for the
+    // others. Must run on the strand
+    bool park(ParkHandler handler);
+    // Forward the data of a session adopted from another process, starting with the bytes it
+    // had not written yet. Must run on the strand
+    void resumeForwarding(const std::string& pending_up, const std::string& pending_down);
+    // Token the session was opened with, and its deadline
+    const std::string& getToken() const;
+    Clock::time_point getDeadline() const;
+    // Bytes forwarded by this session from the client (upstream) and to the client (downstream)
+    std::uint64_t getBytesUp() const;
+    std::uint64_t getBytesDown() const;
+
+private:
+    // One direction of the forwarding, with at most one pending operation at a time
+    struct Direction {
+        std::array<char, BUFFER_SIZE> buffer;
+        HandlerMemory memory;
+        boost::asio::steady_timer throttle_timer;
+        // Bytes of the buffer not written yet when the direction was parked
+        bool parked = false;
+        std::size_t pending_offset = 0;
+        std::size_t pending_size = 0;
+        explicit Direction(const Strand& strand) : throttle_timer(strand) {}
+    };
+
+    void forward(bool upstream);
+    template <typename FromStream, typename ToStream>
+    void forward(FromStream& from_stream, ToStream& to_stream, bool upstream);
+    // Write the first size bytes of the buffer of the direction, then forward the next chunk
+    template <typename ToStream>
+    void write(ToStream& to_stream, bool upstream, std::size_t size, Clock::duration delay);
+    // The direction has no pending operation anymore, hand the session over once both are parked
+    void parkDirection(bool upstream, std::size_t pending_offset, std::size_t pending_size);
+    // Release the token and the shaper before the session goes back to its pool
+    void releaseShaper();
+
+    Strand strand_;
+    std::uint64_t id_;
+    boost::asio::ip::tcp::socket client_socket_;
+    boost::asio::ip::tcp::socket instance_socket_;
+    TlsStream tls_stream_;
+    bool tls_;
+    boost::asio::ip::tcp::resolver resolver_;
+    boost::asio::streambuf token_buffer_;
+    // Stored as Clock ticks so that the reaper can read them from any thread
+    std::atomic<Clock::rep> deadline_;
+    std::atomic<Clock::rep> last_activity_;
+    std::atomic<Clock::rep> next_check_;
+    std::atomic<bool> closed_;
+    // Traffic shaping
+    TrafficShaper* shaper_;
+    std::string token_;
+    TokenBucket bucket_;
+    std::shared_ptr<TokenUsage> usage_;
+    Direction up_;
+    Direction down_;
+    std::uint64_t bytes_up_;
+    std::uint64_t bytes_down_;
+    bool forwarding_;
+    // Set while the session is being parked
+    ParkHandler park_handler_;
+    // Position in the active sessions of the pool
+    std::size_t pool_index_;
+
+    friend class TunnelSessionPool;
+};
+
+// Recycles the sessions of an io_context. A session is reset and handed to a new connection once
+// the previous one let go of it, and the control blocks of the shared_ptrs are recycled as well,
+// so that a busy server stops allocating sessions altogether.
+class TunnelSessionPool : public std::enable_shared_from_this<TunnelSessionPool> {
+public:
+    explicit TunnelSessionPool(boost::asio::io_context& io_context, std::size_t max_idle = 1024);
+    ~TunnelSessionPool();
+    // A session serving the socket, accepted on the io_context of the pool
+    std::shared_ptr<TunnelSession> acquire(boost::asio::ip::tcp::socket socket);
+    boost::asio::io_context& getIOContext() const;
+    // Sessions handed out and not released yet
+    std::size_t getActiveCount();
+    std::vector<std::shared_ptr<TunnelSession>> getActiveSessions();
+
+    // Memory of the shared_ptr control blocks
+    void* allocateBlock(std::size_t size);
+    void deallocateBlock(void* block, std::size_t size);
+
+private:
+    void release(TunnelSession* session);
+
+    boost::asio::io_context& io_context_;
+    std::size_t max_idle_;
+    // Sessions are released by whichever thread drops the last reference
+    std::mutex mutex_;
+    std::vector<TunnelSession*> idle_sessions_;
+    std::vector<TunnelSession*> active_sessions_;
+    std::size_t block_size_;
+    std::vector<void*> idle_blocks_;
+};
+
+#endif // TUNNEL_SESSION_HPP
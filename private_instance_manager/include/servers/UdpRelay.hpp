@@ -0,0 +1,57 @@
+#ifndef UDP_RELAY_HPP
+#define UDP_RELAY_HPP
+
+#include <boost/asio.hpp>
+#include <sys/socket.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "common/IOContextPool.hpp"
+#include "common/TokenBucket.hpp"
+#include "common/TrafficShaper.hpp"
+
+// UDP mode of the tunnel: a client sends its token as a datagram, and once it is accepted every
+// datagram from the client's address goes to the instance, from a socket of its own, and every
+// datagram of the instance goes back to the client. The relay answers the token with one of the
+// lines of the TCP tunnel ("Token is correct.", "Invalid Token!", ...), datagrams from an unknown
+// address that are not a token are dropped. Tokens are resolved asynchronously, with a bounded
+// number of lookups in flight per worker and per client address, as UDP source addresses can be spoofed.
+//
+// Every thread runs a worker with its own SO_REUSEPORT socket, so a client always reaches the same
+// worker, which owns its flow. Datagrams are received and sent in batches with recvmmsg/sendmmsg,
+// and with UDP GRO/GSO the kernel hands over and takes trains of same-size datagrams as a single
+// buffer. Datagrams over the session or token rate are dropped.
+class UdpRelay : public std::enable_shared_from_this<UdpRelay> {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Port, time remaining and address of the instance of a token
+    using TokenInfo = std::optional<std::tuple<unsigned short, long, std::string>>;
+    // Resolve a token without blocking, done may be called from any thread
+    using TokenResolver = std::function<void(const std::string&, std::function<void(TokenInfo)>)>;
+
+    // Largest datagram, or train of datagrams with GRO
+    static constexpr std::size_t MAX_DATAGRAM = 65536;
+    // Datagrams received per system call
+    static constexpr std::size_t BATCH_SIZE = 16;
+
+    // One worker per thread of the pool, on the given port or on the sockets of a previous process
+    UdpRelay(IOContextPool& pool, unsigned short port, TokenResolver resolver, TrafficShaper& shaper,
+             std::chrono::seconds idle_timeout, const std::vector<int>& listen_fds = {});
+    void start();
+    // Stop reading the sockets and drop the flows, the sockets stay open
+    void stop();
+    std::vector<int> getListenFds() const;
+    std::size_t getNumWorkers() const;
+    bool hasGro() const;
+
+private:
+    class Worker;
+    std::vector<std::shared_ptr<Worker>> workers_;
+};
+
+#endif // UDP_RELAY_HPP
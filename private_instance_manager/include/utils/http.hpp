@@ -0,0 +1,32 @@
+#ifndef HTTP_HPP
+#define HTTP_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Head of an HTTP/1.x request, every field points into the parsed buffer
+struct HttpRequestHead {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    // Values of the Host and Cookie headers, empty when absent
+    std::string_view host;
+    std::string_view cookie;
+    // Bytes of the head, final empty line included
+    std::size_t size = 0;
+};
+
+enum class HttpParseResult { Complete, Incomplete, Invalid };
+
+// Parse the request line and the headers at the start of the data, without copying anything.
+// Incomplete until the empty line ending the head was received
+HttpParseResult parse_http_request(std::string_view data, HttpRequestHead& head);
+// Value of a cookie in a Cookie header ("name=value; other=value"), empty when absent
+std::string_view http_cookie(std::string_view cookies, std::string_view name);
+// Host without its port
+std::string_view http_host_name(std::string_view host);
+// Complete response closing the connection, for the requests that cannot be forwarded
+std::string http_error_response(int status, const std::string& reason, const std::string& body);
+
+#endif // HTTP_HPP
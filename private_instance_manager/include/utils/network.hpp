@@ -0,0 +1,9 @@
+#ifndef NETWORK_HPP
+#define NETWORK_HPP
+
+// Ask the OS for a free TCP port. Returns 0 on failure
+unsigned short get_random_port();
+// Listening TCP socket (close-on-exec) bound to a free port, stored in port. Returns -1 on failure
+int create_listen_socket(unsigned short& port);
+
+#endif // NETWORK_HPP
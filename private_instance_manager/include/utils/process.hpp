@@ -0,0 +1,10 @@
+#ifndef PROCESS_HPP
+#define PROCESS_HPP
+
+#include <sys/types.h>
+
+// Switch the calling process to the given group and user, without supplementary groups. Returns
+// false on failure
+bool drop_privileges(uid_t user_id, gid_t group_id);
+
+#endif // PROCESS_HPP
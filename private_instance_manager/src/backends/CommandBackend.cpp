@@ -0,0 +1,121 @@
+#include "backends/CommandBackend.hpp"
+#include "common/Logger.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/wait.h>
+
+CommandBackend::CommandBackend(const std::string& name, const std::string& address, unsigned int capacity,
+                               const std::string& stop_command,
+                               const std::string& docker_host, const std::string& list_command,
+                               const std::string& rename_command, const std::string& inspect_command)
+    : InstanceBackend(name, address, capacity),
+      stop_command_(stop_command),
+      docker_host_(docker_host),
+      list_command_(list_command),
+      rename_command_(rename_command),
+      inspect_command_(inspect_command) {}
+
+bool CommandBackend::launch(const std::string& command, unsigned short port, const std::string& token) {
+    char char_command[1024] = {0};
+    snprintf(char_command, sizeof(char_command), command.c_str(), port, token.c_str());
+    return run(char_command);
+}
+
+bool CommandBackend::stop(const std::string& token) {
+    char char_command[1024] = {0};
+    snprintf(char_command, sizeof(char_command), stop_command_.c_str(), token.c_str());
+    return run(char_command);
+}
+
+bool CommandBackend::recycle(const std::string& command, const std::string& token) {
+    char char_command[1024] = {0};
+    snprintf(char_command, sizeof(char_command), command.c_str(), token.c_str());
+    return run(char_command);
+}
+
+bool CommandBackend::rename(const std::string& token, const std::string& new_token) {
+    char char_command[1024] = {0};
+    snprintf(char_command, sizeof(char_command), rename_command_.c_str(), token.c_str(), new_token.c_str());
+    return run(char_command);
+}
+
+bool CommandBackend::isReadOnly(const std::string& token) {
+    if (inspect_command_.empty()) {
+        return false;
+    }
+    char char_command[1024] = {0};
+    snprintf(char_command, sizeof(char_command), inspect_command_.c_str(), token.c_str());
+    auto lines = output(char_command);
+    return lines && lines->size() == 1 && lines->front() == "true";
+}
+
+std::optional<std::vector<std::string>> CommandBackend::listInstances() {
+    if (list_command_.empty()) {
+        return std::nullopt;
+    }
+    return output(list_command_);
+}
+
+bool CommandBackend::stopAll(const std::vector<std::string>& tokens) {
+    // docker stop takes several containers, stop them in batches rather than one by one
+    static constexpr std::size_t BATCH_SIZE = 32;
+    bool stopped = true;
+    for (std::size_t first = 0; first < tokens.size(); first += BATCH_SIZE) {
+        std::string batch;
+        for (std::size_t i = first; i < std::min(tokens.size(), first + BATCH_SIZE); ++i) {
+            batch += (batch.empty() ? "" : " ") + tokens[i];
+        }
+        std::string command = stop_command_;
+        std::size_t placeholder = command.find("%s");
+        if (placeholder == std::string::npos) {
+            return InstanceBackend::stopAll(tokens);
+        }
+        command.replace(placeholder, 2, batch);
+        stopped = run(command) && stopped;
+    }
+    return stopped;
+}
+
+std::string CommandBackend::withDockerHost(const std::string& command) const {
+    if (docker_host_.empty()) {
+        return command;
+    }
+    return "DOCKER_HOST=" + docker_host_ + " " + command;
+}
+
+bool CommandBackend::run(const std::string& command) {
+    std::string full_command = withDockerHost(command);
+    int status = system(full_command.c_str());
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        log_error("[", getName(), "] Command failed: ", full_command);
+        return false;
+    }
+    return true;
+}
+
+std::optional<std::vector<std::string>> CommandBackend::output(const std::string& command) {
+    std::string full_command = withDockerHost(command);
+    FILE* pipe = popen(full_command.c_str(), "r");
+    if (!pipe) {
+        log_error("[", getName(), "] Command failed: ", full_command);
+        return std::nullopt;
+    }
+    std::vector<std::string> lines;
+    char line[256];
+    while (fgets(line, sizeof(line), pipe)) {
+        std::string text(line);
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r' || text.back() == ' ')) {
+            text.pop_back();
+        }
+        if (!text.empty()) {
+            lines.push_back(text);
+        }
+    }
+    int status = pclose(pipe);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        log_error("[", getName(), "] Command failed: ", full_command);
+        return std::nullopt;
+    }
+    return lines;
+}
@@ -0,0 +1,78 @@
+#include "backends/InstanceBackend.hpp"
+#include "utils/network.hpp"
+
+InstanceBackend::InstanceBackend(const std::string& name, const std::string& address, unsigned int capacity)
+    : name_(name),
+      address_(address),
+      capacity_(capacity),
+      live_instances_(0) {}
+
+unsigned short InstanceBackend::allocatePort() {
+    return get_random_port();
+}
+
+std::optional<std::vector<std::string>> InstanceBackend::listInstances() {
+    return std::nullopt;
+}
+
+bool InstanceBackend::stopAll(const std::vector<std::string>& tokens) {
+    bool stopped = true;
+    for (const auto& token : tokens) {
+        stopped = stop(token) && stopped;
+    }
+    return stopped;
+}
+
+bool InstanceBackend::recycle(const std::string& /*command*/, const std::string& /*token*/) {
+    return false;
+}
+
+bool InstanceBackend::rename(const std::string& /*token*/, const std::string& /*new_token*/) {
+    return false;
+}
+
+bool InstanceBackend::isReadOnly(const std::string& /*token*/) {
+    return false;
+}
+
+const std::string& InstanceBackend::getName() const {
+    return name_;
+}
+
+const std::string& InstanceBackend::getAddress() const {
+    return address_;
+}
+
+unsigned int InstanceBackend::getCapacity() const {
+    return capacity_;
+}
+
+unsigned int InstanceBackend::getLiveInstances() const {
+    return live_instances_.load(std::memory_order_relaxed);
+}
+
+double InstanceBackend::getLoad() const {
+    unsigned int live = getLiveInstances();
+    if (capacity_ == 0) {
+        return live;
+    }
+    return static_cast<double>(live) / capacity_;
+}
+
+bool InstanceBackend::tryReserve() {
+    unsigned int live = live_instances_.load(std::memory_order_relaxed);
+    do {
+        if (capacity_ != 0 && live >= capacity_) {
+            return false;
+        }
+    } while (!live_instances_.compare_exchange_weak(live, live + 1, std::memory_order_relaxed));
+    return true;
+}
+
+void InstanceBackend::adopt() {
+    live_instances_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void InstanceBackend::release() {
+    live_instances_.fetch_sub(1, std::memory_order_relaxed);
+}
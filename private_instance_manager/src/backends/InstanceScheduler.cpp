@@ -0,0 +1,74 @@
+#include "backends/InstanceScheduler.hpp"
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+SchedulingPolicy parse_scheduling_policy(const std::string& policy) {
+    if (policy == "power_of_two") {
+        return SchedulingPolicy::PowerOfTwoChoices;
+    }
+    return SchedulingPolicy::LeastLoaded;
+}
+
+InstanceScheduler::InstanceScheduler(std::vector<std::shared_ptr<InstanceBackend>> backends, SchedulingPolicy policy)
+    : backends_(std::move(backends)),
+      policy_(policy) {
+    if (backends_.empty()) {
+        throw std::invalid_argument("No instance backend provided");
+    }
+}
+
+const std::vector<std::shared_ptr<InstanceBackend>>& InstanceScheduler::getBackends() const {
+    return backends_;
+}
+
+std::shared_ptr<InstanceBackend> InstanceScheduler::acquire() {
+    if (policy_ == SchedulingPolicy::PowerOfTwoChoices && backends_.size() > 2) {
+        auto backend = acquirePowerOfTwo();
+        if (backend) {
+            return backend;
+        }
+        // Both choices were full, fall back to a full scan
+    }
+    return acquireLeastLoaded();
+}
+
+std::shared_ptr<InstanceBackend> InstanceScheduler::acquireLeastLoaded() {
+    // The loads change concurrently: they are read once so that the sort sees a consistent order,
+    // and the next best backend is tried if the reservation fails
+    std::vector<std::pair<double, std::shared_ptr<InstanceBackend>>> candidates;
+    candidates.reserve(backends_.size());
+    for (const auto& backend : backends_) {
+        candidates.emplace_back(backend->getLoad(), backend);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    for (auto& candidate : candidates) {
+        if (candidate.second->tryReserve()) {
+            return candidate.second;
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<InstanceBackend> InstanceScheduler::acquirePowerOfTwo() {
+    thread_local std::minstd_rand generator(std::random_device{}());
+    std::uniform_int_distribution<std::size_t> distribution(0, backends_.size() - 1);
+    std::size_t first = distribution(generator);
+    std::size_t second = distribution(generator);
+    while (second == first) {
+        second = distribution(generator);
+    }
+    auto& a = backends_[first];
+    auto& b = backends_[second];
+    auto& best = a->getLoad() <= b->getLoad() ? a : b;
+    auto& other = &best == &a ? b : a;
+    if (best->tryReserve()) {
+        return best;
+    }
+    if (other->tryReserve()) {
+        return other;
+    }
+    return nullptr;
+}
@@ -1,19 +1,146 @@
 #include "clients/APIClient.hpp"
+#include "common/UUID.hpp"
+#include "common/Logger.hpp"
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 
+// Virtual points of every shard on the hash ring
+static constexpr int RING_POINTS_PER_SHARD = 64;
+// Shards tried for a token, its owner first
+static constexpr std::size_t PROBED_SHARDS = 2;
+// Time between two PINGs to a node that is down
+static constexpr std::chrono::seconds NODE_RETRY_INTERVAL(5);
+
+// 64-bit FNV-1a, stable across processes and builds so that every client agrees on the ring
+static std::uint64_t fnv1a(const void* data, std::size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static APINode parse_node(const std::string& spec, unsigned short default_port) {
+    APINode node;
+    std::size_t colon = spec.rfind(':');
+    if (colon == std::string::npos) {
+        node.address = spec;
+        node.port = default_port;
+    } else {
+        node.address = spec.substr(0, colon);
+        node.port = static_cast<unsigned short>(std::stoul(spec.substr(colon + 1)));
+    }
+    return node;
+}
+
+static int response_status(const std::string& response) {
+    std::istringstream response_stream(response);
+    int status = 0;
+    response_stream >> status;
+    return response_stream.fail() ? 0 : status;
+}
+
+std::vector<APIShard> APIClient::parseShards(const std::string& api_address, unsigned short api_port) {
+    std::vector<APIShard> shards;
+    std::istringstream list(api_address);
+    std::string shard_spec;
+    while (std::getline(list, shard_spec, ',')) {
+        if (shard_spec.empty()) {
+            continue;
+        }
+        APIShard shard;
+        std::size_t bar = shard_spec.find('|');
+        shard.primary = parse_node(shard_spec.substr(0, bar), api_port);
+        if (bar != std::string::npos) {
+            shard.replica = parse_node(shard_spec.substr(bar + 1), api_port);
+        }
+        shards.push_back(shard);
+    }
+    return shards;
+}
+
 APIClient::APIClient(const std::string& api_address, unsigned short api_port)
-    : api_address_(api_address), api_port_(api_port), socket_(io_context_) {}
+    : APIClient(parseShards(api_address, api_port)) {}
+
+APIClient::APIClient(std::vector<APIShard> shards)
+    : shards_(std::move(shards)), socket_(io_context_) {
+    if (shards_.empty()) {
+        throw std::invalid_argument("No API node provided");
+    }
+    buildRing();
+}
 
 APIClient::~APIClient() {
     disconnect();
 }
 
-void APIClient::connect() {
+void APIClient::buildRing() {
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        for (int point = 0; point < RING_POINTS_PER_SHARD; ++point) {
+            std::string key = shards_[i].primary.address + ":" + std::to_string(shards_[i].primary.port) + "#" + std::to_string(point);
+            ring_.emplace_back(fnv1a(key.data(), key.size()), i);
+        }
+    }
+    std::sort(ring_.begin(), ring_.end());
+}
+
+std::size_t APIClient::shardFor(const std::string& uuid_str) const {
+    if (shards_.size() == 1) {
+        return 0;
+    }
+    std::uint64_t hash;
+    try {
+        // Hash the raw bytes so that every spelling of the UUID lands on the same shard
+        boost::uuids::uuid uuid = UUID(uuid_str).getUUID();
+        hash = fnv1a(uuid.data, uuid.size());
+    } catch (const std::invalid_argument&) {
+        return 0;
+    }
+    auto it = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(hash, std::size_t(0)));
+    if (it == ring_.end()) {
+        it = ring_.begin();
+    }
+    return it->second;
+}
+
+std::vector<std::size_t> APIClient::probeSequence(const std::string& uuid_str) const {
+    std::vector<std::size_t> sequence;
+    std::size_t shard_index = shardFor(uuid_str);
+    for (std::size_t attempt = 0; attempt < std::min(PROBED_SHARDS, shards_.size()); ++attempt) {
+        sequence.push_back((shard_index + attempt) % shards_.size());
+    }
+    return sequence;
+}
+
+bool APIClient::isAvailable(APINode& node) {
+    // A single node has nothing to fail over to, every request tries it as before
+    if (node.healthy || (shards_.size() == 1 && !shards_.front().replica)) {
+        return true;
+    }
+    if (std::chrono::steady_clock::now() - node.last_check < NODE_RETRY_INTERVAL) {
+        return false;
+    }
+    return pingNode(node);
+}
+
+bool APIClient::pingNode(APINode& node) {
+    std::string response = sendRequest(node, "PING\n");
+    std::istringstream response_stream(response);
+    int status;
+    std::string answer;
+    response_stream >> status >> answer;
+    node.healthy = !response_stream.fail() && status == 200 && answer == "PONG";
+    node.last_check = std::chrono::steady_clock::now();
+    return node.healthy;
+}
+
+void APIClient::connect(const APINode& node) {
     if (!socket_.is_open()) {
         boost::asio::ip::tcp::resolver resolver(io_context_);
-        // std::cout << "Connecting to " << api_address_ << ":" << api_port_ << std::endl;
-        auto endpoints = resolver.resolve(api_address_, std::to_string(api_port_));
+        auto endpoints = resolver.resolve(node.address, std::to_string(node.port));
         boost::asio::connect(socket_, endpoints);
     }
 }
@@ -24,9 +151,9 @@ void APIClient::disconnect() {
     }
 }
 
-std::string APIClient::sendRequest(const std::string& message) {
+std::string APIClient::sendRequest(APINode& node, const std::string& message) {
     try {
-        connect();
+        connect(node);
         boost::asio::write(socket_, boost::asio::buffer(message));
 
         boost::asio::streambuf response_buffer;
@@ -36,36 +163,51 @@ std::string APIClient::sendRequest(const std::string& message) {
         return std::string(
             std::istreambuf_iterator<char>(&response_buffer), {});
     } catch (const boost::system::system_error& e) {
-        std::cerr << "Network error: " << e.what() << std::endl;
+        log_error("Network error (", node.address, ":", node.port, "): ", e.what());
+        disconnect();
+        // Stop sending requests to the node until it answers PING again
+        node.healthy = false;
+        node.last_check = std::chrono::steady_clock::now();
         return "";
     } catch (const std::exception& e) {
-        std::cerr << "Error in sendRequest: " << e.what() << std::endl;
+        log_error("Error in sendRequest: ", e.what());
+        disconnect();
         return "";
     }
 }
 
 bool APIClient::apiPing() {
+    // Every shard must be reachable, either through its primary or its replica
     try {
-        std::string response = sendRequest("PING\n");
-        if (response.empty()) {
-            return false;
+        for (auto& shard : shards_) {
+            if (!pingNode(shard.primary) && !(shard.replica && pingNode(*shard.replica))) {
+                return false;
+            }
         }
-
-        std::istringstream response_stream(response);
-        int status;
-        std::string answer;
-        response_stream >> status >> answer;
-
-        return !response_stream.fail() && status == 200 && answer == "PONG";
+        return true;
     } catch (const std::exception& e) {
-        std::cerr << "Exception in apiPing: " << e.what() << std::endl;
+        log_error("Exception in apiPing: ", e.what());
         return false;
     }
 }
 
 std::optional<std::tuple<unsigned short, long, std::string>> APIClient::apiGetInfo(const std::string& uuid_str) {
     try {
-        std::string response = sendRequest("GET_INFO " + uuid_str + "\n");
+        std::string request = "GET_INFO " + uuid_str + "\n";
+        std::string response;
+        for (std::size_t shard_index : probeSequence(uuid_str)) {
+            APIShard& shard = shards_[shard_index];
+            if (isAvailable(shard.primary)) {
+                response = sendRequest(shard.primary, request);
+            }
+            // Reads can be served by the replica when the primary doesn't answer
+            if (response.empty() && shard.replica && isAvailable(*shard.replica)) {
+                response = sendRequest(*shard.replica, request);
+            }
+            if (!response.empty() && response_status(response) != 404) {
+                break;
+            }
+        }
         if (response.empty()) {
             return std::make_tuple(0, 0, "");
         }
@@ -85,14 +227,40 @@ std::optional<std::tuple<unsigned short, long, std::string>> APIClient::apiGetIn
         // Everything is fine, return the NetworkInfo
         return std::make_tuple(port, time_remaining, service_name);
     } catch (const std::exception& e) {
-        std::cerr << "Exception in apiGetInfoPort: " << e.what() << std::endl;
+        log_error("Exception in apiGetInfoPort: ", e.what());
     }
     return std::nullopt;
 }
 
-std::optional<std::string> APIClient::apiAddService(const std::string& service_address, unsigned short service_port) {
+std::optional<std::string> APIClient::apiAddService(const std::string& service_address, unsigned short service_port, long ttl) {
     try {
-        std::string response = sendRequest("ADD_SERVICE " + service_address + " " + std::to_string(service_port) + "\n");
+        std::string response;
+        std::string ttl_argument = ttl > 0 ? " " + std::to_string(ttl) : "";
+        if (shards_.size() == 1) {
+            // The server generates the token, and replicates it if it has a replica
+            response = sendRequest(shards_.front().primary, "ADD_SERVICE " + service_address + " " + std::to_string(service_port) + ttl_argument + "\n");
+        } else {
+            // The token decides the shard, so it is generated here and stored with PUT on its owner,
+            // or on the next shard when the owner is down, where the lookups find it
+            for (int attempt = 0; attempt < 3 && response.empty(); ++attempt) {
+                std::string token = UUID().toString();
+                std::vector<std::size_t> sequence = probeSequence(token);
+                for (std::size_t i = 0; i < sequence.size() && response.empty(); ++i) {
+                    APIShard& shard = shards_[sequence[i]];
+                    if (!isAvailable(shard.primary)) {
+                        continue;
+                    }
+                    response = sendRequest(shard.primary, "PUT " + token + " " + service_address + " " + std::to_string(service_port) + ttl_argument + "\n");
+                    if (i != 0 && !response.empty()) {
+                        log_error("Token ", token, " stored on a fallback shard.");
+                    }
+                }
+                // Token already taken, try another one
+                if (response_status(response) == 409) {
+                    response.clear();
+                }
+            }
+        }
         if (response.empty()) {
             return std::nullopt;
         }
@@ -104,7 +272,66 @@ std::optional<std::string> APIClient::apiAddService(const std::string& service_a
             return token;
         }
     } catch (const std::exception& e) {
-        std::cerr << "Exception in apiAddService: " << e.what() << std::endl;
+        log_error("Exception in apiAddService: ", e.what());
     }
     return std::nullopt;
-}
\ No newline at end of file
+}
+
+bool APIClient::apiPutService(const std::string& uuid_str, const std::string& service_address, unsigned short service_port, long time_remaining) {
+    try {
+        APINode& node = shards_[shardFor(uuid_str)].primary;
+        if (!isAvailable(node)) {
+            return false;
+        }
+        std::string response = sendRequest(node, "PUT " + uuid_str + " " + service_address + " " + std::to_string(service_port) + " " + std::to_string(time_remaining) + "\n");
+        // A conflict means that the token is already there
+        int status = response_status(response);
+        return status == 200 || status == 409;
+    } catch (const std::exception& e) {
+        log_error("Exception in apiPutService: ", e.what());
+    }
+    return false;
+}
+
+std::string APIClient::sendTokenUpdate(const std::string& uuid_str, const std::string& message) {
+    std::string response;
+    // Same shards as apiGetInfo, but never the replicas: they only serve reads
+    for (std::size_t shard_index : probeSequence(uuid_str)) {
+        APIShard& shard = shards_[shard_index];
+        if (isAvailable(shard.primary)) {
+            response = sendRequest(shard.primary, message);
+        }
+        if (!response.empty() && response_status(response) != 404) {
+            break;
+        }
+    }
+    return response;
+}
+
+std::optional<long> APIClient::apiExtendService(const std::string& uuid_str, long seconds) {
+    try {
+        std::string response = sendTokenUpdate(uuid_str, "EXTEND " + uuid_str + " " + std::to_string(seconds) + "\n");
+        // Response is "200 TimeRemaining: <seconds>"
+        std::istringstream response_stream(response);
+        int status;
+        std::string time_remaining_label;
+        long time_remaining;
+        response_stream >> status >> time_remaining_label >> time_remaining;
+        if (!response_stream.fail() && status == 200 && time_remaining_label == "TimeRemaining:") {
+            return time_remaining;
+        }
+    } catch (const std::exception& e) {
+        log_error("Exception in apiExtendService: ", e.what());
+    }
+    return std::nullopt;
+}
+
+bool APIClient::apiRevokeService(const std::string& uuid_str) {
+    try {
+        std::string response = sendTokenUpdate(uuid_str, "REVOKE " + uuid_str + "\n");
+        return response_status(response) == 200;
+    } catch (const std::exception& e) {
+        log_error("Exception in apiRevokeService: ", e.what());
+    }
+    return false;
+}
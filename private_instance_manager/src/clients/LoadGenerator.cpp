@@ -0,0 +1,456 @@
+#include "clients/LoadGenerator.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+static constexpr std::size_t BULK_CHUNK_SIZE = 64 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(Clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+// Lines of the servers can carry the NUL terminator of their previous message
+static std::string read_line(boost::asio::streambuf& buffer) {
+    std::istream is(&buffer);
+    std::string line;
+    std::getline(is, line);
+    line.erase(std::remove(line.begin(), line.end(), '\0'), line.end());
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+        line.pop_back();
+    }
+    return line;
+}
+
+void Samples::add(double value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    values_.push_back(value);
+    sorted_ = false;
+}
+
+std::size_t Samples::count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return values_.size();
+}
+
+double Samples::percentile(double fraction) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (values_.empty()) {
+        return 0;
+    }
+    if (!sorted_) {
+        std::sort(values_.begin(), values_.end());
+        sorted_ = true;
+    }
+    // Nearest rank
+    auto rank = static_cast<std::size_t>(std::ceil(fraction * values_.size()));
+    return values_[std::min(std::max<std::size_t>(rank, 1), values_.size()) - 1];
+}
+
+double Samples::max() const {
+    return percentile(1.0);
+}
+
+struct LoadGenerator::Player {
+    boost::asio::strand<boost::asio::io_context::executor_type> strand;
+    // Connection to the instances server, kept open until the instance is stopped
+    boost::asio::ip::tcp::socket control;
+    boost::asio::ip::tcp::socket tunnel;
+    boost::asio::steady_timer step_timer;
+    boost::asio::steady_timer think_timer;
+    boost::asio::streambuf control_buffer;
+    boost::asio::streambuf tunnel_buffer;
+    std::array<char, BULK_CHUNK_SIZE> chunk;
+    // Step of the player, for the errors
+    std::string stage;
+    std::string token;
+    // Last message of the instances server that wasn't a token
+    std::string last_line;
+    std::string outgoing;
+    Clock::time_point step_started;
+    Clock::time_point message_sent;
+    std::size_t session = 0;
+    std::size_t message = 0;
+    std::size_t bulk_received = 0;
+    bool bulk_written = false;
+    bool timed_out = false;
+    bool done = false;
+
+    explicit Player(boost::asio::io_context& io_context)
+        : strand(boost::asio::make_strand(io_context)), control(strand), tunnel(strand),
+          step_timer(strand), think_timer(strand) {}
+
+    void close() {
+        boost::system::error_code ignored;
+        control.close(ignored);
+        tunnel.close(ignored);
+        step_timer.cancel();
+        think_timer.cancel();
+    }
+};
+
+LoadGenerator::LoadGenerator(const Config& config)
+    : config_(config),
+      pool_(ExecutionMode::Shared, config.num_threads) {}
+
+void LoadGenerator::run() {
+    boost::asio::io_context& io_context = pool_.getIOContext();
+    boost::asio::ip::tcp::resolver resolver(io_context);
+    instances_endpoints_ = resolver.resolve(config_.instances_address, std::to_string(config_.instances_port));
+    tunnel_endpoints_ = resolver.resolve(config_.tunnel_address, std::to_string(config_.tunnel_port));
+    bulk_payload_.assign(config_.bulk_bytes, 'b');
+
+    auto work = boost::asio::make_work_guard(io_context);
+    start_ = Clock::now();
+    // The first players are spread over the ramp-up, the next ones replace those that finish
+    std::size_t initial = std::min(config_.concurrency, config_.players);
+    for (std::size_t i = 0; i < initial; ++i) {
+        auto delay = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(config_.ramp_up * i / std::max<std::size_t>(initial, 1)));
+        auto timer = std::make_shared<boost::asio::steady_timer>(io_context, delay);
+        timer->async_wait([this, timer](const boost::system::error_code& ec) {
+            if (!ec) {
+                startPlayer();
+            }
+        });
+    }
+    pool_.run();
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this]() {
+            return finished_ == config_.players;
+        });
+    }
+    work.reset();
+    pool_.stop();
+}
+
+void LoadGenerator::startPlayer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (started_ == config_.players) {
+            return;
+        }
+        ++started_;
+    }
+    auto player = std::make_shared<Player>(pool_.getIOContext());
+    boost::asio::post(player->strand, [this, player]() {
+        provision(player);
+    });
+}
+
+void LoadGenerator::armStep(std::shared_ptr<Player> player) {
+    player->step_started = Clock::now();
+    player->step_timer.expires_after(std::chrono::seconds(config_.step_timeout));
+    player->step_timer.async_wait(boost::asio::bind_executor(player->strand,
+        [player](const boost::system::error_code& ec) {
+            if (!ec && !player->done) {
+                // The pending operations fail, and report the timeout
+                player->timed_out = true;
+                boost::system::error_code ignored;
+                player->control.cancel(ignored);
+                player->tunnel.close(ignored);
+                player->think_timer.cancel();
+            }
+        }));
+}
+
+void LoadGenerator::provision(std::shared_ptr<Player> player) {
+    player->stage = "provision";
+    armStep(player);
+    boost::asio::async_connect(player->control, instances_endpoints_, boost::asio::bind_executor(player->strand,
+        [this, player](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+            if (ec) {
+                fail(player, ec.message());
+                return;
+            }
+            readProvisioning(player);
+        }));
+}
+
+void LoadGenerator::readProvisioning(std::shared_ptr<Player> player) {
+    boost::asio::async_read_until(player->control, player->control_buffer, '\n', boost::asio::bind_executor(player->strand,
+        [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+            if (ec) {
+                // The server explains the failure before closing the connection
+                fail(player, player->last_line.empty() ? ec.message() : player->last_line);
+                return;
+            }
+            std::string line = read_line(player->control_buffer);
+            auto position = line.find("token: ");
+            if (position == std::string::npos) {
+                if (line.rfind("Initializing", 0) != 0) {
+                    player->last_line = line;
+                }
+                readProvisioning(player);
+                return;
+            }
+            player->token = line.substr(position + 7);
+            provisioning_.add(elapsed_ms(player->step_started));
+            openSession(player);
+        }));
+}
+
+void LoadGenerator::openSession(std::shared_ptr<Player> player) {
+    player->stage = "tunnel";
+    player->tunnel_buffer.consume(player->tunnel_buffer.size());
+    armStep(player);
+    boost::asio::async_connect(player->tunnel, tunnel_endpoints_, boost::asio::bind_executor(player->strand,
+        [this, player](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+            if (ec) {
+                fail(player, ec.message());
+                return;
+            }
+            boost::asio::async_read_until(player->tunnel, player->tunnel_buffer, ": ", boost::asio::bind_executor(player->strand,
+                [this, player](const boost::system::error_code& ec, std::size_t length) {
+                    if (ec) {
+                        fail(player, ec.message());
+                        return;
+                    }
+                    player->tunnel_buffer.consume(length);
+                    player->outgoing = player->token + "\n";
+                    boost::asio::async_write(player->tunnel, boost::asio::buffer(player->outgoing), boost::asio::bind_executor(player->strand,
+                        [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+                            if (ec) {
+                                fail(player, ec.message());
+                                return;
+                            }
+                            // The tunnel confirms the token, then connects to the instance. What is
+                            // sent from then on waits in the socket until the tunnel forwards it
+                            auto read = std::make_shared<std::function<void()>>();
+                            *read = [this, player, read]() {
+                                boost::asio::async_read_until(player->tunnel, player->tunnel_buffer, '\n', boost::asio::bind_executor(player->strand,
+                                    [this, player, read](const boost::system::error_code& ec, std::size_t /*length*/) {
+                                        if (ec) {
+                                            *read = nullptr;
+                                            fail(player, ec.message());
+                                            return;
+                                        }
+                                        std::string line = read_line(player->tunnel_buffer);
+                                        if (line.rfind("Token is correct", 0) == 0) {
+                                            static const std::string ping = "ping\n";
+                                            boost::asio::async_write(player->tunnel, boost::asio::buffer(ping), boost::asio::bind_executor(player->strand,
+                                                [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+                                                    if (ec) {
+                                                        fail(player, ec.message());
+                                                    }
+                                                }));
+                                            (*read)();
+                                            return;
+                                        }
+                                        *read = nullptr;
+                                        if (line != "ping") {
+                                            // "Invalid Token!", "Token has expired!"...
+                                            fail(player, line.empty() ? "no echo" : line);
+                                            return;
+                                        }
+                                        // The session is up once the ping comes back from the instance
+                                        tunnel_setup_.add(elapsed_ms(player->step_started));
+                                        player->stage = "interactive";
+                                        player->message = 0;
+                                        exchangeMessage(player);
+                                    }));
+                            };
+                            (*read)();
+                        }));
+                }));
+        }));
+}
+
+void LoadGenerator::exchangeMessage(std::shared_ptr<Player> player) {
+    if (player->message == config_.interactive_messages) {
+        sendBulk(player);
+        return;
+    }
+    std::string expected = "m" + std::to_string(player->session) + "-" + std::to_string(player->message);
+    if (expected.size() + 1 < config_.message_size) {
+        expected.append(config_.message_size - expected.size() - 1, 'x');
+    }
+    player->outgoing = expected + "\n";
+    player->message_sent = Clock::now();
+    boost::asio::async_write(player->tunnel, boost::asio::buffer(player->outgoing), boost::asio::bind_executor(player->strand,
+        [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+            if (ec) {
+                fail(player, ec.message());
+            }
+        }));
+    auto read = std::make_shared<std::function<void()>>();
+    *read = [this, player, expected, read]() {
+        boost::asio::async_read_until(player->tunnel, player->tunnel_buffer, '\n', boost::asio::bind_executor(player->strand,
+            [this, player, expected, read](const boost::system::error_code& ec, std::size_t /*length*/) {
+                if (ec) {
+                    *read = nullptr;
+                    fail(player, ec.message());
+                    return;
+                }
+                *read = nullptr;
+                if (read_line(player->tunnel_buffer) != expected) {
+                    fail(player, "unexpected echo");
+                    return;
+                }
+                round_trip_.add(elapsed_ms(player->message_sent));
+                ++player->message;
+                if (config_.think_time > 0) {
+                    player->think_timer.expires_after(std::chrono::milliseconds(config_.think_time));
+                    player->think_timer.async_wait(boost::asio::bind_executor(player->strand,
+                        [this, player](const boost::system::error_code& ec) {
+                            if (!ec && !player->done) {
+                                exchangeMessage(player);
+                            }
+                        }));
+                    return;
+                }
+                exchangeMessage(player);
+            }));
+    };
+    (*read)();
+}
+
+void LoadGenerator::sendBulk(std::shared_ptr<Player> player) {
+    player->stage = "bulk";
+    armStep(player);
+    player->bulk_written = false;
+    // Whatever the interactive phase left in the buffer is part of the echo
+    player->bulk_received = player->tunnel_buffer.size();
+    player->tunnel_buffer.consume(player->tunnel_buffer.size());
+
+    auto finished = [this, player]() {
+        if (!player->bulk_written || player->bulk_received < config_.bulk_bytes) {
+            return;
+        }
+        double seconds = elapsed_ms(player->step_started) / 1000.0;
+        if (config_.bulk_bytes > 0) {
+            bulk_rate_.add(config_.bulk_bytes / (1024.0 * 1024.0) / std::max(seconds, 1e-6));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bulk_total_ += config_.bulk_bytes;
+        }
+        boost::system::error_code ignored;
+        player->tunnel.close(ignored);
+        if (++player->session < config_.sessions_per_player) {
+            openSession(player);
+        } else {
+            stopInstance(player);
+        }
+    };
+
+    boost::asio::async_write(player->tunnel, boost::asio::buffer(bulk_payload_), boost::asio::bind_executor(player->strand,
+        [this, player, finished](const boost::system::error_code& ec, std::size_t /*length*/) {
+            if (ec) {
+                fail(player, ec.message());
+                return;
+            }
+            player->bulk_written = true;
+            finished();
+        }));
+    auto read = std::make_shared<std::function<void()>>();
+    *read = [this, player, finished, read]() {
+        if (player->bulk_received >= config_.bulk_bytes) {
+            // Resetting the function destroys this lambda, keep what is still needed
+            auto done = finished;
+            *read = nullptr;
+            done();
+            return;
+        }
+        player->tunnel.async_read_some(boost::asio::buffer(player->chunk), boost::asio::bind_executor(player->strand,
+            [this, player, read](const boost::system::error_code& ec, std::size_t length) {
+                if (ec) {
+                    *read = nullptr;
+                    fail(player, ec.message());
+                    return;
+                }
+                player->bulk_received += length;
+                (*read)();
+            }));
+    };
+    (*read)();
+}
+
+void LoadGenerator::stopInstance(std::shared_ptr<Player> player) {
+    static const std::string stop = "stop\n";
+    player->stage = "stop";
+    armStep(player);
+    boost::asio::async_write(player->control, boost::asio::buffer(stop), boost::asio::bind_executor(player->strand,
+        [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+            if (ec) {
+                fail(player, ec.message());
+                return;
+            }
+            // The server closes the connection once the instance is stopped
+            boost::asio::async_read(player->control, player->control_buffer, boost::asio::bind_executor(player->strand,
+                [this, player](const boost::system::error_code& ec, std::size_t /*length*/) {
+                    if (ec != boost::asio::error::eof) {
+                        fail(player, ec ? ec.message() : "connection not closed");
+                        return;
+                    }
+                    stop_.add(elapsed_ms(player->step_started));
+                    finish(player, true);
+                }));
+        }));
+}
+
+void LoadGenerator::fail(std::shared_ptr<Player> player, const std::string& reason) {
+    if (player->done) {
+        return;
+    }
+    if (!player->token.empty() && player->stage != "stop" && player->control.is_open()) {
+        // Don't leave the instance running until its token expires
+        boost::system::error_code ignored;
+        boost::asio::write(player->control, boost::asio::buffer("stop\n", 5), ignored);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++errors_[player->stage + ": " + (player->timed_out ? "timeout" : reason)];
+    }
+    finish(player, false);
+}
+
+void LoadGenerator::finish(std::shared_ptr<Player> player, bool succeeded) {
+    player->done = true;
+    player->close();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++finished_;
+        if (succeeded) {
+            ++succeeded_;
+        }
+        if (finished_ == config_.players) {
+            end_ = Clock::now();
+            done_.notify_all();
+            return;
+        }
+    }
+    startPlayer();
+}
+
+void LoadGenerator::report(std::ostream& os) const {
+    std::size_t failed = config_.players - succeeded_;
+    double seconds = std::chrono::duration<double>(end_ - start_).count();
+    os << std::fixed << std::setprecision(1);
+    os << "Players: " << config_.players << " (" << succeeded_ << " succeeded, " << failed << " failed, "
+       << 100.0 * failed / std::max<std::size_t>(config_.players, 1) << "%) in " << seconds << " s" << std::endl;
+    os << std::left << std::setw(26) << "" << std::right << std::setw(8) << "count" << std::setw(10) << "p50"
+       << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+    auto row = [&os](const std::string& name, const Samples& samples) {
+        os << std::left << std::setw(26) << name << std::right << std::setw(8) << samples.count()
+           << std::setw(10) << samples.percentile(0.5) << std::setw(10) << samples.percentile(0.9)
+           << std::setw(10) << samples.percentile(0.99) << std::setw(10) << samples.max() << std::endl;
+    };
+    row("Provisioning (ms)", provisioning_);
+    row("Tunnel setup (ms)", tunnel_setup_);
+    row("Round trip (ms)", round_trip_);
+    row("Bulk echo (MiB/s)", bulk_rate_);
+    row("Stop (ms)", stop_);
+    os << "Bulk throughput: " << bulk_total_ / (1024.0 * 1024.0) / std::max(seconds, 1e-6) << " MiB/s echoed" << std::endl;
+    if (!errors_.empty()) {
+        os << "Errors:" << std::endl;
+        for (const auto& error : errors_) {
+            os << "  " << error.first << ": " << error.second << " ("
+               << 100.0 * error.second / std::max<std::size_t>(config_.players, 1) << "%)" << std::endl;
+        }
+    }
+}
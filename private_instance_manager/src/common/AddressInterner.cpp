@@ -0,0 +1,39 @@
+#include "common/AddressInterner.hpp"
+
+std::uint32_t AddressInterner::intern(const std::string& address) {
+    auto it = ids_.find(address);
+    if (it != ids_.end()) {
+        ++references_[it->second];
+        return it->second;
+    }
+    std::uint32_t id;
+    if (!free_ids_.empty()) {
+        id = free_ids_.back();
+        free_ids_.pop_back();
+        addresses_[id] = address;
+        references_[id] = 1;
+    } else {
+        id = static_cast<std::uint32_t>(addresses_.size());
+        addresses_.push_back(address);
+        references_.push_back(1);
+    }
+    ids_.emplace(address, id);
+    return id;
+}
+
+void AddressInterner::release(std::uint32_t id) {
+    if (--references_[id] == 0) {
+        ids_.erase(addresses_[id]);
+        addresses_[id].clear();
+        addresses_[id].shrink_to_fit();
+        free_ids_.push_back(id);
+    }
+}
+
+const std::string& AddressInterner::get(std::uint32_t id) const {
+    return addresses_[id];
+}
+
+std::size_t AddressInterner::size() const {
+    return ids_.size();
+}
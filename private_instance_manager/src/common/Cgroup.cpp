@@ -0,0 +1,310 @@
+#include "common/Cgroup.hpp"
+#include "common/Logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+// Period of the CPU limit, in microseconds
+static constexpr std::uint64_t CPU_PERIOD_US = 100000;
+// Time given to the killed processes to leave the cgroup before it is removed
+static constexpr int REMOVE_ATTEMPTS = 200;
+static constexpr auto REMOVE_RETRY_DELAY = std::chrono::milliseconds(5);
+
+static bool write_file(const std::string& path, const std::string& value) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+    close(fd);
+    return written;
+}
+
+static std::optional<std::string> read_file(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        return std::nullopt;
+    }
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+// Value of a key in a flat keyed file such as cpu.stat or memory.events
+static std::optional<std::uint64_t> read_key(const std::string& path, const std::string& key) {
+    std::ifstream file(path);
+    std::string name;
+    std::uint64_t value;
+    while (file >> name >> value) {
+        if (name == key) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+static std::optional<std::uint64_t> read_value(const std::string& path) {
+    std::ifstream file(path);
+    std::uint64_t value;
+    if (!(file >> value)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+static std::vector<std::string> split_words(const std::string& str) {
+    std::istringstream is(str);
+    std::vector<std::string> words;
+    std::string word;
+    while (is >> word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+// Mount point of the cgroup v2 hierarchy, /sys/fs/cgroup on most systems and /sys/fs/cgroup/unified
+// on hybrid ones
+static std::optional<std::string> find_cgroup2_mount() {
+    std::ifstream mounts("/proc/self/mounts");
+    std::string line;
+    while (std::getline(mounts, line)) {
+        std::vector<std::string> fields = split_words(line);
+        if (fields.size() >= 3 && fields[2] == "cgroup2") {
+            return fields[1];
+        }
+    }
+    return std::nullopt;
+}
+
+// Path of the cgroup v2 of the calling process, relative to the mount point
+static std::optional<std::string> find_own_cgroup() {
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        if (line.rfind("0::", 0) == 0) {
+            return line.substr(3);
+        }
+    }
+    return std::nullopt;
+}
+
+// Prefix of the cgroups created by this run. The pid alone can come back after a restart, the start
+// time tells the runs apart
+static const std::string& run_prefix() {
+    static const std::string prefix = "pim-" + std::to_string(getpid()) + "-" +
+        std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()) + "-";
+    return prefix;
+}
+
+Cgroup::Cgroup(std::string path, int procs_fd) : path_(std::move(path)), procs_fd_(procs_fd) {}
+
+Cgroup::~Cgroup() {
+    destroy();
+}
+
+int Cgroup::procsFd() const {
+    return procs_fd_;
+}
+
+bool Cgroup::join(int procs_fd) {
+    // "0" stands for the writing process
+    return write(procs_fd, "0", 1) == 1;
+}
+
+std::optional<CgroupUsage> Cgroup::usage() const {
+    auto cpu = read_key(path_ + "/cpu.stat", "usage_usec");
+    if (!cpu) {
+        return std::nullopt;
+    }
+    CgroupUsage usage;
+    usage.cpu = std::chrono::microseconds(*cpu);
+    usage.memory = read_value(path_ + "/memory.current").value_or(0);
+    usage.pids = read_value(path_ + "/pids.current").value_or(0);
+    return usage;
+}
+
+std::string Cgroup::limitExceeded() const {
+    if (read_key(path_ + "/memory.events", "oom_kill").value_or(0) > 0) {
+        return "out of memory";
+    }
+    if (read_key(path_ + "/pids.events", "max").value_or(0) > 0) {
+        return "too many processes";
+    }
+    if (read_key(path_ + "/cgroup.events", "populated") == 0) {
+        return "exited";
+    }
+    return "";
+}
+
+void Cgroup::destroy() {
+    if (destroyed_) {
+        return;
+    }
+    destroyed_ = true;
+    close(procs_fd_);
+    // cgroup.kill needs Linux 5.14, kill the processes one by one before that
+    if (!write_file(path_ + "/cgroup.kill", "1")) {
+        auto procs = read_file(path_ + "/cgroup.procs");
+        for (const auto& pid : split_words(procs.value_or(""))) {
+            kill(static_cast<pid_t>(std::stol(pid)), SIGKILL);
+        }
+    }
+    // The cgroup can only be removed once the killed processes are gone
+    for (int attempt = 0; attempt < REMOVE_ATTEMPTS; ++attempt) {
+        if (rmdir(path_.c_str()) == 0 || errno == ENOENT) {
+            return;
+        }
+        if (errno != EBUSY) {
+            break;
+        }
+        std::this_thread::sleep_for(REMOVE_RETRY_DELAY);
+    }
+    log_error("Failed to remove the cgroup ", path_, ": ", std::strerror(errno));
+}
+
+std::shared_ptr<CgroupManager> CgroupManager::create(const std::string& parent, const CgroupLimits& limits) {
+    auto mount = find_cgroup2_mount();
+    if (!mount) {
+        log_error("cgroup v2 is not mounted, the instances run without resource limits");
+        return nullptr;
+    }
+    std::string path = parent;
+    if (path.empty()) {
+        auto own = find_own_cgroup();
+        if (!own) {
+            log_error("The server is not in a cgroup v2, the instances run without resource limits");
+            return nullptr;
+        }
+        path = *mount + *own;
+    }
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        log_error("Failed to create the cgroup ", path, ": ", std::strerror(errno));
+        return nullptr;
+    }
+    auto available = read_file(path + "/cgroup.controllers");
+    if (!available) {
+        log_error(path, " is not a cgroup v2, the instances run without resource limits");
+        return nullptr;
+    }
+
+    // Controllers needed by the limits. Those missing are reported, the others still apply
+    std::vector<std::string> wanted;
+    if (limits.cpus > 0) {
+        wanted.push_back("cpu");
+    }
+    if (limits.memory > 0) {
+        wanted.push_back("memory");
+    }
+    if (limits.pids > 0) {
+        wanted.push_back("pids");
+    }
+    std::vector<std::string> present = split_words(*available);
+    std::vector<std::string> controllers;
+    for (const auto& controller : wanted) {
+        if (std::find(present.begin(), present.end(), controller) == present.end()) {
+            log_error("The ", controller, " controller is not delegated to ", path, ", its limit is not enforced");
+            continue;
+        }
+        std::string enable = "+" + controller;
+        if (!write_file(path + "/cgroup.subtree_control", enable) && errno == EBUSY) {
+            // A cgroup with processes can't have controlled children: its processes (the server
+            // itself when it is the default parent) are moved to a leaf first
+            std::string leaf = path + "/server";
+            if (mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST) {
+                log_error("Failed to create the cgroup ", leaf, ": ", std::strerror(errno));
+                return nullptr;
+            }
+            for (const auto& pid : split_words(read_file(path + "/cgroup.procs").value_or(""))) {
+                write_file(leaf + "/cgroup.procs", pid);
+            }
+            write_file(path + "/cgroup.subtree_control", enable);
+        }
+        auto enabled = split_words(read_file(path + "/cgroup.subtree_control").value_or(""));
+        if (std::find(enabled.begin(), enabled.end(), controller) == enabled.end()) {
+            log_error("Failed to enable the ", controller, " controller in ", path, ", its limit is not enforced");
+            continue;
+        }
+        controllers.push_back(controller);
+    }
+
+    std::shared_ptr<CgroupManager> manager(new CgroupManager(path, limits, controllers));
+    manager->removeStale();
+    // The parent must accept new children, or nothing will
+    auto probe = manager->createInstance();
+    if (!probe) {
+        log_error("cgroups are not delegated to the server, the instances run without resource limits");
+        return nullptr;
+    }
+    return manager;
+}
+
+CgroupManager::CgroupManager(std::string parent, const CgroupLimits& limits, std::vector<std::string> controllers)
+    : parent_(std::move(parent)), limits_(limits), controllers_(std::move(controllers)) {}
+
+std::shared_ptr<Cgroup> CgroupManager::createInstance() {
+    // Numbered per process, the managers of several challenges can share a parent
+    static std::atomic<std::uint64_t> next_id(0);
+    std::string path = parent_ + "/" + run_prefix() + std::to_string(next_id.fetch_add(1, std::memory_order_relaxed));
+    if (mkdir(path.c_str(), 0755) != 0) {
+        log_error("Failed to create the cgroup ", path, ": ", std::strerror(errno));
+        return nullptr;
+    }
+    auto enabled = [this](const std::string& controller) {
+        return std::find(controllers_.begin(), controllers_.end(), controller) != controllers_.end();
+    };
+    bool configured = true;
+    if (limits_.cpus > 0 && enabled("cpu")) {
+        auto quota = static_cast<std::uint64_t>(limits_.cpus * CPU_PERIOD_US);
+        configured &= write_file(path + "/cpu.max", std::to_string(std::max<std::uint64_t>(quota, 1000)) + " " +
+                                                    std::to_string(CPU_PERIOD_US));
+    }
+    if (limits_.memory > 0 && enabled("memory")) {
+        configured &= write_file(path + "/memory.max", std::to_string(limits_.memory));
+        // Swapping would only hide the limit. Both are missing on some kernels
+        write_file(path + "/memory.swap.max", "0");
+        write_file(path + "/memory.oom.group", "1");
+    }
+    if (limits_.pids > 0 && enabled("pids")) {
+        configured &= write_file(path + "/pids.max", std::to_string(limits_.pids));
+    }
+    int procs_fd = open((path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (!configured || procs_fd < 0) {
+        log_error("Failed to configure the cgroup ", path, ": ", std::strerror(errno));
+        if (procs_fd >= 0) {
+            close(procs_fd);
+        }
+        rmdir(path.c_str());
+        return nullptr;
+    }
+    return std::make_shared<Cgroup>(path, procs_fd);
+}
+
+void CgroupManager::removeStale() {
+    DIR* dir = opendir(parent_.c_str());
+    if (!dir) {
+        return;
+    }
+    // Instances don't outlive their server, so the cgroups of a previous run are empty
+    const std::string& own = run_prefix();
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.rfind("pim-", 0) == 0 && name.rfind(own, 0) != 0) {
+            rmdir((parent_ + "/" + name).c_str());
+        }
+    }
+    closedir(dir);
+}
@@ -0,0 +1,277 @@
+#include "common/Handoff.hpp"
+#include "common/Logger.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sstream>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+// Most descriptors the kernel accepts in a single SCM_RIGHTS message
+static constexpr std::size_t MAX_FDS = 253;
+// Signals the first process passes on to its successors
+static constexpr int FORWARDED_SIGNALS[] = {SIGTERM, SIGINT, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2};
+
+// Whether this process was started by an upgrade
+static bool successor = false;
+// Process group of the successors of the first process, 0 until it spawns one
+static volatile sig_atomic_t successor_group = 0;
+
+static long max_open_fds() {
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) {
+        max_fd = 65536;
+    }
+    return max_fd;
+}
+
+static void forward_signal(int signal) {
+    if (successor_group > 0) {
+        kill(-successor_group, signal);
+    }
+}
+
+static std::string executable_path() {
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length <= 0) {
+        return "";
+    }
+    std::string result(path, static_cast<std::size_t>(length));
+    // The binary was replaced on disk by the new build, which is the one to run
+    static const std::string DELETED = " (deleted)";
+    if (result.size() > DELETED.size() && result.compare(result.size() - DELETED.size(), DELETED.size(), DELETED) == 0) {
+        result.resize(result.size() - DELETED.size());
+    }
+    return result;
+}
+
+std::unique_ptr<Handoff> Handoff::spawn(const std::string& binary) {
+    std::string path = binary.empty() ? executable_path() : binary;
+    if (path.empty()) {
+        log_error("Handoff: cannot find the executable.");
+        return nullptr;
+    }
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+        perror("socketpair");
+        return nullptr;
+    }
+    // Everything the child needs is prepared before the fork, it only calls async-signal-safe functions
+    std::vector<std::string> variables;
+    for (char** variable = environ; *variable; ++variable) {
+        if (std::strncmp(*variable, "HANDOFF_FD=", 11) != 0) {
+            variables.emplace_back(*variable);
+        }
+    }
+    variables.emplace_back("HANDOFF_FD=" + std::to_string(sockets[1]));
+    std::vector<char*> envp;
+    for (auto& variable : variables) {
+        envp.push_back(const_cast<char*>(variable.c_str()));
+    }
+    envp.push_back(nullptr);
+    char* argv[] = {const_cast<char*>(path.c_str()), nullptr};
+    long max_fd = max_open_fds();
+    // The successors of the first process share a group, the later ones inherit it
+    bool new_group = !successor;
+    if (new_group && prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) {
+        perror("prctl");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        return nullptr;
+    }
+    if (pid == 0) {
+        if (new_group) {
+            setpgid(0, 0);
+        }
+        // The new process only gets the channel: sockets of live sessions left open here would
+        // keep the connections open after the old process closes them
+        for (int fd = 3; fd < max_fd; ++fd) {
+            if (fd != sockets[1]) {
+                close(fd);
+            }
+        }
+        fcntl(sockets[1], F_SETFD, 0);
+        // The servers wait for the upgrade signal with sigwait, the mask survives exec
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, nullptr);
+        execve(path.c_str(), argv, envp.data());
+        perror("execve");
+        _exit(127);
+    }
+    close(sockets[1]);
+    if (new_group) {
+        // Also done here, the group must exist before a signal is forwarded to it
+        setpgid(pid, pid);
+        successor_group = pid;
+    }
+    return std::unique_ptr<Handoff>(new Handoff(sockets[0], pid));
+}
+
+int Handoff::waitForSuccessors() {
+    if (successor || successor_group == 0) {
+        return 0;
+    }
+    // Sockets left open here would keep the connections of the old sessions open
+    for (int fd = 3; fd < max_open_fds(); ++fd) {
+        close(fd);
+    }
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = forward_signal;
+    sigemptyset(&action.sa_mask);
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int signal : FORWARDED_SIGNALS) {
+        sigaction(signal, &action, nullptr);
+        sigaddset(&signals, signal);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+    // Successors orphaned by their parent are reparented here, as this process is their subreaper
+    int exit_status = 0;
+    while (true) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return exit_status;
+        }
+        if (WIFEXITED(status)) {
+            exit_status = WEXITSTATUS(status);
+        } else if (WIFSIGNALED(status)) {
+            exit_status = 128 + WTERMSIG(status);
+        }
+    }
+}
+
+std::unique_ptr<Handoff> Handoff::inherit() {
+    const char* value = std::getenv("HANDOFF_FD");
+    if (!value) {
+        return nullptr;
+    }
+    int fd = std::atoi(value);
+    unsetenv("HANDOFF_FD");
+    if (fd < 3 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        return nullptr;
+    }
+    successor = true;
+    return std::unique_ptr<Handoff>(new Handoff(fd, 0));
+}
+
+Handoff::Handoff(int socket, pid_t peer) : socket_(socket), peer_(peer) {}
+
+Handoff::~Handoff() {
+    close(socket_);
+}
+
+bool Handoff::send(MessageType type, const std::string& payload, const std::vector<int>& fds) {
+    if (payload.size() > MAX_PAYLOAD || fds.size() > MAX_FDS) {
+        return false;
+    }
+    std::string data(1, static_cast<char>(type));
+    data += payload;
+    struct iovec iov = {const_cast<char*>(data.data()), data.size()};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control;
+    if (!fds.empty()) {
+        control.resize(CMSG_SPACE(fds.size() * sizeof(int)));
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    ssize_t length;
+    do {
+        length = sendmsg(socket_, &msg, MSG_NOSIGNAL);
+    } while (length < 0 && errno == EINTR);
+    return length == static_cast<ssize_t>(data.size());
+}
+
+bool Handoff::receive(Message& message, std::chrono::milliseconds timeout) {
+    if (timeout > std::chrono::milliseconds::zero()) {
+        struct pollfd pfd = {socket_, POLLIN, 0};
+        int ready;
+        do {
+            ready = poll(&pfd, 1, static_cast<int>(timeout.count()));
+        } while (ready < 0 && errno == EINTR);
+        if (ready <= 0) {
+            return false;
+        }
+    }
+    std::vector<char> data(1 + MAX_PAYLOAD);
+    std::vector<char> control(CMSG_SPACE(MAX_FDS * sizeof(int)));
+    struct iovec iov = {data.data(), data.size()};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t length;
+    do {
+        length = recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC);
+    } while (length < 0 && errno == EINTR);
+    if (length <= 0) {
+        return false;
+    }
+    message.fds.clear();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::size_t offset = message.fds.size();
+            message.fds.resize(offset + count);
+            std::memcpy(message.fds.data() + offset, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    message.type = static_cast<MessageType>(data[0]);
+    message.payload.assign(data.data() + 1, static_cast<std::size_t>(length) - 1);
+    return true;
+}
+
+pid_t Handoff::getPeer() const {
+    return peer_;
+}
+
+void Handoff::terminate() {
+    if (peer_ > 0) {
+        kill(peer_, SIGKILL);
+        waitpid(peer_, nullptr, 0);
+        peer_ = 0;
+    }
+}
+
+std::vector<int> Handoff::listeners(const Message& message, const std::string& role) {
+    std::vector<int> fds;
+    std::istringstream roles(message.payload);
+    std::string name;
+    for (std::size_t i = 0; roles >> name && i < message.fds.size(); ++i) {
+        if (name == role) {
+            fds.push_back(message.fds[i]);
+        }
+    }
+    return fds;
+}
@@ -0,0 +1,143 @@
+#include "common/IOContextPool.hpp"
+#include "common/Logger.hpp"
+#include <future>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+ExecutionMode parse_execution_mode(const std::string& mode) {
+    if (mode == "per_core") {
+        return ExecutionMode::PerCore;
+    }
+    return ExecutionMode::Shared;
+}
+
+void cancel_acceptor(boost::asio::ip::tcp::acceptor& acceptor) {
+    std::promise<void> cancelled;
+    boost::asio::post(acceptor.get_executor(), [&acceptor, &cancelled]() {
+        boost::system::error_code ignored;
+        acceptor.cancel(ignored);
+        cancelled.set_value();
+    });
+    cancelled.get_future().wait();
+}
+
+IOContextPool::IOContextPool(ExecutionMode mode, unsigned int num_threads, bool pin_threads)
+    : mode_(mode),
+      num_threads_(num_threads),
+      pin_threads_(pin_threads) {
+    if (num_threads_ == 0) {
+        num_threads_ = std::thread::hardware_concurrency();
+        if (num_threads_ == 0) {
+            num_threads_ = 1;
+        }
+    }
+    if (mode_ == ExecutionMode::PerCore) {
+        // A concurrency hint of 1 lets Asio skip the locking needed by multiple runners
+        for (unsigned int i = 0; i < num_threads_; ++i) {
+            io_contexts_.emplace_back(std::make_unique<boost::asio::io_context>(1));
+        }
+    } else {
+        io_contexts_.emplace_back(std::make_unique<boost::asio::io_context>(num_threads_));
+    }
+}
+
+IOContextPool::~IOContextPool() {
+    stop();
+}
+
+std::size_t IOContextPool::size() const {
+    return io_contexts_.size();
+}
+
+unsigned int IOContextPool::getNumThreads() const {
+    return num_threads_;
+}
+
+ExecutionMode IOContextPool::getMode() const {
+    return mode_;
+}
+
+boost::asio::io_context& IOContextPool::getIOContext(std::size_t index) {
+    return *io_contexts_[index % io_contexts_.size()];
+}
+
+std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> IOContextPool::createAcceptors(unsigned short port,
+                                                                                            const std::vector<int>& listen_fds) {
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+    // The accept handlers run on the strand of their acceptor, so that it can be cancelled from
+    // another thread
+    for (std::size_t i = 0; i < listen_fds.size(); ++i) {
+        auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(boost::asio::make_strand(getIOContext(i)));
+        acceptor->assign(boost::asio::ip::tcp::v4(), listen_fds[i]);
+        acceptors.emplace_back(std::move(acceptor));
+    }
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+    for (std::size_t i = acceptors.size(); i < io_contexts_.size(); ++i) {
+        auto acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(boost::asio::make_strand(*io_contexts_[i]));
+        acceptor->open(endpoint.protocol());
+        acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        // The kernel balances the incoming connections between the acceptors sharing the port
+        if (mode_ == ExecutionMode::PerCore) {
+            acceptor->set_option(reuse_port(true));
+        }
+        acceptor->bind(endpoint);
+        acceptor->listen();
+        acceptors.emplace_back(std::move(acceptor));
+    }
+    return acceptors;
+}
+
+void IOContextPool::run() {
+    for (unsigned int i = 0; i < num_threads_; ++i) {
+        boost::asio::io_context& io_context = getIOContext(i);
+        threads_.emplace_back([&io_context]() {
+            io_context.run();
+        });
+        if (pin_threads_) {
+            pinThread(threads_.back(), i);
+        }
+    }
+}
+
+void IOContextPool::stop() {
+    for (auto& io_context : io_contexts_) {
+        io_context->stop();
+    }
+    for (auto& t : threads_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    threads_.clear();
+}
+
+void IOContextPool::pinThread(std::thread& thread, unsigned int index) {
+    // Pick the index-th CPU among the ones the process is allowed to run on
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        log_error("Failed to get the CPU affinity, thread ", index, " not pinned.");
+        return;
+    }
+    int num_cpus = CPU_COUNT(&allowed);
+    if (num_cpus == 0) {
+        return;
+    }
+    int target = index % num_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (target-- == 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset), &cpuset) != 0) {
+                log_error("Failed to pin thread ", index, " to CPU ", cpu, ".");
+            }
+            return;
+        }
+    }
+}
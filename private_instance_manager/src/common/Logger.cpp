@@ -0,0 +1,194 @@
+#include "common/Logger.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <pthread.h>
+#include <thread>
+#include <unistd.h>
+
+// Period at which the rings are drained
+static constexpr std::chrono::milliseconds DRAIN_INTERVAL(10);
+// Period of the rate limit of a message
+static constexpr std::chrono::seconds RATE_WINDOW(1);
+// Messages with the same text printed per window by default
+static constexpr std::size_t DEFAULT_RATE_LIMIT = 10;
+
+static void write_all(int fd, const std::string& data) {
+    std::size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t written = ::write(fd, data.data() + offset, data.size() - offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        offset += static_cast<std::size_t>(written);
+    }
+}
+
+static int level_fd(LogLevel level) {
+    return level == LogLevel::Error ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+Logger& Logger::get() {
+    // Never destroyed: threads that are still running at exit can log until the end
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+Logger::Logger()
+    : forked_(false),
+      rate_limit_(DEFAULT_RATE_LIMIT),
+      started_(false),
+      flush_requests_(0),
+      flushed_(0) {
+    pthread_atfork(nullptr, nullptr, []() {
+        Logger::get().forked_.store(true, std::memory_order_relaxed);
+    });
+    // What is still queued when the process exits is written before
+    std::atexit([]() {
+        Logger::get().flush();
+    });
+}
+
+void Logger::setRateLimit(std::size_t per_second) {
+    rate_limit_.store(per_second, std::memory_order_relaxed);
+}
+
+void Logger::flush() {
+    if (forked_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!started_) {
+        return;
+    }
+    std::uint64_t request = ++flush_requests_;
+    wake_.notify_one();
+    flushed_condition_.wait(lock, [this, request]() {
+        return flushed_ >= request;
+    });
+}
+
+Logger::Ring& Logger::threadRing() {
+    // Owned by every thread that logged something, the ring outlives the thread until it is drained
+    struct ThreadRing {
+        std::shared_ptr<Ring> ring;
+        ~ThreadRing() {
+            if (ring) {
+                ring->closed.store(true, std::memory_order_release);
+            }
+        }
+    };
+    thread_local ThreadRing local;
+    if (!local.ring) {
+        local.ring = std::make_shared<Ring>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(local.ring);
+        // Started with the first message, so that a process can still fork while single-threaded
+        // as long as it didn't log anything
+        if (!started_) {
+            started_ = true;
+            std::thread([this]() {
+                run();
+            }).detach();
+        }
+    }
+    return *local.ring;
+}
+
+void Logger::run() {
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait_for(lock, DRAIN_INTERVAL, [this]() {
+            return flush_requests_ != flushed_;
+        });
+        std::uint64_t requests = flush_requests_;
+        // Rings of the threads that exited are dropped once empty
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<Ring>& ring) {
+            return ring->closed.load(std::memory_order_acquire) && ring->empty();
+        }), rings_.end());
+        rings = rings_;
+        lock.unlock();
+        drain(rings, requests != flushed_);
+        rings.clear();
+        lock.lock();
+        flushed_ = requests;
+        flushed_condition_.notify_all();
+    }
+}
+
+void Logger::drain(std::vector<std::shared_ptr<Ring>>& rings, bool flushing) {
+    std::vector<Entry> entries;
+    std::uint64_t dropped = 0;
+    for (auto& ring : rings) {
+        ring->drain([&entries](const Record& record) {
+            entries.push_back({record.time, record.level, std::string(record.data.data(), record.size), record.text_size});
+        });
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+    // Every ring is in order, the threads are interleaved by time
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.time < b.time;
+    });
+    std::string output[2];
+    auto write_line = [&output](LogLevel level, const std::string& line) {
+        std::string& stream = output[level == LogLevel::Error ? 1 : 0];
+        stream += line;
+        stream += '\n';
+    };
+    auto summary = [](const std::string& text, std::size_t suppressed) {
+        return text + " (" + std::to_string(suppressed) + " similar messages suppressed)";
+    };
+    std::size_t limit = rate_limit_.load(std::memory_order_relaxed);
+    for (auto& entry : entries) {
+        if (limit == 0) {
+            write_line(entry.level, entry.text);
+            continue;
+        }
+        std::string key(1, static_cast<char>(entry.level));
+        key.append(entry.text, 0, entry.text_size);
+        auto [it, inserted] = windows_.try_emplace(std::move(key));
+        Window& window = it->second;
+        if (inserted || entry.time - window.start >= RATE_WINDOW) {
+            if (window.suppressed > 0) {
+                write_line(window.level, summary(it->first.substr(1), window.suppressed));
+            }
+            window.start = entry.time;
+            window.level = entry.level;
+            window.count = 0;
+            window.suppressed = 0;
+        }
+        if (window.count < limit) {
+            ++window.count;
+            write_line(entry.level, entry.text);
+        } else {
+            ++window.suppressed;
+        }
+    }
+    // Windows that ended are summed up and forgotten, all of them before a flush
+    Clock::time_point now = Clock::now();
+    for (auto it = windows_.begin(); it != windows_.end();) {
+        if (flushing || now - it->second.start >= RATE_WINDOW) {
+            if (it->second.suppressed > 0) {
+                write_line(it->second.level, summary(it->first.substr(1), it->second.suppressed));
+            }
+            it = windows_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (dropped > 0) {
+        write_line(LogLevel::Error, "Logger: " + std::to_string(dropped) + " messages dropped, a queue was full");
+    }
+    write_all(level_fd(LogLevel::Info), output[0]);
+    write_all(level_fd(LogLevel::Error), output[1]);
+}
+
+void Logger::writeNow(const Record& record) {
+    std::string line(record.data.data(), record.size);
+    line += '\n';
+    write_all(level_fd(record.level), line);
+}
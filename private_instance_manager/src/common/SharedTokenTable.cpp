@@ -0,0 +1,292 @@
+#include "common/SharedTokenTable.hpp"
+#include "common/TokenTable.hpp"
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr std::uint64_t TABLE_MAGIC = 0x50494d544f4b454eULL; // "PIMTOKEN"
+static constexpr std::uint32_t TABLE_VERSION = 2;
+// Longest probe sequence, for both the writer and the readers
+static constexpr std::uint32_t MAX_PROBE = 64;
+// Attempts at reading a slot that is being written before giving up
+static constexpr int MAX_READ_RETRIES = 8;
+
+enum SlotState : std::uint32_t {
+    SLOT_EMPTY = 0,
+    SLOT_USED = 1,
+    SLOT_TOMBSTONE = 2
+};
+
+struct SharedTokenTable::Header {
+    std::uint64_t magic;
+    std::uint32_t version;
+    std::uint32_t capacity;
+    std::atomic<std::int64_t> heartbeat;
+    char padding[40];
+};
+
+struct SharedTokenTable::Record {
+    std::uint8_t uuid[16];
+    std::int64_t expires_at;
+    std::uint32_t state;
+    std::uint16_t port;
+    std::uint16_t padding;
+    char address[MAX_ADDRESS_LENGTH + 1];
+};
+
+static constexpr std::size_t RECORD_WORDS = 12;
+
+// The record is copied word by word with relaxed atomics, so that concurrent reads and writes
+// are well defined and the seqlock only has to tell whether the copy is consistent
+struct SharedTokenTable::Slot {
+    std::atomic<std::uint64_t> seq;
+    std::atomic<std::uint64_t> words[RECORD_WORDS];
+};
+
+static_assert(sizeof(std::atomic<std::uint64_t>) == sizeof(std::uint64_t), "Atomics must not add state");
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Atomics in shared memory must be lock-free");
+
+static std::int64_t unix_now() {
+    return static_cast<std::int64_t>(std::time(nullptr));
+}
+
+std::unique_ptr<SharedTokenTable> SharedTokenTable::create(const std::string& name, std::uint32_t capacity, long group) {
+    static_assert(sizeof(Record) == RECORD_WORDS * sizeof(std::uint64_t), "Record must fill the slot words");
+    // Power of two capacity, so that the probe sequence is a mask
+    std::uint32_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    std::size_t size = sizeof(Header) + static_cast<std::size_t>(rounded) * sizeof(Slot);
+    // Readers still mapping an old segment notice that its heartbeat stops and reopen it
+    shm_unlink(name.c_str());
+    mode_t mode = group >= 0 ? 0640 : 0600;
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, mode);
+    if (fd < 0) {
+        perror("shm_open");
+        return nullptr;
+    }
+    // Given to the group before anything is written, and never readable by the other users
+    if (group >= 0 && fchown(fd, static_cast<uid_t>(-1), static_cast<gid_t>(group)) != 0) {
+        perror("fchown");
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    if (fchmod(fd, mode) != 0) {
+        perror("fchmod");
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    // ftruncate zero-fills the segment: every slot starts empty with an even sequence
+    auto table = std::unique_ptr<SharedTokenTable>(new SharedTokenTable(name, memory, size, true));
+    table->header_->capacity = rounded;
+    table->header_->version = TABLE_VERSION;
+    table->header_->heartbeat.store(unix_now(), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    // The magic is written last, readers reject the segment until it is initialized
+    table->header_->magic = TABLE_MAGIC;
+    return table;
+}
+
+std::unique_ptr<SharedTokenTable> SharedTokenTable::open(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return nullptr;
+    }
+    std::size_t size = st.st_size;
+    void* memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    auto table = std::unique_ptr<SharedTokenTable>(new SharedTokenTable(name, memory, size, false));
+    const Header* header = table->header_;
+    if (header->magic != TABLE_MAGIC || header->version != TABLE_VERSION
+        || size != sizeof(Header) + static_cast<std::size_t>(header->capacity) * sizeof(Slot)) {
+        return nullptr;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return table;
+}
+
+SharedTokenTable::SharedTokenTable(const std::string& name, void* memory, std::size_t size, bool writer)
+    : name_(name),
+      memory_(memory),
+      size_(size),
+      writer_(writer),
+      header_(static_cast<Header*>(memory)),
+      slots_(reinterpret_cast<Slot*>(static_cast<char*>(memory) + sizeof(Header))) {}
+
+SharedTokenTable::~SharedTokenTable() {
+    munmap(memory_, size_);
+    if (writer_) {
+        shm_unlink(name_.c_str());
+    }
+}
+
+SharedTokenTable::Slot& SharedTokenTable::slotAt(std::uint32_t index) const {
+    return slots_[index & (header_->capacity - 1)];
+}
+
+std::uint32_t SharedTokenTable::homeSlot(const boost::uuids::uuid& uuid) const {
+    // Tokens stored with PUT are chosen by the clients, they are hashed like in the API table
+    return static_cast<std::uint32_t>(TokenTable::hashOf(uuid.data)) & (header_->capacity - 1);
+}
+
+bool SharedTokenTable::readRecord(const Slot& slot, Record& record) const {
+    std::uint64_t words[RECORD_WORDS];
+    for (int attempt = 0; attempt < MAX_READ_RETRIES; ++attempt) {
+        std::uint64_t before = slot.seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            // Write in progress
+            continue;
+        }
+        for (std::size_t i = 0; i < RECORD_WORDS; ++i) {
+            words[i] = slot.words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) == before) {
+            std::memcpy(&record, words, sizeof(record));
+            return true;
+        }
+    }
+    return false;
+}
+
+void SharedTokenTable::writeRecord(Slot& slot, const Record& record) {
+    std::uint64_t words[RECORD_WORDS];
+    std::memcpy(words, &record, sizeof(record));
+    std::uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < RECORD_WORDS; ++i) {
+        slot.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
+
+bool SharedTokenTable::put(const boost::uuids::uuid& uuid, const std::string& address, unsigned short port, std::int64_t expires_at) {
+    if (!writer_ || address.size() > MAX_ADDRESS_LENGTH) {
+        return false;
+    }
+    Record record;
+    std::memset(&record, 0, sizeof(record));
+    std::memcpy(record.uuid, uuid.data, sizeof(record.uuid));
+    record.expires_at = expires_at;
+    record.state = SLOT_USED;
+    record.port = port;
+    std::memcpy(record.address, address.data(), address.size());
+
+    std::uint32_t home = homeSlot(uuid);
+    Slot* free_slot = nullptr;
+    Record current;
+    for (std::uint32_t i = 0; i < MAX_PROBE; ++i) {
+        Slot& slot = slotAt(home + i);
+        // The writer is alone, its reads always succeed
+        readRecord(slot, current);
+        if (current.state == SLOT_USED && std::memcmp(current.uuid, record.uuid, sizeof(record.uuid)) == 0) {
+            writeRecord(slot, record);
+            return true;
+        }
+        if (current.state != SLOT_USED && !free_slot) {
+            free_slot = &slot;
+        }
+        if (current.state == SLOT_EMPTY) {
+            // End of the probe sequence, the token is not in the table
+            break;
+        }
+    }
+    if (!free_slot) {
+        return false;
+    }
+    writeRecord(*free_slot, record);
+    return true;
+}
+
+void SharedTokenTable::erase(const boost::uuids::uuid& uuid) {
+    if (!writer_) {
+        return;
+    }
+    std::uint32_t home = homeSlot(uuid);
+    Record current;
+    for (std::uint32_t i = 0; i < MAX_PROBE; ++i) {
+        readRecord(slotAt(home + i), current);
+        if (current.state == SLOT_EMPTY) {
+            return;
+        }
+        if (current.state != SLOT_USED || std::memcmp(current.uuid, uuid.data, sizeof(current.uuid)) != 0) {
+            continue;
+        }
+        Record tombstone;
+        std::memset(&tombstone, 0, sizeof(tombstone));
+        tombstone.state = SLOT_TOMBSTONE;
+        writeRecord(slotAt(home + i), tombstone);
+        // Tombstones at the end of a probe sequence are not needed anymore, turn them back
+        // into empty slots so that the sequences don't grow forever under churn
+        readRecord(slotAt(home + i + 1), current);
+        if (current.state == SLOT_EMPTY) {
+            Record empty;
+            std::memset(&empty, 0, sizeof(empty));
+            std::uint32_t index = home + i;
+            for (std::uint32_t cleared = 0; cleared < header_->capacity; ++cleared, --index) {
+                readRecord(slotAt(index), current);
+                if (current.state != SLOT_TOMBSTONE) {
+                    break;
+                }
+                writeRecord(slotAt(index), empty);
+            }
+        }
+        return;
+    }
+}
+
+void SharedTokenTable::heartbeat() {
+    header_->heartbeat.store(unix_now(), std::memory_order_relaxed);
+}
+
+std::optional<SharedTokenTable::Entry> SharedTokenTable::lookup(const boost::uuids::uuid& uuid) const {
+    std::uint32_t home = homeSlot(uuid);
+    Record record;
+    for (std::uint32_t i = 0; i < MAX_PROBE; ++i) {
+        if (!readRecord(slotAt(home + i), record)) {
+            // The slot kept changing under us, let the API answer
+            return std::nullopt;
+        }
+        if (record.state == SLOT_EMPTY) {
+            return std::nullopt;
+        }
+        if (record.state == SLOT_USED && std::memcmp(record.uuid, uuid.data, sizeof(record.uuid)) == 0) {
+            record.address[MAX_ADDRESS_LENGTH] = '\0';
+            return Entry{std::string(record.address), record.port, record.expires_at};
+        }
+    }
+    return std::nullopt;
+}
+
+bool SharedTokenTable::isAlive(std::int64_t max_age) const {
+    return unix_now() - header_->heartbeat.load(std::memory_order_relaxed) <= max_age;
+}
@@ -0,0 +1,93 @@
+#include "common/TimerWheel.hpp"
+
+TimerWheel::TimerWheel(boost::asio::io_context& io_context, Clock::duration tick, std::size_t num_slots)
+    : timer_(io_context),
+      tick_(tick),
+      origin_(Clock::now()),
+      ticks_(0),
+      slots_(num_slots == 0 ? 1 : num_slots),
+      size_(0) {}
+
+void TimerWheel::start() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        origin_ = Clock::now();
+        ticks_ = 0;
+    }
+    scheduleTick();
+}
+
+void TimerWheel::stop() {
+    timer_.cancel();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+        slot.clear();
+    }
+    size_ = 0;
+}
+
+void TimerWheel::schedule(Clock::time_point when, Callback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_[slotFor(when)].push_back(Entry{when, std::move(callback)});
+    ++size_;
+}
+
+std::size_t TimerWheel::size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+}
+
+std::size_t TimerWheel::slotFor(Clock::time_point when) const {
+    // Entries due in the past go in the next slot to be processed
+    std::uint64_t tick = ticks_ + 1;
+    if (when > origin_) {
+        // Round up, so that the entry is never processed before it is due
+        Clock::duration delay = when - origin_;
+        std::uint64_t when_tick = static_cast<std::uint64_t>(delay / tick_) + (delay % tick_ != Clock::duration::zero() ? 1 : 0);
+        if (when_tick > tick) {
+            tick = when_tick;
+        }
+    }
+    return tick % slots_.size();
+}
+
+void TimerWheel::scheduleTick() {
+    timer_.expires_at(origin_ + tick_ * (ticks_ + 1));
+    timer_.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec) {
+            onTick();
+            scheduleTick();
+        }
+    });
+}
+
+void TimerWheel::onTick() {
+    Clock::time_point now = Clock::now();
+    std::vector<Entry> due;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Catch up with all the ticks elapsed since the last run
+        while (origin_ + tick_ * (ticks_ + 1) <= now) {
+            ++ticks_;
+            auto& slot = slots_[ticks_ % slots_.size()];
+            for (std::size_t i = 0; i < slot.size();) {
+                if (slot[i].when <= now) {
+                    due.push_back(std::move(slot[i]));
+                    slot[i] = std::move(slot.back());
+                    slot.pop_back();
+                    --size_;
+                } else {
+                    // Due in a later round of the wheel
+                    ++i;
+                }
+            }
+        }
+    }
+    // Run the callbacks outside of the lock, they can schedule new entries
+    for (auto& entry : due) {
+        std::optional<Clock::time_point> next = entry.callback();
+        if (next) {
+            schedule(*next, std::move(entry.callback));
+        }
+    }
+}
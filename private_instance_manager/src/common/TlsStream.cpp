@@ -0,0 +1,150 @@
+#include "common/TlsStream.hpp"
+#include <openssl/err.h>
+#include <cerrno>
+
+TlsContext::TlsContext(const std::string& certificate_file, const std::string& key_file, bool ktls, long session_cache_size)
+    : context_(boost::asio::ssl::context::tls_server), ktls_(ktls) {
+    context_.set_options(boost::asio::ssl::context::default_workarounds
+                         | boost::asio::ssl::context::no_sslv2
+                         | boost::asio::ssl::context::no_sslv3
+                         | boost::asio::ssl::context::no_tlsv1
+                         | boost::asio::ssl::context::no_tlsv1_1);
+    context_.use_certificate_chain_file(certificate_file);
+    context_.use_private_key_file(key_file, boost::asio::ssl::context::pem);
+    SSL_CTX* ctx = context_.native_handle();
+    // Resumption by session id from the server cache, or statelessly with the tickets (encrypted
+    // with keys generated for this context)
+    static const unsigned char SESSION_ID_CONTEXT[] = "tunnel";
+    SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, session_cache_size);
+    SSL_CTX_set_num_tickets(ctx, 2);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls_) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    ktls_ = false;
+#endif
+}
+
+SSL_CTX* TlsContext::nativeHandle() {
+    return context_.native_handle();
+}
+
+bool TlsContext::ktls() const {
+    return ktls_;
+}
+
+TlsStream::TlsStream(boost::asio::ip::tcp::socket& socket)
+    : socket_(socket), ssl_(nullptr), kernel_send_(false), kernel_receive_(false) {}
+
+TlsStream::~TlsStream() {
+    clear();
+}
+
+bool TlsStream::reset(TlsContext& context) {
+    clear();
+    ssl_ = SSL_new(context.nativeHandle());
+    if (!ssl_) {
+        return false;
+    }
+    // OpenSSL does its own non-blocking I/O on the descriptor, Asio only waits for readiness
+    boost::system::error_code ec;
+    socket_.non_blocking(true, ec);
+    if (ec || SSL_set_fd(ssl_, socket_.native_handle()) != 1) {
+        clear();
+        return false;
+    }
+    SSL_set_accept_state(ssl_);
+    return true;
+}
+
+void TlsStream::clear() {
+    if (ssl_) {
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+    }
+    kernel_send_ = false;
+    kernel_receive_ = false;
+}
+
+TlsStream::executor_type TlsStream::get_executor() {
+    return socket_.get_executor();
+}
+
+void TlsStream::shutdown() {
+    if (ssl_ && socket_.is_open() && SSL_is_init_finished(ssl_)) {
+        SSL_shutdown(ssl_);
+        ERR_clear_error();
+    }
+}
+
+bool TlsStream::kernelSend() const {
+    return kernel_send_;
+}
+
+bool TlsStream::kernelReceive() const {
+    return kernel_receive_;
+}
+
+bool TlsStream::sessionReused() const {
+    return ssl_ && SSL_session_reused(ssl_);
+}
+
+TlsStream::Attempt TlsStream::attempt(Operation operation, void* data, std::size_t size) {
+    Attempt result;
+    if (!ssl_) {
+        result.ec = boost::asio::error::bad_descriptor;
+        return result;
+    }
+    ERR_clear_error();
+    errno = 0;
+    int ret = 0;
+    switch (operation) {
+        case Operation::Handshake:
+            ret = SSL_do_handshake(ssl_);
+            break;
+        case Operation::Read:
+            ret = SSL_read_ex(ssl_, data, size, &result.bytes);
+            break;
+        case Operation::Write:
+            ret = SSL_write_ex(ssl_, data, size, &result.bytes);
+            break;
+    }
+    if (ret == 1) {
+        if (operation == Operation::Handshake) {
+#ifndef OPENSSL_NO_KTLS
+            // OpenSSL enabled kTLS on the socket if the kernel supports the negotiated cipher
+            kernel_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+            kernel_receive_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_)) && SSL_pending(ssl_) == 0;
+#endif
+        }
+        return result;
+    }
+    result.bytes = 0;
+    switch (SSL_get_error(ssl_, ret)) {
+        case SSL_ERROR_WANT_READ:
+            result.wait = true;
+            result.wait_type = boost::asio::socket_base::wait_read;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            result.wait = true;
+            result.wait_type = boost::asio::socket_base::wait_write;
+            break;
+        case SSL_ERROR_ZERO_RETURN:
+            result.ec = boost::asio::error::eof;
+            break;
+        case SSL_ERROR_SYSCALL:
+            if (errno != 0) {
+                result.ec = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            } else {
+                result.ec = boost::asio::ssl::error::stream_truncated;
+            }
+            break;
+        default:
+            result.ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+            break;
+    }
+    return result;
+}
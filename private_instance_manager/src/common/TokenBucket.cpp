@@ -0,0 +1,72 @@
+#include "common/TokenBucket.hpp"
+#include <algorithm>
+
+static constexpr std::int64_t NANOSECONDS_PER_SECOND = 1000000000;
+
+TokenBucket::TokenBucket(std::uint64_t rate, std::uint64_t burst)
+    : rate_(rate),
+      burst_(burst),
+      tat_(0) {}
+
+void TokenBucket::setRate(std::uint64_t rate, std::uint64_t burst) {
+    rate_.store(rate, std::memory_order_relaxed);
+    burst_.store(burst, std::memory_order_relaxed);
+}
+
+void TokenBucket::shareRate(std::shared_ptr<const std::atomic<std::uint64_t>> rate) {
+    shared_rate_ = std::move(rate);
+}
+
+std::uint64_t TokenBucket::getRate() const {
+    return currentRate();
+}
+
+bool TokenBucket::isUnlimited() const {
+    return currentRate() == 0;
+}
+
+TokenBucket::Clock::duration TokenBucket::charge(std::size_t bytes, Clock::time_point now) {
+    std::uint64_t rate = currentRate();
+    if (rate == 0) {
+        return Clock::duration::zero();
+    }
+    std::int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    std::int64_t cost_ns = static_cast<std::int64_t>(bytes * NANOSECONDS_PER_SECOND / rate);
+    std::int64_t burst_ns = static_cast<std::int64_t>(burst_.load(std::memory_order_relaxed) * NANOSECONDS_PER_SECOND / rate);
+    std::int64_t tat = tat_.load(std::memory_order_relaxed);
+    std::int64_t new_tat;
+    do {
+        // An idle bucket does not accumulate more than the burst
+        new_tat = std::max(tat, now_ns) + cost_ns;
+    } while (!tat_.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed));
+    // The transfer is within the burst as long as the arrival time is less than a burst ahead
+    std::int64_t delay_ns = new_tat - burst_ns - now_ns;
+    if (delay_ns <= 0) {
+        return Clock::duration::zero();
+    }
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(delay_ns));
+}
+
+bool TokenBucket::tryCharge(std::size_t bytes, Clock::time_point now) {
+    std::uint64_t rate = currentRate();
+    if (rate == 0) {
+        return true;
+    }
+    std::int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+    std::int64_t cost_ns = static_cast<std::int64_t>(bytes * NANOSECONDS_PER_SECOND / rate);
+    std::int64_t burst_ns = static_cast<std::int64_t>(burst_.load(std::memory_order_relaxed) * NANOSECONDS_PER_SECOND / rate);
+    std::int64_t tat = tat_.load(std::memory_order_relaxed);
+    std::int64_t new_tat;
+    do {
+        new_tat = std::max(tat, now_ns) + cost_ns;
+        // Rejected bytes are not charged, so a sender over its rate still gets its share through
+        if (new_tat - burst_ns > now_ns) {
+            return false;
+        }
+    } while (!tat_.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed));
+    return true;
+}
+
+std::uint64_t TokenBucket::currentRate() const {
+    return (shared_rate_ ? *shared_rate_ : rate_).load(std::memory_order_relaxed);
+}
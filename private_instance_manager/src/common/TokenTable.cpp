@@ -0,0 +1,233 @@
+#include "common/TokenTable.hpp"
+#include <algorithm>
+#include <cstring>
+
+enum TokenState : std::uint16_t {
+    TOKEN_EMPTY = 0,
+    TOKEN_USED = 1,
+    TOKEN_TOMBSTONE = 2
+};
+
+static_assert(sizeof(TokenRecord) == 28, "Token records must stay compact");
+
+// Home slots a scan looks at per token it may return, so that a mostly empty table is walked
+// in several calls
+static constexpr std::size_t SCAN_SLOTS_PER_TOKEN = 8;
+
+static unsigned capacity_shift(std::size_t capacity) {
+    unsigned shift = 64;
+    while (capacity > 1) {
+        capacity >>= 1;
+        --shift;
+    }
+    return shift;
+}
+
+static std::size_t round_capacity(std::size_t capacity) {
+    std::size_t rounded = 16;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+    return rounded;
+}
+
+TokenTable::TokenTable(std::size_t initial_capacity)
+    : epoch_(Clock::now()),
+      slots_(round_capacity(initial_capacity)),
+      shift_(capacity_shift(slots_.size())),
+      size_(0),
+      tombstones_(0) {}
+
+std::uint32_t TokenTable::now() const {
+    return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - epoch_).count());
+}
+
+std::uint64_t TokenTable::hashOf(const std::uint8_t* uuid) {
+    // Tokens stored with PUT are chosen by the clients, mix all the bytes (splitmix64 finalizer)
+    std::uint64_t words[2];
+    std::memcpy(words, uuid, sizeof(words));
+    std::uint64_t hash = words[0] ^ (words[1] * 0x9e3779b97f4a7c15ULL);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+std::size_t TokenTable::homeSlot(std::uint64_t hash) const {
+    return hash >> shift_;
+}
+
+std::size_t TokenTable::findSlot(const boost::uuids::uuid& uuid) const {
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t index = homeSlot(hashOf(uuid.data)), probes = 0; probes < slots_.size(); index = (index + 1) & mask, ++probes) {
+        const TokenRecord& record = slots_[index];
+        if (record.state == TOKEN_EMPTY) {
+            break;
+        }
+        if (record.state == TOKEN_USED && std::memcmp(record.uuid, uuid.data, sizeof(record.uuid)) == 0) {
+            return index;
+        }
+    }
+    return slots_.size();
+}
+
+bool TokenTable::insert(const boost::uuids::uuid& uuid, const std::string& address, unsigned short port, long ttl) {
+    if ((size_ + tombstones_ + 1) * 4 > slots_.size() * 3) {
+        // Grow only if the live tokens need it, otherwise just drop the tombstones
+        rehash(size_ * 2 + 2 > slots_.size() ? slots_.size() * 2 : slots_.size());
+    }
+    std::size_t mask = slots_.size() - 1;
+    std::size_t free_slot = slots_.size();
+    std::size_t index = homeSlot(hashOf(uuid.data));
+    for (std::size_t probes = 0; probes < slots_.size(); index = (index + 1) & mask, ++probes) {
+        const TokenRecord& record = slots_[index];
+        if (record.state == TOKEN_EMPTY) {
+            if (free_slot == slots_.size()) {
+                free_slot = index;
+            }
+            break;
+        }
+        if (record.state == TOKEN_TOMBSTONE) {
+            if (free_slot == slots_.size()) {
+                free_slot = index;
+            }
+        } else if (std::memcmp(record.uuid, uuid.data, sizeof(record.uuid)) == 0) {
+            return false;
+        }
+    }
+    TokenRecord& record = slots_[free_slot];
+    if (record.state == TOKEN_TOMBSTONE) {
+        --tombstones_;
+    }
+    std::memcpy(record.uuid, uuid.data, sizeof(record.uuid));
+    record.address_id = addresses_.intern(address);
+    record.port = port;
+    record.state = TOKEN_USED;
+    setTimeRemaining(record, ttl);
+    ++size_;
+    return true;
+}
+
+const TokenRecord* TokenTable::find(const boost::uuids::uuid& uuid) const {
+    std::size_t index = findSlot(uuid);
+    return index == slots_.size() ? nullptr : &slots_[index];
+}
+
+TokenRecord* TokenTable::find(const boost::uuids::uuid& uuid) {
+    std::size_t index = findSlot(uuid);
+    return index == slots_.size() ? nullptr : &slots_[index];
+}
+
+bool TokenTable::erase(const boost::uuids::uuid& uuid) {
+    std::size_t index = findSlot(uuid);
+    if (index == slots_.size()) {
+        return false;
+    }
+    eraseSlot(index);
+    return true;
+}
+
+void TokenTable::eraseSlot(std::size_t index) {
+    TokenRecord& record = slots_[index];
+    addresses_.release(record.address_id);
+    std::memset(&record, 0, sizeof(record));
+    record.state = TOKEN_TOMBSTONE;
+    ++tombstones_;
+    --size_;
+}
+
+std::size_t TokenTable::removeExpired(const std::function<void(const TokenRecord&)>& on_remove) {
+    std::uint32_t current = now();
+    std::size_t removed = 0;
+    for (std::size_t index = 0; index < slots_.size(); ++index) {
+        const TokenRecord& record = slots_[index];
+        if (record.state == TOKEN_USED && record.deadline < current) {
+            if (on_remove) {
+                on_remove(record);
+            }
+            eraseSlot(index);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+std::uint64_t TokenTable::scan(std::uint64_t cursor, std::size_t limit, const std::function<void(const TokenRecord&)>& callback) const {
+    std::size_t mask = slots_.size() - 1;
+    std::size_t visited = 0;
+    std::size_t max_homes = std::max<std::size_t>(limit, 1) * SCAN_SLOTS_PER_TOKEN;
+    std::vector<std::pair<std::uint64_t, std::size_t>> bucket;
+    for (std::size_t home = homeSlot(cursor), homes = 0; home < slots_.size(); ++home, ++homes) {
+        if (homes == max_homes) {
+            // Resume at the start of this slot
+            return cursor;
+        }
+        // The tokens whose home is this slot are in the run of used slots starting there
+        bucket.clear();
+        for (std::size_t index = home, probes = 0; probes < slots_.size(); index = (index + 1) & mask, ++probes) {
+            const TokenRecord& record = slots_[index];
+            if (record.state == TOKEN_EMPTY) {
+                break;
+            }
+            if (record.state != TOKEN_USED) {
+                continue;
+            }
+            std::uint64_t hash = hashOf(record.uuid);
+            if (homeSlot(hash) == home && hash >= cursor) {
+                bucket.emplace_back(hash, index);
+            }
+        }
+        std::sort(bucket.begin(), bucket.end());
+        for (const auto& [hash, index] : bucket) {
+            if (visited == limit) {
+                // Resume in the middle of the slot
+                return hash;
+            }
+            callback(slots_[index]);
+            ++visited;
+        }
+        // Start of the next slot in the hash space, 0 after the last one
+        cursor = home + 1 == slots_.size() ? 0 : static_cast<std::uint64_t>(home + 1) << shift_;
+        if (visited == limit) {
+            return cursor;
+        }
+    }
+    return 0;
+}
+
+void TokenTable::rehash(std::size_t capacity) {
+    std::vector<TokenRecord> old_slots(capacity);
+    old_slots.swap(slots_);
+    shift_ = capacity_shift(slots_.size());
+    tombstones_ = 0;
+    std::size_t mask = slots_.size() - 1;
+    for (const TokenRecord& record : old_slots) {
+        if (record.state != TOKEN_USED) {
+            continue;
+        }
+        std::size_t index = homeSlot(hashOf(record.uuid));
+        while (slots_[index].state != TOKEN_EMPTY) {
+            index = (index + 1) & mask;
+        }
+        slots_[index] = record;
+    }
+}
+
+const std::string& TokenTable::getAddress(const TokenRecord& record) const {
+    return addresses_.get(record.address_id);
+}
+
+long TokenTable::timeRemaining(const TokenRecord& record) const {
+    return static_cast<long>(record.deadline) - static_cast<long>(now());
+}
+
+void TokenTable::setTimeRemaining(TokenRecord& record, long ttl) const {
+    record.deadline = now() + static_cast<std::uint32_t>(ttl > 0 ? ttl : 0);
+}
+
+std::size_t TokenTable::size() const {
+    return size_;
+}
+
+std::size_t TokenTable::capacity() const {
+    return slots_.size();
+}
@@ -0,0 +1,104 @@
+#include "common/TrafficShaper.hpp"
+#include <algorithm>
+
+TrafficShaper::TrafficShaper(std::uint64_t session_rate, std::uint64_t token_rate, std::uint64_t global_rate,
+                             std::uint64_t burst)
+    : session_rate_(session_rate),
+      token_rate_(token_rate),
+      global_rate_(global_rate),
+      burst_(burst),
+      active_tokens_(0),
+      fair_share_(std::make_shared<std::atomic<std::uint64_t>>(0)),
+      last_prune_(std::chrono::steady_clock::now()) {
+    rebalance();
+}
+
+std::shared_ptr<TokenUsage> TrafficShaper::acquire(const std::string& token, std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prune();
+    auto& usage = tokens_[token];
+    if (!usage) {
+        usage = std::make_shared<TokenUsage>();
+        usage->bucket.setRate(token_rate_, burst_);
+        if (global_rate_ != 0) {
+            usage->bucket.shareRate(fair_share_);
+        }
+    }
+    usage->deadline = std::max(usage->deadline, deadline);
+    if (usage->sessions.fetch_add(1, std::memory_order_relaxed) == 0) {
+        ++active_tokens_;
+        rebalance();
+    }
+    return usage;
+}
+
+void TrafficShaper::release(const std::string& token) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tokens_.find(token);
+    if (it == tokens_.end()) {
+        return;
+    }
+    if (it->second->sessions.fetch_sub(1, std::memory_order_relaxed) == 1) {
+        --active_tokens_;
+        rebalance();
+    }
+}
+
+std::optional<TokenUsageSnapshot> TrafficShaper::getUsage(const std::string& token) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = tokens_.find(token);
+    if (it == tokens_.end()) {
+        return std::nullopt;
+    }
+    return TokenUsageSnapshot{it->second->bytes_up.load(std::memory_order_relaxed),
+                              it->second->bytes_down.load(std::memory_order_relaxed),
+                              it->second->sessions.load(std::memory_order_relaxed),
+                              it->second->bucket.getRate()};
+}
+
+TokenUsageSnapshot TrafficShaper::getTotalUsage() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TokenUsageSnapshot total{0, 0, 0, global_rate_};
+    for (auto& [token, usage] : tokens_) {
+        total.bytes_up += usage->bytes_up.load(std::memory_order_relaxed);
+        total.bytes_down += usage->bytes_down.load(std::memory_order_relaxed);
+        total.sessions += usage->sessions.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+std::uint64_t TrafficShaper::getSessionRate() const {
+    return session_rate_;
+}
+
+std::uint64_t TrafficShaper::getBurst() const {
+    return burst_;
+}
+
+void TrafficShaper::rebalance() {
+    if (global_rate_ == 0) {
+        return;
+    }
+    // Fair share of the global rate, never below one burst per second
+    std::uint64_t share = std::max<std::uint64_t>(global_rate_ / std::max<std::size_t>(active_tokens_, 1), burst_);
+    if (token_rate_ != 0) {
+        share = std::min(share, token_rate_);
+    }
+    fair_share_->store(share, std::memory_order_relaxed);
+}
+
+void TrafficShaper::prune() {
+    // Scanning the registry at every new session would make opening sessions O(tokens)
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_prune_ < std::chrono::seconds(1)) {
+        return;
+    }
+    last_prune_ = now;
+    for (auto it = tokens_.begin(); it != tokens_.end();) {
+        if (it->second->sessions.load(std::memory_order_relaxed) == 0 && it->second->deadline < now) {
+            it = tokens_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
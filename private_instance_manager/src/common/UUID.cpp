@@ -1,7 +1,69 @@
 #include "common/UUID.hpp"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sys/random.h>
+
+// UUIDs drawn from the kernel at once by every thread
+static constexpr std::size_t UUID_BATCH = 256;
+
+// Bumped in a forked child, whose buffers hold the same bytes as its parent's
+static std::atomic<std::uint64_t> fork_generation(0);
+
+// Random bytes of a thread, taken from the kernel's CSPRNG in batches. A batch costs one getrandom
+// call, the UUIDs are then copied out of it without any syscall or lock. Used bytes are wiped, so
+// that the buffer never holds a token that was handed out
+struct RandomBatch {
+    std::array<std::uint8_t, UUID_BATCH * 16> bytes;
+    std::size_t offset = UUID_BATCH * 16;
+    std::uint64_t generation = 0;
+
+    bool refill() {
+        std::size_t filled = 0;
+        while (filled < bytes.size()) {
+            ssize_t length = getrandom(bytes.data() + filled, bytes.size() - filled, 0);
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            filled += static_cast<std::size_t>(length);
+        }
+        offset = 0;
+        return true;
+    }
+};
+
+static boost::uuids::uuid random_uuid() {
+    static const bool fork_handler = pthread_atfork(nullptr, nullptr, []() {
+        fork_generation.fetch_add(1, std::memory_order_relaxed);
+    }) == 0;
+    (void)fork_handler;
+    thread_local RandomBatch batch;
+    std::uint64_t generation = fork_generation.load(std::memory_order_relaxed);
+    if (batch.generation != generation) {
+        batch.generation = generation;
+        batch.offset = batch.bytes.size();
+    }
+    if (batch.offset == batch.bytes.size() && !batch.refill()) {
+        // Without getrandom, boost reads the entropy source itself
+        return boost::uuids::random_generator()();
+    }
+    boost::uuids::uuid uuid;
+    std::memcpy(uuid.data, batch.bytes.data() + batch.offset, sizeof(uuid.data));
+    std::memset(batch.bytes.data() + batch.offset, 0, sizeof(uuid.data));
+    batch.offset += sizeof(uuid.data);
+    // Version 4, variant 1 (RFC 4122)
+    uuid.data[6] = static_cast<std::uint8_t>((uuid.data[6] & 0x0F) | 0x40);
+    uuid.data[8] = static_cast<std::uint8_t>((uuid.data[8] & 0x3F) | 0x80);
+    return uuid;
+}
 
 // Default constructor generates a new random UUID
-UUID::UUID() : uuid_(boost::uuids::random_generator()()) {}
+UUID::UUID() : uuid_(random_uuid()) {}
 
 // Constructor that accepts an existing boost::uuids::uuid
 UUID::UUID(const boost::uuids::uuid& uuid) : uuid_(uuid) {}
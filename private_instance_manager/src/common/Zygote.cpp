@@ -0,0 +1,345 @@
+#include "common/Zygote.hpp"
+#include "common/Cgroup.hpp"
+#include "utils/command_line.hpp"
+#include "utils/process.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Time given to a killed instance to exit, in milliseconds
+static constexpr int TERMINATE_TIMEOUT_MS = 1000;
+
+struct SpawnRequest {
+    uid_t user_id;
+    gid_t group_id;
+    // Whether a listening socket comes with the request
+    int has_listen_fd;
+    // Whether the cgroup.procs of the instance's cgroup comes with the request, after the socket
+    int has_cgroup_fd;
+};
+
+struct SpawnReply {
+    pid_t pid;
+    // errno of the failure, 0 on success
+    int error;
+    // Whether a pidfd follows the stdout descriptor
+    int has_pidfd;
+};
+
+static int pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int pidfd_send_signal(int pidfd, int signal) {
+#ifdef SYS_pidfd_send_signal
+    return static_cast<int>(syscall(SYS_pidfd_send_signal, pidfd, signal, nullptr, 0));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Close the descriptors inherited from the server (listening sockets, epoll...), except stdio and keep
+static void close_inherited(int keep) {
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    if (max_fd < 0 || max_fd > 65536) {
+        max_fd = 65536;
+    }
+    for (int fd = 3; fd < max_fd; ++fd) {
+        if (fd != keep) {
+            close(fd);
+        }
+    }
+}
+
+static bool send_reply(int socket, const SpawnReply& reply, int stdout_fd, int pidfd) {
+    struct iovec iov = {const_cast<SpawnReply*>(&reply), sizeof(reply)};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+    if (reply.error == 0) {
+        int fds[2] = {stdout_fd, pidfd};
+        std::size_t count = reply.has_pidfd ? 2 : 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+    return sendmsg(socket, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(reply));
+}
+
+std::unique_ptr<Zygote> Zygote::start(const std::string& command, const std::string& template_library) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) {
+        perror("socketpair");
+        return nullptr;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sockets[0]);
+        close(sockets[1]);
+        return nullptr;
+    }
+    if (pid == 0) {
+        close(sockets[0]);
+        serve(sockets[1], command, template_library);
+    }
+    close(sockets[1]);
+    return std::unique_ptr<Zygote>(new Zygote(pid, sockets[0]));
+}
+
+Zygote::Zygote(pid_t pid, int socket) : pid_(pid), socket_(socket) {}
+
+Zygote::~Zygote() {
+    // The zygote exits when the socket is closed
+    close(socket_);
+    waitpid(pid_, nullptr, 0);
+}
+
+void Zygote::serve(int socket, const std::string& command, const std::string& template_library) {
+    // The zygote doesn't outlive the server, and its children are reaped by the kernel
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    signal(SIGCHLD, SIG_IGN);
+    close_inherited(socket);
+
+    // One-time initialization, shared copy-on-write with every instance
+    int (*run)() = nullptr;
+    if (!template_library.empty()) {
+        void* handle = dlopen(template_library.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            fprintf(stderr, "Zygote: %s\n", dlerror());
+            _exit(1);
+        }
+        auto init = reinterpret_cast<int (*)()>(dlsym(handle, "pim_template_init"));
+        run = reinterpret_cast<int (*)()>(dlsym(handle, "pim_template_run"));
+        if (!run) {
+            fprintf(stderr, "Zygote: %s has no pim_template_run\n", template_library.c_str());
+            _exit(1);
+        }
+        if (init && init() != 0) {
+            fprintf(stderr, "Zygote: pim_template_init failed\n");
+            _exit(1);
+        }
+    }
+    std::vector<std::string> args = split_command(command);
+    std::vector<char*> argv;
+    for (auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    if (!run && args.empty()) {
+        fprintf(stderr, "Zygote: empty command\n");
+        _exit(1);
+    }
+
+    while (true) {
+        SpawnRequest request;
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t length = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        if (length == 0 || (length < 0 && errno != EINTR)) {
+            // The server is gone
+            _exit(0);
+        }
+        int fds[2] = {-1, -1};
+        std::size_t count = 0;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = std::min<std::size_t>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), 2);
+            std::memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+        if (length != static_cast<ssize_t>(sizeof(request)) ||
+            static_cast<std::size_t>((request.has_listen_fd != 0) + (request.has_cgroup_fd != 0)) != count) {
+            for (std::size_t i = 0; i < count; ++i) {
+                close(fds[i]);
+            }
+            continue;
+        }
+        int listen_fd = request.has_listen_fd ? fds[0] : -1;
+        int cgroup_fd = request.has_cgroup_fd ? fds[count - 1] : -1;
+        SpawnReply reply = {0, 0, 0};
+        int output[2];
+        if (pipe2(output, O_CLOEXEC) != 0) {
+            reply.error = errno;
+            send_reply(socket, reply, -1, -1);
+            for (std::size_t i = 0; i < count; ++i) {
+                close(fds[i]);
+            }
+            continue;
+        }
+        pid_t zygote_pid = getpid();
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(socket);
+            close(output[0]);
+            // dup2 clears the close-on-exec flag of the new stdout
+            if (dup2(output[1], STDOUT_FILENO) < 0) {
+                _exit(1);
+            }
+            close(output[1]);
+            if (listen_fd >= 0) {
+                // Socket activation convention: the first passed descriptor is 3
+                if (listen_fd == 3) {
+                    fcntl(listen_fd, F_SETFD, 0);
+                } else if (dup2(listen_fd, 3) < 0) {
+                    _exit(1);
+                } else {
+                    close(listen_fd);
+                }
+                char pid[16];
+                snprintf(pid, sizeof(pid), "%d", static_cast<int>(getpid()));
+                setenv("LISTEN_FDS", "1", 1);
+                setenv("LISTEN_PID", pid, 1);
+            }
+            // Joined while still privileged, the instance never runs outside of its limits
+            if (cgroup_fd >= 0 && !Cgroup::join(cgroup_fd)) {
+                _exit(1);
+            }
+            if (!drop_privileges(request.user_id, request.group_id)) {
+                _exit(1);
+            }
+            // Killed with the zygote, so with the server
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != zygote_pid) {
+                _exit(1);
+            }
+            if (run) {
+                // exit() flushes the stdio buffers of the template
+                exit(run());
+            }
+            execvp(argv[0], argv.data());
+            perror("execvp");
+            _exit(127);
+        }
+        close(output[1]);
+        for (std::size_t i = 0; i < count; ++i) {
+            close(fds[i]);
+        }
+        if (pid < 0) {
+            reply.error = errno;
+            close(output[0]);
+            send_reply(socket, reply, -1, -1);
+            continue;
+        }
+        int pidfd = pidfd_open(pid);
+        reply.pid = pid;
+        reply.has_pidfd = pidfd >= 0;
+        send_reply(socket, reply, output[0], pidfd);
+        close(output[0]);
+        if (pidfd >= 0) {
+            close(pidfd);
+        }
+    }
+}
+
+std::optional<Zygote::Instance> Zygote::spawn(uid_t user_id, gid_t group_id, int listen_fd, int cgroup_fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SpawnRequest request = {user_id, group_id, listen_fd >= 0, cgroup_fd >= 0};
+    struct iovec request_iov = {&request, sizeof(request)};
+    struct msghdr request_msg;
+    std::memset(&request_msg, 0, sizeof(request_msg));
+    request_msg.msg_iov = &request_iov;
+    request_msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char request_control[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2];
+    std::size_t count = 0;
+    if (listen_fd >= 0) {
+        fds[count++] = listen_fd;
+    }
+    if (cgroup_fd >= 0) {
+        fds[count++] = cgroup_fd;
+    }
+    if (count > 0) {
+        request_msg.msg_control = request_control;
+        request_msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&request_msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+    if (sendmsg(socket_, &request_msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(request))) {
+        perror("Zygote request");
+        return std::nullopt;
+    }
+    SpawnReply reply;
+    struct iovec iov = {&reply, sizeof(reply)};
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t length;
+    do {
+        length = recvmsg(socket_, &msg, MSG_CMSG_CLOEXEC);
+    } while (length < 0 && errno == EINTR);
+    if (length != static_cast<ssize_t>(sizeof(reply))) {
+        std::fprintf(stderr, "Zygote is not answering\n");
+        return std::nullopt;
+    }
+    Instance instance = {reply.pid, -1, -1};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int fds[2] = {-1, -1};
+        std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::memcpy(fds, CMSG_DATA(cmsg), std::min<std::size_t>(count, 2) * sizeof(int));
+        instance.stdout_fd = fds[0];
+        instance.pidfd = count > 1 ? fds[1] : -1;
+    }
+    if (reply.error != 0 || instance.stdout_fd < 0) {
+        std::fprintf(stderr, "Zygote failed to fork: %s\n", std::strerror(reply.error));
+        terminate(instance);
+        return std::nullopt;
+    }
+    return instance;
+}
+
+void Zygote::terminate(Instance& instance) {
+    if (instance.stdout_fd >= 0) {
+        close(instance.stdout_fd);
+        instance.stdout_fd = -1;
+    }
+    if (instance.pidfd >= 0) {
+        // No risk of killing a recycled pid through the pidfd
+        pidfd_send_signal(instance.pidfd, SIGKILL);
+        struct pollfd pfd = {instance.pidfd, POLLIN, 0};
+        poll(&pfd, 1, TERMINATE_TIMEOUT_MS);
+        close(instance.pidfd);
+        instance.pidfd = -1;
+    } else if (instance.pid > 0) {
+        kill(instance.pid, SIGKILL);
+    }
+    instance.pid = 0;
+}
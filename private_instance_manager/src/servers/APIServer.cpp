@@ -1,49 +1,176 @@
 // APIServer.cpp
 
 #include "servers/APIServer.hpp"
+#include "clients/APIClient.hpp"
+#include "common/Logger.hpp"
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <ctime>
+#include <thread>
 
-APIServer::APIServer(unsigned short port, long timeout_seconds, long cleanup_interval, unsigned short num_threads)
-    : port_(port),
-      timeout_seconds_(timeout_seconds),
-      cleanup_interval_(cleanup_interval),
-      acceptor_(io_context_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-      num_threads_(num_threads) {
-    if (num_threads_ == 0) {
-        num_threads_ = std::thread::hardware_concurrency();
-        if (num_threads_ == 0) {
-            num_threads_ = 1;
+// Tokens read from the table per lock acquisition by LIST
+static constexpr std::size_t LIST_BATCH_SIZE = 256;
+// Time given to the requests in flight to finish before the tokens are handed over
+static constexpr std::chrono::seconds UPGRADE_REQUEST_TIMEOUT(5);
+// Time given to the new process to start serving during an upgrade
+static constexpr std::chrono::seconds UPGRADE_READY_TIMEOUT(30);
+
+APIServer::APIServer(const APIServerConfig& config)
+    : port_(config.port),
+      timeout_seconds_(config.timeout_seconds),
+      max_ttl_(config.max_ttl > 0 ? std::max(config.max_ttl, config.timeout_seconds) : config.timeout_seconds),
+      cleanup_interval_(config.cleanup_interval),
+      pool_(config.mode, config.num_threads, config.pin_threads),
+      acceptors_(pool_.createAcceptors(config.port, config.listen_fds)),
+      draining_(false),
+      active_requests_(0),
+      replica_address_(config.replica_address),
+      replica_port_(config.replica_port),
+      replication_stopped_(false) {
+    if (!config.token_table_name.empty()) {
+        token_table_ = SharedTokenTable::create(config.token_table_name, config.token_table_capacity,
+                                                config.token_table_group);
+        if (!token_table_) {
+            log_error("Failed to create the shared token table ", config.token_table_name, ".");
         }
     }
 }
 
 
 void APIServer::start() {
-    std::cout << "Server started." << std::endl;
+    log_info("Server started.");
     scheduleTokenCleanup();
-    std::cout << "Token cleanup scheduled every " << cleanup_interval_ << " seconds." << std::endl;
-    std::cout << "Using " << num_threads_ << " threads." << std::endl;
-    std::cout << "Waiting for incoming connections on port " << port_ << "." << std::endl;
-    doAccept();
-    for (unsigned int i = 0; i < num_threads_; ++i) {
-        threads_.emplace_back([this]() {
-            io_context_.run();
+    log_info("Token cleanup scheduled every ", cleanup_interval_, " seconds.");
+    log_info("Using ", pool_.getNumThreads(), " threads and ", acceptors_.size(), " acceptors.");
+    log_info("Waiting for incoming connections on port ", port_, ".");
+    if (!replica_address_.empty()) {
+        log_info("Replicating tokens to ", replica_address_, ":", replica_port_, ".");
+        replication_thread_ = std::thread([this]() {
+            runReplication();
         });
     }
+    for (auto& acceptor : acceptors_) {
+        doAccept(*acceptor);
+    }
+    pool_.run();
 }
 
 void APIServer::stop() {
-    io_context_.stop();
-    // Wait for all threads to finish
-    for (auto& t : threads_) {
-        t.join();
+    // Stop the io_contexts and wait for all threads to finish
+    pool_.stop();
+    {
+        std::lock_guard<std::mutex> lock(replication_mutex_);
+        replication_stopped_ = true;
+    }
+    replication_cv_.notify_all();
+    if (replication_thread_.joinable()) {
+        replication_thread_.join();
+    }
+}
+
+bool APIServer::upgrade(const std::string& binary) {
+    auto handoff = Handoff::spawn(binary);
+    if (!handoff) {
+        log_error("Upgrade failed: cannot start the new binary.");
+        return false;
+    }
+    std::vector<int> fds;
+    std::string roles;
+    for (auto& acceptor : acceptors_) {
+        fds.push_back(acceptor->native_handle());
+        roles += "api ";
+    }
+    bool sent = handoff->send(Handoff::MessageType::Listeners, roles, fds);
+    // The tokens can't change anymore once the requests in flight are done
+    draining_.store(true);
+    for (auto& acceptor : acceptors_) {
+        cancel_acceptor(*acceptor);
+    }
+    auto deadline = std::chrono::steady_clock::now() + UPGRADE_REQUEST_TIMEOUT;
+    while (active_requests_.load() > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // Same lines as LIST, in messages of at most MAX_PAYLOAD bytes
+    std::size_t count = 0;
+    std::uint64_t cursor = 0;
+    do {
+        std::vector<std::string> chunks(1);
+        {
+            std::lock_guard<std::mutex> lock(tokens_mutex_);
+            cursor = tokens_.scan(cursor, LIST_BATCH_SIZE, [this, &chunks, &count](const TokenRecord& record) {
+                long time_remaining = tokens_.timeRemaining(record);
+                if (time_remaining <= 0) {
+                    return;
+                }
+                boost::uuids::uuid uuid;
+                std::memcpy(uuid.data, record.uuid, sizeof(record.uuid));
+                std::string line = boost::uuids::to_string(uuid) + " " + tokens_.getAddress(record) + " "
+                    + std::to_string(record.port) + " " + std::to_string(time_remaining) + "\n";
+                if (chunks.back().size() + line.size() > Handoff::MAX_PAYLOAD) {
+                    chunks.emplace_back();
+                }
+                chunks.back() += line;
+                ++count;
+            });
+        }
+        for (const auto& chunk : chunks) {
+            if (!chunk.empty()) {
+                sent = sent && handoff->send(Handoff::MessageType::Tokens, chunk);
+            }
+        }
+    } while (cursor != 0);
+    Handoff::Message message;
+    if (!sent || !handoff->send(Handoff::MessageType::Done, "")
+        || !handoff->receive(message, UPGRADE_READY_TIMEOUT) || message.type != Handoff::MessageType::Ready) {
+        log_error("Upgrade failed: the new process didn't start serving.");
+        handoff->terminate();
+        draining_.store(false);
+        for (auto& acceptor : acceptors_) {
+            boost::asio::post(acceptor->get_executor(), [this, &acceptor]() {
+                doAccept(*acceptor);
+            });
+        }
+        return false;
+    }
+    log_info("Process ", handoff->getPeer(), " took over with ", count, " tokens.");
+    return true;
+}
+
+std::size_t APIServer::restoreTokens(const std::string& lines) {
+    std::istringstream stream(lines);
+    std::string line;
+    std::size_t count = 0;
+    std::lock_guard<std::mutex> lock(tokens_mutex_);
+    while (std::getline(stream, line)) {
+        std::istringstream fields(line);
+        std::string uuid_str, address;
+        unsigned short port;
+        long time_remaining;
+        fields >> uuid_str >> address >> port >> time_remaining;
+        if (fields.fail() || time_remaining <= 0) {
+            continue;
+        }
+        UUID uuid{boost::uuids::nil_uuid()};
+        try {
+            uuid = UUID(uuid_str);
+        } catch (const std::invalid_argument& e) {
+            continue;
+        }
+        // The replica already has the tokens
+        if (tokens_.insert(uuid.getUUID(), address, port, time_remaining)) {
+            publishToken(uuid, address, port, time_remaining);
+            ++count;
+        }
     }
+    return count;
 }
 
 void APIServer::scheduleTokenCleanup() {
     auto self = shared_from_this();
-    cleanup_timer_ = std::make_shared<boost::asio::deadline_timer>(io_context_, boost::posix_time::seconds(cleanup_interval_));
+    cleanup_timer_ = std::make_shared<boost::asio::deadline_timer>(pool_.getIOContext(), boost::posix_time::seconds(cleanup_interval_));
     cleanup_timer_->async_wait([self](const boost::system::error_code& ec) {
         if (!ec) {
             self->removeExpiredTokens();
@@ -52,26 +179,36 @@ void APIServer::scheduleTokenCleanup() {
     });
 }
 
-void APIServer::doAccept() {
+void APIServer::doAccept(boost::asio::ip::tcp::acceptor& acceptor) {
     auto self = shared_from_this();
-    acceptor_.async_accept(
-        [this, self](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+    acceptor.async_accept(
+        [this, self, &acceptor](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
             if (!ec) {
                 try {
                     handleRequest(std::move(socket));
                 } catch (const std::exception& e) {
-                    std::cerr << "Exception in connection handler: " << e.what() << std::endl;
+                    log_error("Exception in connection handler: ", e.what());
                 }
-            } else {
-                std::cerr << "Accept error: " << ec.message() << std::endl;
+            } else if (!draining_.load()) {
+                log_error("Accept error: ", ec.message());
             }
-            doAccept(); // Accept the next connection
+            // Once the sockets are handed over, the connections are left in the backlog
+            if (draining_.load()) {
+                return;
+            }
+            doAccept(acceptor); // Accept the next connection
         });
 }
 
 void APIServer::handleRequest(boost::asio::ip::tcp::socket socket) {
     auto self = shared_from_this();
-    auto socket_ptr = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+    // The request is over once the last handler lets go of its socket
+    ++active_requests_;
+    auto socket_ptr = std::shared_ptr<boost::asio::ip::tcp::socket>(new boost::asio::ip::tcp::socket(std::move(socket)),
+        [self](boost::asio::ip::tcp::socket* socket) {
+            delete socket;
+            --self->active_requests_;
+        });
     auto buffer_ptr = std::make_shared<boost::asio::streambuf>();
 
     boost::asio::async_read_until(*socket_ptr, *buffer_ptr, '\n',
@@ -80,19 +217,27 @@ void APIServer::handleRequest(boost::asio::ip::tcp::socket socket) {
                 std::istream stream(buffer_ptr.get());
                 std::string command;
                 std::getline(stream, command);
+                // LIST answers with several writes, one per batch of tokens
+                std::stringstream ss(command);
+                std::string action;
+                ss >> action;
+                if (action == "LIST") {
+                    listTokens(socket_ptr, ss);
+                    return;
+                }
                 // Process the command and get the response
                 std::string response = processCommand(command);
                 // Send the response back to the client
                 boost::asio::async_write(*socket_ptr, boost::asio::buffer(response),
                     [socket_ptr](boost::system::error_code ec, std::size_t /*length*/) mutable {
                         if (ec) {
-                            std::cerr << "Error: " << ec.message() << std::endl;
+                            log_error("Error: ", ec.message());
                             
                         }
                         socket_ptr->close();
                     });
             } else {
-                std::cerr << "Error: " << ec.message() << std::endl;
+                log_error("Error: ", ec.message());
                 socket_ptr->close();
             }
         });
@@ -113,6 +258,12 @@ std::string APIServer::processCommand(const std::string& command) {
         return addService(ss);
     } else if (action == "GET_INFO") {
         return getInfo(ss);
+    } else if (action == "PUT") {
+        return putService(ss);
+    } else if (action == "EXTEND") {
+        return extendService(ss);
+    } else if (action == "REVOKE") {
+        return revokeService(ss);
     }
 
     return statusMessage(StatusCode::BadRequest) + " Invalid command\n";
@@ -130,21 +281,27 @@ std::string APIServer::addService(std::stringstream& ss) {
     if (ss.fail() || port == 0) {
         return statusMessage(StatusCode::BadRequest) + " Invalid port number\n";
     }
-    // Generate a new UUID outside the lock
+    // The TTL is optional, tokens get the default timeout without it
+    long ttl;
+    ss >> ttl;
+    if (ss.fail()) {
+        ttl = timeout_seconds_;
+    } else if (ttl <= 0) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid TTL\n";
+    }
+    ttl = std::min(ttl, max_ttl_);
+    // Drawn from the thread's batch, without a syscall or a lock
     UUID new_uuid;
-    bool is_unique = false;
-    // Try to generate a unique UUID
-    while (!is_unique) {
-        new_uuid = UUID(); // Generate a new UUID
-        // Lock to check and add the UUID
+    {
+        // The insertion checks the uniqueness in the same probe. A collision of 122 random bits
+        // won't happen, it would only cost another draw under the same lock
         std::lock_guard<std::mutex> lock(tokens_mutex_);
-        if (tokens_.find(new_uuid) == tokens_.end()) {
-            // Unique UUID found, add to tokens
-            NetworkInfo network_info(address, port);
-            tokens_[new_uuid] = network_info;
-            is_unique = true; // Exit loop
+        while (!tokens_.insert(new_uuid.getUUID(), address, port, ttl)) {
+            new_uuid = UUID();
         }
+        publishToken(new_uuid, address, port, ttl);
     }
+    replicate(ReplicationAction::Put, new_uuid, address, port, ttl);
 
     // Returning "200" with the UUID as a response
     std::ostringstream response;
@@ -160,50 +317,300 @@ std::string APIServer::getInfo(std::stringstream& ss) {
         return statusMessage(StatusCode::BadRequest) + " Missing UUID\n";
     }
 
-    UUID uuid;
+    UUID uuid{boost::uuids::nil_uuid()};
     try {
         uuid = UUID(uuid_str);
     } catch (const std::invalid_argument& e) {
         return statusMessage(StatusCode::BadRequest) + " Invalid UUID\n";
     }
 
-    // Retrieve the NetworkInfo associated with the UUID
-    NetworkInfo network_info;
+    // Retrieve the record associated with the UUID and format the answer under the lock,
+    // the address is not copied out of the table
+    std::ostringstream response;
     {
         std::lock_guard<std::mutex> lock(tokens_mutex_);
-        auto it = tokens_.find(uuid);
-        if (it == tokens_.end()) {
+        const TokenRecord* record = tokens_.find(uuid.getUUID());
+        if (!record) {
             return statusMessage(StatusCode::NotFound) + " UUID not found\n";
         }
-        network_info = it->second;
+        // Calculate the time remaining before expiration
+        long time_remaining = tokens_.timeRemaining(*record);
+        if (time_remaining <= 0) {
+            return statusMessage(StatusCode::Gone) + " UUID has expired\n";
+        }
+        // Returning "200 Port: <port> - TimeRemaining: <seconds> - ServiceName: <service_name>\n"
+        response << statusMessage(StatusCode::OK)
+                 << " Port: " << record->port
+                 << " - TimeRemaining: " << time_remaining
+                 << " - ServiceName: " << tokens_.getAddress(*record) << "\n";
     }
+    return response.str();
+}
+
+std::string APIServer::putService(std::stringstream& ss) {
+    std::string uuid_str, address;
+    unsigned short port;
+    long time_remaining;
 
-    // Calculate the time remaining before expiration
-    boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
-    long seconds_elapsed = (now - network_info.getTimestamp()).total_seconds();
-    long time_remaining = timeout_seconds_ - seconds_elapsed;
+    ss >> uuid_str;
+    if (ss.fail()) {
+        return statusMessage(StatusCode::BadRequest) + " Missing UUID\n";
+    }
+    UUID uuid{boost::uuids::nil_uuid()};
+    try {
+        uuid = UUID(uuid_str);
+    } catch (const std::invalid_argument& e) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid UUID\n";
+    }
+    ss >> address;
+    if (ss.fail()) {
+        return statusMessage(StatusCode::BadRequest) + " Missing service name\n";
+    }
+    ss >> port;
+    if (ss.fail() || port == 0) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid port number\n";
+    }
+    // The time remaining is optional, tokens stored by the clients get the default timeout
+    ss >> time_remaining;
+    if (ss.fail()) {
+        time_remaining = timeout_seconds_;
+    }
+    time_remaining = std::min(time_remaining, max_ttl_);
     if (time_remaining <= 0) {
         return statusMessage(StatusCode::Gone) + " UUID has expired\n";
     }
-    // Returning "200 Port: <port> - TimeRemaining: <seconds> - ServiceName: <service_name>\n"
+    {
+        std::lock_guard<std::mutex> lock(tokens_mutex_);
+        if (!tokens_.insert(uuid.getUUID(), address, port, time_remaining)) {
+            return statusMessage(StatusCode::Conflict) + " UUID already exists\n";
+        }
+        publishToken(uuid, address, port, time_remaining);
+    }
+    replicate(ReplicationAction::Put, uuid, address, port, time_remaining);
+
+    std::ostringstream response;
+    response << "200 " << uuid.toString() << "\n";
+    return response.str();
+}
+
+std::string APIServer::extendService(std::stringstream& ss) {
+    std::string uuid_str;
+    long seconds;
+
+    ss >> uuid_str;
+    if (ss.fail()) {
+        return statusMessage(StatusCode::BadRequest) + " Missing UUID\n";
+    }
+    UUID uuid{boost::uuids::nil_uuid()};
+    try {
+        uuid = UUID(uuid_str);
+    } catch (const std::invalid_argument& e) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid UUID\n";
+    }
+    ss >> seconds;
+    if (ss.fail() || seconds <= 0) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid number of seconds\n";
+    }
+    long time_remaining;
+    {
+        std::lock_guard<std::mutex> lock(tokens_mutex_);
+        TokenRecord* record = tokens_.find(uuid.getUUID());
+        if (!record) {
+            return statusMessage(StatusCode::NotFound) + " UUID not found\n";
+        }
+        time_remaining = tokens_.timeRemaining(*record);
+        if (time_remaining <= 0) {
+            return statusMessage(StatusCode::Gone) + " UUID has expired\n";
+        }
+        time_remaining = std::min(time_remaining + seconds, max_ttl_);
+        tokens_.setTimeRemaining(*record, time_remaining);
+        publishToken(uuid, tokens_.getAddress(*record), record->port, time_remaining);
+    }
+    replicate(ReplicationAction::Extend, uuid, "", 0, seconds);
+
+    // Returning "200 TimeRemaining: <seconds>\n"
     std::ostringstream response;
-    response << statusMessage(StatusCode::OK)
-             << " Port: " << network_info.getEndpointPort()
-             << " - TimeRemaining: " << time_remaining 
-             << " - ServiceName: " << network_info.getEndpointAddress() << "\n";
+    response << statusMessage(StatusCode::OK) << " TimeRemaining: " << time_remaining << "\n";
     return response.str();
 }
 
+std::string APIServer::revokeService(std::stringstream& ss) {
+    std::string uuid_str;
+
+    ss >> uuid_str;
+    if (ss.fail()) {
+        return statusMessage(StatusCode::BadRequest) + " Missing UUID\n";
+    }
+    UUID uuid{boost::uuids::nil_uuid()};
+    try {
+        uuid = UUID(uuid_str);
+    } catch (const std::invalid_argument& e) {
+        return statusMessage(StatusCode::BadRequest) + " Invalid UUID\n";
+    }
+    {
+        std::lock_guard<std::mutex> lock(tokens_mutex_);
+        if (!tokens_.erase(uuid.getUUID())) {
+            return statusMessage(StatusCode::NotFound) + " UUID not found\n";
+        }
+        if (token_table_) {
+            token_table_->erase(uuid.getUUID());
+        }
+    }
+    replicate(ReplicationAction::Revoke, uuid);
+
+    return statusMessage(StatusCode::OK) + " Revoked\n";
+}
+
+void APIServer::listTokens(std::shared_ptr<boost::asio::ip::tcp::socket> socket, std::stringstream& ss) {
+    std::string cursor_str, limit_str;
+    ss >> cursor_str >> limit_str;
+    std::uint64_t cursor = 0;
+    std::size_t limit = 0;
+    bool valid = cursor_str.find_first_not_of("0123456789") == std::string::npos
+        && limit_str.find_first_not_of("0123456789") == std::string::npos;
+    try {
+        if (valid && !cursor_str.empty()) {
+            cursor = std::stoull(cursor_str);
+        }
+        if (valid && !limit_str.empty()) {
+            limit = std::stoull(limit_str);
+        }
+    } catch (const std::out_of_range& e) {
+        valid = false;
+    }
+    if (!valid) {
+        auto response = std::make_shared<std::string>(statusMessage(StatusCode::BadRequest) + " Invalid cursor or limit\n");
+        boost::asio::async_write(*socket, boost::asio::buffer(*response),
+            [socket, response](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    log_error("Error: ", ec.message());
+                }
+                socket->close();
+            });
+        return;
+    }
+    // No limit lists the whole table
+    sendListBatch(socket, cursor, limit == 0 ? std::numeric_limits<std::size_t>::max() : limit);
+}
+
+void APIServer::sendListBatch(std::shared_ptr<boost::asio::ip::tcp::socket> socket, std::uint64_t cursor, std::size_t remaining) {
+    auto self = shared_from_this();
+    auto batch = std::make_shared<std::string>();
+    std::size_t count = std::min(remaining, LIST_BATCH_SIZE);
+    std::size_t visited = 0;
+    std::uint64_t next;
+    {
+        // The lock is released between batches, GET_INFO requests go through while the
+        // previous batch is being written
+        std::lock_guard<std::mutex> lock(tokens_mutex_);
+        next = tokens_.scan(cursor, count, [this, &batch, &visited](const TokenRecord& record) {
+            ++visited;
+            long time_remaining = tokens_.timeRemaining(record);
+            if (time_remaining <= 0) {
+                return;
+            }
+            boost::uuids::uuid uuid;
+            std::memcpy(uuid.data, record.uuid, sizeof(record.uuid));
+            // One "<uuid> <service_name> <port> <time_remaining>" line per token
+            *batch += boost::uuids::to_string(uuid) + " " + tokens_.getAddress(record) + " "
+                + std::to_string(record.port) + " " + std::to_string(time_remaining) + "\n";
+        });
+    }
+    // A batch can stop short of count tokens on a sparse part of the table
+    remaining -= visited;
+    // The last line gives the cursor to resume from, 0 once the whole table was listed
+    bool last = next == 0 || remaining == 0;
+    if (last) {
+        *batch += statusMessage(StatusCode::OK) + " Cursor: " + std::to_string(next) + "\n";
+    }
+    boost::asio::async_write(*socket, boost::asio::buffer(*batch),
+        [this, self, socket, batch, next, remaining, last](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                log_error("Error: ", ec.message());
+                socket->close();
+                return;
+            }
+            if (last) {
+                socket->close();
+                return;
+            }
+            sendListBatch(socket, next, remaining);
+        });
+}
+
+void APIServer::replicate(ReplicationAction action, const UUID& uuid, const std::string& address, unsigned short port,
+                          long seconds) {
+    if (replica_address_.empty()) {
+        return;
+    }
+    // New tokens carry their deadline, so that a late PUT doesn't extend them
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(action == ReplicationAction::Put ? seconds : 0);
+    long extension = action == ReplicationAction::Extend ? seconds : 0;
+    {
+        std::lock_guard<std::mutex> lock(replication_mutex_);
+        replication_queue_.push_back(Replication{action, uuid.toString(), address, port, deadline, extension});
+    }
+    replication_cv_.notify_one();
+}
+
+void APIServer::runReplication() {
+    // Blocking client, the requests are sent from this thread and never from the workers
+    APIClient replica(replica_address_, replica_port_);
+    while (true) {
+        std::deque<Replication> batch;
+        {
+            std::unique_lock<std::mutex> lock(replication_mutex_);
+            replication_cv_.wait(lock, [this]() {
+                return replication_stopped_ || !replication_queue_.empty();
+            });
+            if (replication_stopped_) {
+                return;
+            }
+            batch.swap(replication_queue_);
+        }
+        for (const auto& entry : batch) {
+            bool replicated = true;
+            if (entry.action == ReplicationAction::Put) {
+                long time_remaining = std::chrono::duration_cast<std::chrono::seconds>(entry.deadline - std::chrono::steady_clock::now()).count();
+                if (time_remaining <= 0) {
+                    continue;
+                }
+                replicated = replica.apiPutService(entry.uuid, entry.address, entry.port, time_remaining);
+            } else if (entry.action == ReplicationAction::Extend) {
+                replicated = replica.apiExtendService(entry.uuid, entry.extension).has_value();
+            } else {
+                // Not finding the token on the replica is fine, it is gone either way
+                replica.apiRevokeService(entry.uuid);
+            }
+            if (!replicated) {
+                log_error("Failed to replicate token ", entry.uuid, ".");
+            }
+        }
+    }
+}
+
 void APIServer::removeExpiredTokens() {
-    boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
     std::lock_guard<std::mutex> lock(tokens_mutex_);
-    for (auto it = tokens_.begin(); it != tokens_.end();) {
-        long seconds_elapsed = (now - it->second.getTimestamp()).total_seconds();
-        if (seconds_elapsed > timeout_seconds_) {
-            it = tokens_.erase(it);
-        } else {
-            ++it;
+    tokens_.removeExpired([this](const TokenRecord& record) {
+        if (token_table_) {
+            boost::uuids::uuid uuid;
+            std::memcpy(uuid.data, record.uuid, sizeof(record.uuid));
+            token_table_->erase(uuid);
         }
+    });
+    if (token_table_) {
+        token_table_->heartbeat();
+    }
+}
+
+void APIServer::publishToken(const UUID& uuid, const std::string& address, unsigned short port, long time_remaining) {
+    if (!token_table_) {
+        return;
+    }
+    std::int64_t expires_at = static_cast<std::int64_t>(std::time(nullptr)) + time_remaining;
+    if (!token_table_->put(uuid.getUUID(), address, port, expires_at)) {
+        // The tunnel servers will ask the API for this one
+        log_error("Token ", uuid.toString(), " not published in the shared token table.");
     }
 }
 
@@ -215,6 +622,8 @@ std::string APIServer::statusMessage(StatusCode code) {
             return "400";
         case StatusCode::NotFound:
             return "404";
+        case StatusCode::Conflict:
+            return "409";
         case StatusCode::Gone:
             return "410";
         case StatusCode::InternalServerError:
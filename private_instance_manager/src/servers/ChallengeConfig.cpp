@@ -0,0 +1,149 @@
+#include "servers/ChallengeConfig.hpp"
+#include "utils/strings.hpp"
+#include "common/Logger.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <unordered_set>
+
+static std::string trim(const std::string& str) {
+    std::size_t begin = str.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    std::size_t end = str.find_last_not_of(" \t\r");
+    return str.substr(begin, end - begin + 1);
+}
+
+static bool parse_unsigned(const std::string& value, unsigned long max, unsigned long& result) {
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    errno = 0;
+    result = std::strtoul(value.c_str(), nullptr, 10);
+    return errno == 0 && result <= max;
+}
+
+// Apply a KEY=value line to the challenge. Returns false if the key or the value is invalid
+static bool apply_setting(ChallengeConfig& challenge, const std::string& key, const std::string& value) {
+    unsigned long number = 0;
+    if (key == "SERVER_PORT") {
+        if (!parse_unsigned(value, 65535, number) || number == 0) {
+            return false;
+        }
+        challenge.port = static_cast<unsigned short>(number);
+    } else if (key == "DOCKER_COMMAND" || key == "BASH_COMMAND") {
+        if (value.empty()) {
+            return false;
+        }
+        challenge.cmd_type = key == "DOCKER_COMMAND" ? CommandType::Docker : CommandType::Bash;
+        challenge.command = value;
+    } else if (key == "TIMEOUT" || key == "READY_TIMEOUT") {
+        if (!parse_unsigned(value, 365L * 24 * 3600, number) || number == 0) {
+            return false;
+        }
+        (key == "TIMEOUT" ? challenge.timeout : challenge.ready_timeout) = static_cast<long>(number);
+    } else if (key == "CHALLENGE_ADDRESS") {
+        challenge.challenge_address = value;
+    } else if (key == "CHALLENGE_PORT") {
+        challenge.challenge_port = value;
+    } else if (key == "SSL" || key == "PASS_LISTEN_FD" || key == "ZYGOTE") {
+        if (value != "true" && value != "false") {
+            return false;
+        }
+        bool enabled = value == "true";
+        (key == "SSL" ? challenge.ssl : key == "ZYGOTE" ? challenge.zygote : challenge.pass_listen_fd) = enabled;
+    } else if (key == "ZYGOTE_TEMPLATE") {
+        challenge.zygote_template = value;
+    } else if (key == "MAX_INSTANCES" || key == "RECYCLE_POOL") {
+        if (!parse_unsigned(value, ~0U, number)) {
+            return false;
+        }
+        (key == "MAX_INSTANCES" ? challenge.max_instances : challenge.recycle_pool) = static_cast<unsigned int>(number);
+    } else if (key == "RECYCLE_COMMAND") {
+        challenge.recycle_command = value;
+    } else if (key == "INSTANCE_CPUS") {
+        char* end = nullptr;
+        double cpus = std::strtod(value.c_str(), &end);
+        if (value.empty() || *end != '\0' || cpus < 0) {
+            return false;
+        }
+        challenge.limits.cpus = cpus;
+    } else if (key == "INSTANCE_MEMORY_MB") {
+        if (!parse_unsigned(value, ~0UL >> 20, number)) {
+            return false;
+        }
+        challenge.limits.memory = static_cast<std::uint64_t>(number) * 1024 * 1024;
+    } else if (key == "INSTANCE_PIDS") {
+        if (!parse_unsigned(value, ~0UL, number)) {
+            return false;
+        }
+        challenge.limits.pids = number;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::optional<std::vector<ChallengeConfig>> load_challenges(const std::string& path, const ChallengeConfig& defaults) {
+    std::ifstream file(path);
+    if (!file) {
+        log_error("Failed to read the challenges from ", path);
+        return std::nullopt;
+    }
+    std::vector<ChallengeConfig> challenges;
+    std::string line;
+    std::size_t line_number = 0;
+    while (std::getline(file, line)) {
+        ++line_number;
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') {
+            continue;
+        }
+        if (line.front() == '[' && line.back() == ']') {
+            challenges.push_back(defaults);
+            challenges.back().name = trim(line.substr(1, line.size() - 2));
+            if (challenges.back().name.empty()) {
+                log_error(path, ":", line_number, ": a challenge needs a name");
+                return std::nullopt;
+            }
+            continue;
+        }
+        std::size_t equals = line.find('=');
+        if (equals == std::string::npos || challenges.empty()) {
+            log_error(path, ":", line_number, ": expected [challenge] or KEY=value");
+            return std::nullopt;
+        }
+        std::string key = trim(line.substr(0, equals));
+        std::string value = trim(line.substr(equals + 1));
+        if (!value.empty()) {
+            value = remove_quotes(value);
+        }
+        if (!apply_setting(challenges.back(), key, value)) {
+            log_error(path, ":", line_number, ": invalid setting ", key);
+            return std::nullopt;
+        }
+    }
+
+    std::unordered_set<std::string> names;
+    std::unordered_set<unsigned short> ports;
+    for (const auto& challenge : challenges) {
+        if (!names.insert(challenge.name).second) {
+            log_error(path, ": the challenge ", challenge.name, " is defined twice");
+            return std::nullopt;
+        }
+        if (challenge.port == 0 || !ports.insert(challenge.port).second) {
+            log_error(path, ": the challenge ", challenge.name, " needs a SERVER_PORT of its own");
+            return std::nullopt;
+        }
+        if (challenge.command.empty()) {
+            log_error(path, ": the challenge ", challenge.name, " has no DOCKER_COMMAND or BASH_COMMAND");
+            return std::nullopt;
+        }
+    }
+    if (challenges.empty()) {
+        log_error(path, " has no challenge");
+        return std::nullopt;
+    }
+    return challenges;
+}
@@ -6,52 +6,39 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <cstring>
+#include <array>
+#include <fcntl.h>
+#include <sys/prctl.h>
 #include <boost/process.hpp>
 #include <boost/process/extend.hpp>
 #include "servers/InstancesServer.hpp"
 #include "clients/APIClient.hpp"
 #include "utils/command_line.hpp"
+#include "utils/network.hpp"
+#include "utils/process.hpp"
+#include "common/UUID.hpp"
+#include "backends/CommandBackend.hpp"
+#include "common/Logger.hpp"
 
-unsigned short get_random_port() {
-    int sockfd;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    int opt = 1;
-    unsigned short port;
-
-    // Create socket (IPv4, TCP)
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("socket");
-        return -1;
-    }
-    // Optional: Set socket options
-    // SO_REUSEADDR allows the socket to be bound to an address that is already in use
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        close(sockfd);
-        return -1;
-    }
-    // Define the address
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY; // Bind to all interfaces
-    addr.sin_port = 0;                  // Let the OS assign a random free port
-    // Bind the socket
-    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(sockfd);
-        return -1;
-    }
-    // Retrieve the assigned port number
-    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) == -1) {
-        perror("getsockname");
-        close(sockfd);
-        return -1;
-    }
-    port = ntohs(addr.sin_port);
-    close(sockfd);
-    return port;
+// Time between two passes over the tokens of the running instances, to notice revocations
+static constexpr long TOKEN_CHECK_INTERVAL = 5;
+// Threads running the backend commands, each one waits on a docker command at a time
+static constexpr std::size_t BLOCKING_THREADS = 4;
+// Seconds between two looks at the resources used by an instance
+static constexpr long LIMITS_CHECK_INTERVAL = 1;
+// Delays between two readiness probes of a docker instance, doubled after every failure
+static constexpr auto PROBE_MIN_DELAY = std::chrono::milliseconds(50);
+static constexpr auto PROBE_MAX_DELAY = std::chrono::milliseconds(1000);
+// A probe connection that stays open this long is served by the instance. A published port
+// accepts connections as soon as the container starts, and closes them until the instance listens
+static constexpr auto PROBE_SETTLE_TIME = std::chrono::milliseconds(200);
+
+// CPU time, memory and processes of an instance, for the logs and the user
+static std::string format_usage(const CgroupUsage& usage) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "CPU time: %.2fs, memory: %.1f MiB, processes: %llu",
+             usage.cpu.count() / 1e6, usage.memory / (1024.0 * 1024.0), static_cast<unsigned long long>(usage.pids));
+    return buffer;
 }
 
 static APIClient& get_thread_api_client(const std::string& api_endpoint, unsigned short api_port) {
@@ -63,248 +50,1076 @@ static APIClient& get_thread_api_client(const std::string& api_endpoint, unsigne
 }
 
 
-// Constructor to initialize the acceptor with the given port
-InstancesServer::InstancesServer(unsigned short port, std::string& api_address, unsigned short api_port,
-    long timeout, std::string& instance_address, std::string& command, std::string& challenge_address, 
-    std::string& challenge_port, bool ssl, CommandType cmd_type, unsigned int user_id, unsigned int group_id, unsigned int num_threads)
-    : port_(port),
-      api_address_(api_address),
+// Constructor to initialize the acceptors of every challenge
+InstancesServer::InstancesServer(std::vector<Challenge> challenges, std::string& api_address, unsigned short api_port,
+    std::string& instance_address, unsigned int user_id, unsigned int group_id, unsigned int num_threads,
+    ExecutionMode mode, bool pin_threads, std::shared_ptr<InstanceScheduler> scheduler, long reconcile_interval)
+    : api_address_(api_address),
       api_port_(api_port),
-      timeout_(timeout),
-      acceptor_(io_context_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+      pool_(mode, num_threads, pin_threads),
       instance_address_(instance_address),
-      command_(command),
-      challenge_address_(challenge_address),
-      challenge_port_(challenge_port), 
-      ssl_(ssl),
       user_id_(user_id),
-      group_id_(group_id) {
-    if (num_threads_ == 0) {
-        num_threads_ = std::thread::hardware_concurrency();
-        if (num_threads_ == 0) {
-            num_threads_ = 1;
+      group_id_(group_id),
+      scheduler_(scheduler),
+      reconcile_interval_(reconcile_interval),
+      token_checks_stopped_(false),
+      blocking_pool_(BLOCKING_THREADS) {
+    bool docker = false;
+    for (auto& challenge : challenges) {
+        docker = docker || challenge.config.cmd_type == CommandType::Docker;
+        auto pool = std::make_unique<ChallengePool>();
+        pool->acceptors = pool_.createAcceptors(challenge.config.port);
+        pool->challenge = std::move(challenge);
+        challenges_.push_back(std::move(pool));
+    }
+    if (!docker) {
+        // The backends only run docker instances
+        scheduler_ = nullptr;
+    } else if (!scheduler_) {
+        // Without a scheduler every instance runs on the docker daemon next to the server
+        std::vector<std::shared_ptr<InstanceBackend>> backends;
+        backends.push_back(std::make_shared<CommandBackend>("local", instance_address_, 0));
+        scheduler_ = std::make_shared<InstanceScheduler>(backends);
+    }
+}
+
+bool InstancesServer::tryReserve(ChallengePool& pool) {
+    unsigned int max_instances = pool.challenge.config.max_instances;
+    unsigned int live = pool.live_instances.load(std::memory_order_relaxed);
+    do {
+        if (max_instances != 0 && live >= max_instances) {
+            return false;
         }
+    } while (!pool.live_instances.compare_exchange_weak(live, live + 1, std::memory_order_relaxed));
+    return true;
+}
+
+std::function<bool()> InstancesServer::releasing(ChallengePool& pool, std::function<bool()> teardown) {
+    return [&pool, teardown]() {
+        bool stopped = teardown();
+        pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
+        return stopped;
+    };
+}
+
+std::string InstancesServer::instanceMessage(const ChallengeConfig& challenge, const std::string& token, bool with_stats) {
+    std::string msg = "Initialized private instance with token: " + token + "\n";
+    // Construct the challenge URL
+    std::string connection_info = "ncat ";
+    if (challenge.ssl)
+        connection_info += "--ssl ";
+    connection_info += challenge.challenge_address + " " + challenge.challenge_port;
+    msg += "Use it at: " + connection_info + "\n";
+    msg += "Send \"stop\" to terminate the instance.\n";
+    if (with_stats) {
+        msg += "Send \"stats\" to see its resource usage.\n";
     }
-    if (cmd_type == CommandType::Docker) {
-        run_command = [this](std::shared_ptr<boost::asio::ip::tcp::socket> client_socket) {
-            this->runDockerCommand(client_socket);
-        };
-    } else {
-        run_command = [this](std::shared_ptr<boost::asio::ip::tcp::socket> client_socket) {
-            this->runBashCommand(client_socket);
-        };
+    return msg;
+}
+
+// Port announced by an instance on a line like "Listening on port: <port>", 0 if there is none
+static unsigned short parse_ready_port(const std::string& line) {
+    std::vector<std::string> tokens = split_command(line);
+    if (tokens.size() < 2 || line.find("port") == std::string::npos) {
+        return 0;
     }
+    const std::string& value = tokens.back();
+    if (value.empty() || value.size() > 5 || value.find_first_not_of("0123456789") != std::string::npos) {
+        return 0;
+    }
+    unsigned long port = std::stoul(value);
+    return port <= 65535 ? static_cast<unsigned short>(port) : 0;
 }
 
-void InstancesServer::runBashCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket) {
-    boost::process::ipstream output;
-    std::string line;
+void InstancesServer::runBashCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool) {
+    const ChallengeConfig& challenge = pool.challenge.config;
     uid_t user_id = user_id_;
     gid_t group_id = group_id_;
 
-    auto self = shared_from_this();
-    // Getting the API client
-    APIClient& api_client = get_thread_api_client(api_address_, api_port_);
-    // Dropping privileges
-    auto on_setup_fn = [user_id, group_id](auto &e) {
-        if (setgid(user_id) != 0) {
-            perror("setgid failed");
-            exit(1);
+    if (!tryReserve(pool)) {
+        boost::asio::async_write(*client_socket, boost::asio::buffer("No capacity left, try again later\n"),
+            [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    log_error("Write error: ", ec.message());
+                }
+                client_socket->close();
+            });
+        return;
+    }
+    // With a listening socket made here, the port is known before the instance even starts
+    unsigned short port = 0;
+    int listen_fd = -1;
+    if (challenge.pass_listen_fd) {
+        listen_fd = create_listen_socket(port);
+        if (listen_fd < 0) {
+            pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
+            boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to obtain a free port\n"),
+                [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (ec) {
+                        log_error("Write error: ", ec.message());
+                    }
+                    client_socket->close();
+                });
+            return;
         }
-        if (setuid(group_id) != 0) {
-            perror("setuid failed");
-            exit(1);
+    }
+    // The instance gets its own cgroup, joined before it drops its privileges
+    std::shared_ptr<Cgroup> cgroup;
+    int cgroup_fd = -1;
+    if (pool.challenge.cgroups) {
+        cgroup = pool.challenge.cgroups->createInstance();
+        if (cgroup) {
+            cgroup_fd = cgroup->procsFd();
         }
-    };
-    // Running the command - Need to be a shared pointer
-    auto process = std::make_shared<boost::process::child>(command_.c_str(), boost::process::std_out > output, boost::process::extend::on_exec_setup(on_setup_fn));
-    // Getting the port. Output is "Listening on port: <port>\n"
-    std::getline(output, line);
-    std::vector<std::string> tokens = split_command(line);
-    if (tokens.size() < 4) {
-        boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to obtain a free port\n"),
+    }
+    // Stops the instance, whichever way it was started
+    std::function<bool()> teardown;
+    int stdout_fd = -1;
+    if (pool.challenge.zygote) {
+        // Forked by the zygote, which drops the privileges itself
+        auto instance = pool.challenge.zygote->spawn(user_id, group_id, listen_fd, cgroup_fd);
+        if (instance) {
+            stdout_fd = instance->stdout_fd;
+            instance->stdout_fd = -1;
+            auto zygote_instance = std::make_shared<Zygote::Instance>(*instance);
+            teardown = [zygote_instance]() {
+                Zygote::terminate(*zygote_instance);
+                return true;
+            };
+        }
+    } else {
+        boost::process::pipe output;
+        // Dropping privileges, and handing the listening socket over as fd 3 (socket activation)
+        pid_t server_pid = getpid();
+        auto on_setup_fn = [user_id, group_id, listen_fd, cgroup_fd, server_pid](auto &e) {
+            if (listen_fd >= 0) {
+                if (listen_fd == 3) {
+                    fcntl(listen_fd, F_SETFD, 0);
+                } else if (dup2(listen_fd, 3) < 0) {
+                    exit(1);
+                }
+                char pid[16];
+                snprintf(pid, sizeof(pid), "%d", static_cast<int>(getpid()));
+                setenv("LISTEN_FDS", "1", 1);
+                setenv("LISTEN_PID", pid, 1);
+                // The executor captured the environment before the fork
+                e.env = environ;
+            }
+            if (cgroup_fd >= 0 && !Cgroup::join(cgroup_fd)) {
+                exit(1);
+            }
+            if (!drop_privileges(user_id, group_id)) {
+                exit(1);
+            }
+            // Killed with the server, set after the privileges are dropped as changing them clears it
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            if (getppid() != server_pid) {
+                exit(1);
+            }
+        };
+        try {
+            // Running the command - Need to be a shared pointer
+            auto process = std::make_shared<boost::process::child>(challenge.command.c_str(), boost::process::std_out > output, boost::process::extend::on_exec_setup(on_setup_fn));
+            stdout_fd = fcntl(output.native_source(), F_DUPFD_CLOEXEC, 0);
+            teardown = [process]() {
+                if (process->valid()) {
+                    process->terminate();
+                    process->wait();
+                }
+                return true;
+            };
+        } catch (const boost::process::process_error& e) {
+            log_error("Failed to run the command: ", e.what(), LogField("challenge", challenge.name));
+        }
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    if (!teardown) {
+        if (stdout_fd >= 0) {
+            close(stdout_fd);
+        }
+        pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
+        boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to start the instance\n"),
             [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
                 if (ec) {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
+                    log_error("Write error: ", ec.message());
                 }
                 client_socket->close();
             });
         return;
     }
-    unsigned short port = std::stoull(tokens[3]);
+    if (cgroup) {
+        // Whatever the instance forked dies with it
+        teardown = [cgroup, teardown]() {
+            bool stopped = teardown();
+            cgroup->destroy();
+            return stopped;
+        };
+    }
+    waitForReadiness(client_socket, pool, stdout_fd, port, releasing(pool, teardown), cgroup);
+}
+
+void InstancesServer::waitForReadiness(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+    int stdout_fd, unsigned short port, std::function<bool()> teardown, std::shared_ptr<Cgroup> cgroup) {
+    auto self = shared_from_this();
+    // The output of the instance is read on the worker threads without blocking them, until it
+    // announces its port or the deadline passes. It is drained afterwards, so that the instance
+    // doesn't get a SIGPIPE the next time it prints something
+    struct Handshake {
+        boost::asio::strand<boost::asio::any_io_executor> strand;
+        boost::asio::posix::stream_descriptor output;
+        boost::asio::steady_timer timer;
+        boost::asio::streambuf buffer;
+        std::array<char, 512> discarded;
+        bool done = false;
+        Handshake(boost::asio::any_io_executor executor, int fd)
+            : strand(boost::asio::make_strand(executor)), output(strand, fd), timer(strand) {}
+    };
+    auto state = std::make_shared<Handshake>(client_socket->get_executor(), stdout_fd);
+
+    auto drain = std::make_shared<std::function<void()>>();
+    *drain = [state, drain]() {
+        state->output.async_read_some(boost::asio::buffer(state->discarded), boost::asio::bind_executor(state->strand,
+            [state, drain](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    // The instance exited
+                    *drain = nullptr;
+                    return;
+                }
+                (*drain)();
+            }));
+    };
+    ChallengePool* challenge = &pool;
+    auto ready = [self, client_socket, challenge, state, teardown, cgroup, drain](unsigned short port) {
+        state->done = true;
+        state->timer.cancel();
+        (*drain)();
+        // Registering the instance blocks on the API, leave the strand first
+        boost::asio::post(client_socket->get_executor(), [self, client_socket, challenge, port, teardown, cgroup]() {
+            self->registerBashInstance(client_socket, *challenge, port, teardown, cgroup);
+        });
+    };
+    if (port != 0) {
+        // The instance got its listening socket from us, nothing to wait for
+        boost::asio::post(state->strand, [ready, port]() {
+            ready(port);
+        });
+        return;
+    }
+
+    auto fail = [self, client_socket, challenge, state, teardown, drain](const std::string& reason) {
+        *drain = nullptr;
+        state->done = true;
+        state->timer.cancel();
+        boost::system::error_code ignored;
+        state->output.close(ignored);
+        log_error("Instance not ready: ", reason, LogField("challenge", challenge->challenge.config.name));
+        boost::asio::post(self->blocking_pool_, teardown);
+        boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to obtain a free port\n"),
+            [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    log_error("Write error: ", ec.message());
+                }
+                client_socket->close();
+            });
+    };
+
+    state->timer.expires_after(std::chrono::seconds(pool.challenge.config.ready_timeout));
+    state->timer.async_wait(boost::asio::bind_executor(state->strand,
+        [state, fail](const boost::system::error_code& ec) {
+            if (!ec && !state->done) {
+                fail("timeout");
+            }
+        }));
+
+    auto read = std::make_shared<std::function<void()>>();
+    *read = [state, fail, ready, read]() {
+        boost::asio::async_read_until(state->output, state->buffer, '\n', boost::asio::bind_executor(state->strand,
+            [state, fail, ready, read](boost::system::error_code ec, std::size_t /*length*/) {
+                if (state->done) {
+                    *read = nullptr;
+                    return;
+                }
+                if (ec) {
+                    *read = nullptr;
+                    fail(ec == boost::asio::error::eof ? "exited before announcing its port" : ec.message());
+                    return;
+                }
+                std::istream is(&state->buffer);
+                std::string line;
+                std::getline(is, line);
+                // Anything printed before the announcement is skipped
+                unsigned short port = parse_ready_port(line);
+                if (port == 0) {
+                    (*read)();
+                    return;
+                }
+                *read = nullptr;
+                ready(port);
+            }));
+    };
+    (*read)();
+}
+
+void InstancesServer::registerBashInstance(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+    unsigned short port, std::function<bool()> teardown, std::shared_ptr<Cgroup> cgroup) {
+    auto self = shared_from_this();
+    const ChallengeConfig& challenge = pool.challenge.config;
+    // Getting the API client
+    APIClient& api_client = get_thread_api_client(api_address_, api_port_);
     // Getting the UUID
-    auto result = api_client.apiAddService(instance_address_, port);
+    auto result = api_client.apiAddService(instance_address_, port, challenge.timeout);
     if (!result) {
+        boost::asio::post(blocking_pool_, teardown);
         boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to add a service!\n"),
             [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
                 if (ec) {
-                    std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                    log_error("Failed to write to client socket: ", ec.message());
                 }
                 client_socket->close();
             });
         return;
     }
-    std::string token = *result;
-    std::string msg = "Initialized private instance with token: " + token + "\n";
-    // Construct the challenge URL
-    std::string connection_info = "ncat ";
-    if (ssl_)
-        connection_info += "--ssl ";
-    connection_info += challenge_address_ + " " + challenge_port_;
-    msg += "Use it at: " + connection_info + "\n";
-    boost::asio::async_write(*client_socket, boost::asio::buffer(msg),
-        [self, client_socket, process](boost::system::error_code ec, std::size_t /*length*/) {
+    std::shared_ptr<std::string> token = std::make_shared<std::string>(*result);
+    auto msg = std::make_shared<std::string>(instanceMessage(challenge, *token, cgroup != nullptr));
+    long timeout = challenge.timeout;
+    boost::asio::async_write(*client_socket, boost::asio::buffer(*msg),
+        [self, client_socket, token, timeout, teardown, cgroup, msg](boost::system::error_code ec, std::size_t /*length*/) {
             if (ec) {
-                std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                log_error("Failed to write to client socket: ", ec.message());
                 client_socket->close();
-            } 
-            // Wait the timeout asynchronously
-            auto timer = std::make_shared<boost::asio::steady_timer>(self->io_context_, std::chrono::seconds(self->timeout_));
-            timer->async_wait([self, client_socket, process, timer] (const boost::system::error_code& ec) {
-                if (ec) 
-                    std::cerr << "Timer error: " << ec.message() << std::endl;
-                boost::asio::async_write(*client_socket, boost::asio::buffer("Terminating the instance...\n"),
-                    [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
-                        if (ec) {
-                            std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
-                        }
-                        client_socket->close();
-                    });
-                if (process->valid()) {
-                    process->terminate();
-                    process->wait();
-                }
-            });
+            }
+            self->superviseInstance(client_socket, token, timeout, teardown, cgroup);
         });
 }
 
-void InstancesServer::runDockerCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket) {
+void InstancesServer::runDockerCommand(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool) {
     auto self = shared_from_this();
+    const ChallengeConfig& challenge = pool.challenge.config;
     // Getting the API client
     APIClient& api_client = get_thread_api_client(api_address_, api_port_);
+    // Choosing the backend that will run the instance, within the share of the challenge
+    // A recycled instance is ready already, with its slot
+    auto ready = takeReady(pool);
+    if (ready) {
+        serveRecycled(client_socket, pool, std::move(*ready));
+        return;
+    }
+    std::shared_ptr<InstanceBackend> backend;
+    if (tryReserve(pool)) {
+        backend = scheduler_->acquire();
+        if (!backend) {
+            pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    if (!backend) {
+        boost::asio::async_write(*client_socket, boost::asio::buffer("No capacity left, try again later\n"),
+            [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec) {
+                    log_error("Write error: ", ec.message());
+                }
+                client_socket->close();
+            });
+        return;
+    }
     // Getting a free port
-    unsigned short port = get_random_port();
-    if (port == -1) {
+    unsigned short port = backend->allocatePort();
+    if (port == 0) {
+        backend->release();
+        pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
         boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to obtain a free port\n"),
             [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
                 if (ec) {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
+                    log_error("Write error: ", ec.message());
                 }
                 client_socket->close();
             });
         return;
     }
-    // Getting the UUID
-    auto result = api_client.apiAddService(instance_address_, port);
+    // Getting the UUID, the tunnel will reach the instance on the chosen backend
+    auto result = api_client.apiAddService(backend->getAddress(), port, challenge.timeout);
     if (!result) {
+        backend->release();
+        pool.live_instances.fetch_sub(1, std::memory_order_relaxed);
         boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to add a service!\n"),
             [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
                 if (ec) {
-                    std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                    log_error("Failed to write to client socket: ", ec.message());
                 }
                 client_socket->close();
             });
         return;
     }
     std::shared_ptr<std::string> token = std::make_shared<std::string>(*result);
+    // Tracked before it runs, so that the reconciliation never takes it for an orphan
+    trackInstance(*token);
     // Running the docker command
-    char char_command[256] = {0}; // TODO - Dynamic allocation
-    snprintf(char_command, sizeof(char_command), command_.c_str(), port, token->c_str());
-    int status = system(char_command);
-    if (status == -1) {
-        boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to run the docker command\n"),
+    ChallengePool* instance_pool = &pool;
+    std::string command = challenge.command;
+    runBlocking(client_socket->get_executor(),
+        [backend, command, port, token]() {
+            return backend->launch(command, port, *token);
+        },
+        [self, client_socket, instance_pool, backend, port, token](bool launched) {
+            if (!launched) {
+                backend->release();
+                instance_pool->live_instances.fetch_sub(1, std::memory_order_relaxed);
+                self->untrackInstance(*token);
+                boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to run the docker command\n"),
+                    [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                        if (ec) {
+                            log_error("Failed to write to client socket: ", ec.message());
+                        }
+                        client_socket->close();
+                    });
+                return;
+            }
+            self->serveLaunched(client_socket, *instance_pool, backend, port, token);
+        });
+}
+
+void InstancesServer::serveLaunched(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+    std::shared_ptr<InstanceBackend> backend, unsigned short port, std::shared_ptr<std::string> token) {
+    auto self = shared_from_this();
+    const ChallengeConfig& challenge = pool.challenge.config;
+    // The token is only handed out once the instance accepts connections
+    auto teardown = releasing(pool, dockerTeardown(backend, token));
+    // Once it served a user, an instance that can be recycled is reset rather than stopped
+    auto supervised_teardown = teardown;
+    if (!challenge.recycle_command.empty()) {
+        supervised_teardown = recycleTeardown(pool, backend, port, token);
+    }
+    ChallengePool* instance_pool = &pool;
+    probeReadiness(client_socket->get_executor(), backend->getAddress(), port, challenge.ready_timeout,
+        [self, client_socket, instance_pool, token, teardown, supervised_teardown](bool ready) {
+            const ChallengeConfig& challenge = instance_pool->challenge.config;
+            if (!ready) {
+                log_error("Instance ", *token, " not ready: timeout", LogField("challenge", challenge.name));
+                APIClient& api_client = get_thread_api_client(self->api_address_, self->api_port_);
+                api_client.apiRevokeService(*token);
+                boost::asio::post(self->blocking_pool_, teardown);
+                boost::asio::async_write(*client_socket, boost::asio::buffer("The instance did not start in time\n"),
+                    [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                        if (ec) {
+                            log_error("Write error: ", ec.message());
+                        }
+                        client_socket->close();
+                    });
+                return;
+            }
+            auto buffer = std::make_shared<std::string>(instanceMessage(challenge, *token, false));
+            long timeout = challenge.timeout;
+            boost::asio::async_write(*client_socket, boost::asio::buffer(*buffer),
+                [self, client_socket, token, timeout, supervised_teardown, buffer](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (ec) {
+                        log_error("Failed to write to client socket: ", ec.message());
+                        client_socket->close();
+                    }
+                    self->superviseInstance(client_socket, token, timeout, supervised_teardown);
+                });
+        });
+}
+
+void InstancesServer::serveRecycled(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, ChallengePool& pool,
+    ReadyInstance instance) {
+    auto self = shared_from_this();
+    const ChallengeConfig& challenge = pool.challenge.config;
+    // The instance was renamed after this token when it was reset, nobody knows it yet
+    APIClient& api_client = get_thread_api_client(api_address_, api_port_);
+    if (!api_client.apiPutService(instance.token, instance.backend->getAddress(), instance.port, challenge.timeout)) {
+        // Still clean, it waits for the next user
+        {
+            std::lock_guard<std::mutex> lock(pool.ready_mutex);
+            pool.ready.push_back(std::move(instance));
+        }
+        boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to add a service!\n"),
             [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
                 if (ec) {
-                    std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                    log_error("Failed to write to client socket: ", ec.message());
                 }
                 client_socket->close();
             });
         return;
     }
-    std::string msg = "Initialized private instance with token: " + *token + "\n";
-    // Construct the challenge URL
-    std::string connection_info = "ncat ";
-    if (ssl_)
-        connection_info += "--ssl ";
-    connection_info += challenge_address_ + " " + challenge_port_;
-    msg += "Use it at: " + connection_info + "\n";
-    boost::asio::async_write(*client_socket, boost::asio::buffer(msg),
-        [self, client_socket, token](boost::system::error_code ec, std::size_t /*length*/) {
+    auto token = std::make_shared<std::string>(instance.token);
+    auto teardown = recycleTeardown(pool, instance.backend, instance.port, token);
+    auto buffer = std::make_shared<std::string>(instanceMessage(challenge, *token, false));
+    long timeout = challenge.timeout;
+    boost::asio::async_write(*client_socket, boost::asio::buffer(*buffer),
+        [self, client_socket, token, timeout, teardown, buffer](boost::system::error_code ec, std::size_t /*length*/) {
             if (ec) {
-                std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                log_error("Failed to write to client socket: ", ec.message());
                 client_socket->close();
-            } 
-            // Wait the timeout asynchronously
-            auto timer = std::make_shared<boost::asio::steady_timer>(self->io_context_, std::chrono::seconds(self->timeout_));
-            timer->async_wait([self, client_socket, token, timer] (const boost::system::error_code& ec) {
-                if (ec) 
-                    std::cerr << "Timer error: " << ec.message() << std::endl;
-                boost::asio::async_write(*client_socket, boost::asio::buffer("Terminating the instance...\n"),
-                    [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+            }
+            self->superviseInstance(client_socket, token, timeout, teardown);
+        });
+}
+
+std::optional<InstancesServer::ReadyInstance> InstancesServer::takeReady(ChallengePool& pool) {
+    std::lock_guard<std::mutex> lock(pool.ready_mutex);
+    if (pool.ready.empty()) {
+        return std::nullopt;
+    }
+    ReadyInstance instance = std::move(pool.ready.back());
+    pool.ready.pop_back();
+    return instance;
+}
+
+void InstancesServer::probeReadiness(boost::asio::any_io_executor executor, const std::string& address, unsigned short port,
+    long ready_timeout, std::function<void(bool)> done) {
+    // Connections are attempted with an exponential backoff until one is accepted and kept open,
+    // or until the deadline. Nothing blocks the worker threads in the meantime
+    struct Probe {
+        boost::asio::strand<boost::asio::any_io_executor> strand;
+        boost::asio::ip::tcp::resolver resolver;
+        boost::asio::ip::tcp::socket socket;
+        boost::asio::steady_timer retry_timer;
+        boost::asio::steady_timer settle_timer;
+        boost::asio::steady_timer deadline;
+        std::array<char, 1> byte;
+        std::chrono::milliseconds delay = PROBE_MIN_DELAY;
+        bool finished = false;
+        Probe(boost::asio::any_io_executor executor)
+            : strand(boost::asio::make_strand(executor)), resolver(strand), socket(strand),
+              retry_timer(strand), settle_timer(strand), deadline(strand) {}
+    };
+    auto state = std::make_shared<Probe>(executor);
+
+    auto finish = [state, done](bool ready) {
+        if (state->finished) {
+            return;
+        }
+        state->finished = true;
+        state->resolver.cancel();
+        state->retry_timer.cancel();
+        state->settle_timer.cancel();
+        state->deadline.cancel();
+        boost::system::error_code ignored;
+        state->socket.close(ignored);
+        done(ready);
+    };
+
+    auto attempt = std::make_shared<std::function<void()>>();
+    auto retry = [state, attempt]() {
+        boost::system::error_code ignored;
+        state->socket.close(ignored);
+        state->settle_timer.cancel();
+        state->retry_timer.expires_after(state->delay);
+        state->delay = std::min(state->delay * 2, std::chrono::duration_cast<std::chrono::milliseconds>(PROBE_MAX_DELAY));
+        state->retry_timer.async_wait(boost::asio::bind_executor(state->strand,
+            [state, attempt](const boost::system::error_code& ec) {
+                if (!ec && !state->finished) {
+                    (*attempt)();
+                }
+            }));
+    };
+    *attempt = [state, address, port, finish, retry]() {
+        state->resolver.async_resolve(address, std::to_string(port), boost::asio::bind_executor(state->strand,
+            [state, finish, retry](const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+                if (state->finished) {
+                    return;
+                }
+                if (ec) {
+                    retry();
+                    return;
+                }
+                boost::asio::async_connect(state->socket, endpoints, boost::asio::bind_executor(state->strand,
+                    [state, finish, retry](const boost::system::error_code& ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+                        if (state->finished) {
+                            return;
+                        }
                         if (ec) {
-                            std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                            retry();
+                            return;
                         }
-                        client_socket->close();
-                    });
-                char char_command[256] = {0}; // TODO - Dynamic allocation
-                snprintf(char_command, sizeof(char_command), "docker stop %s", token->c_str());
-                int status = system(char_command);
-                if (status == -1) {
-                    std::cerr << "Failed to stop the instance!" << std::endl;
-                    boost::asio::async_write(*client_socket, boost::asio::buffer("Failed to stop the instance\n"),
-                        [client_socket](boost::system::error_code ec, std::size_t /*length*/) {
+                        // Data (a banner) means ready, a closed connection means not yet
+                        state->socket.async_read_some(boost::asio::buffer(state->byte), boost::asio::bind_executor(state->strand,
+                            [state, finish, retry](const boost::system::error_code& ec, std::size_t /*length*/) {
+                                if (state->finished) {
+                                    return;
+                                }
+                                if (ec) {
+                                    retry();
+                                    return;
+                                }
+                                finish(true);
+                            }));
+                        state->settle_timer.expires_after(PROBE_SETTLE_TIME);
+                        state->settle_timer.async_wait(boost::asio::bind_executor(state->strand,
+                            [state, finish](const boost::system::error_code& ec) {
+                                if (!ec) {
+                                    finish(true);
+                                }
+                            }));
+                    }));
+            }));
+    };
+
+    state->deadline.expires_after(std::chrono::seconds(ready_timeout));
+    state->deadline.async_wait(boost::asio::bind_executor(state->strand,
+        [state, finish, attempt](const boost::system::error_code& ec) {
+            if (!ec) {
+                finish(false);
+            }
+            // Break the self-reference of the attempts
+            *attempt = nullptr;
+        }));
+    boost::asio::post(state->strand, [attempt]() {
+        (*attempt)();
+    });
+}
+
+void InstancesServer::runBlocking(boost::asio::any_io_executor executor, std::function<bool()> command,
+    std::function<void(bool)> done) {
+    boost::asio::post(blocking_pool_, [executor, command, done]() {
+        bool result = command();
+        boost::asio::post(executor, [done, result]() {
+            done(result);
+        });
+    });
+}
+
+std::function<bool()> InstancesServer::dockerTeardown(std::shared_ptr<InstanceBackend> backend, std::shared_ptr<std::string> token) {
+    auto self = shared_from_this();
+    return [self, backend, token]() {
+        bool stopped = backend->stop(*token);
+        backend->release();
+        self->untrackInstance(*token);
+        if (!stopped) {
+            log_error("Failed to stop the instance!");
+        }
+        return stopped;
+    };
+}
+
+std::function<bool()> InstancesServer::recycleTeardown(ChallengePool& pool, std::shared_ptr<InstanceBackend> backend,
+    unsigned short port, std::shared_ptr<std::string> token) {
+    auto self = shared_from_this();
+    ChallengePool* instance_pool = &pool;
+    // The teardown only runs once the token expired or was revoked
+    return [self, instance_pool, backend, port, token]() {
+        return self->recycleInstance(*instance_pool, backend, port, *token);
+    };
+}
+
+bool InstancesServer::recycleInstance(ChallengePool& pool, std::shared_ptr<InstanceBackend> backend, unsigned short port,
+    const std::string& token) {
+    auto self = shared_from_this();
+    const ChallengeConfig& challenge = pool.challenge.config;
+    ChallengePool* instance_pool = &pool;
+    // Waiting instances count in live_instances, the slot is given back once the instance is stopped
+    auto discard = [self, instance_pool, backend](const std::string& name) {
+        bool stopped = backend->stop(name);
+        backend->release();
+        instance_pool->live_instances.fetch_sub(1, std::memory_order_relaxed);
+        self->untrackInstance(name);
+        if (!stopped) {
+            log_error("Failed to stop the instance!");
+        }
+        return stopped;
+    };
+    {
+        std::lock_guard<std::mutex> lock(pool.ready_mutex);
+        if (pool.ready.size() >= challenge.recycle_pool) {
+            return discard(token);
+        }
+    }
+    // A reset keeps the writable layer of the container, so only a read-only instance can go to
+    // another user without the files of the previous one
+    if (!backend->isReadOnly(token)) {
+        log_error("Instance ", token, " not recycled: its root filesystem is writable", LogField("challenge", challenge.name));
+        return discard(token);
+    }
+    // The reset restarts the processes of the instance and drops the connections of the previous
+    // user. The name changes with it, so that the instance stays named after the token of its user
+    if (!backend->recycle(challenge.recycle_command, token)) {
+        log_error("Failed to reset the instance ", token, LogField("challenge", challenge.name));
+        return discard(token);
+    }
+    std::string next_token = UUID().toString();
+    // Tracked under both names until the rename, never taken for an orphan
+    trackInstance(next_token);
+    if (!backend->rename(token, next_token)) {
+        untrackInstance(next_token);
+        return discard(token);
+    }
+    untrackInstance(token);
+    probeReadiness(pool_.getIOContext().get_executor(), backend->getAddress(), port, challenge.ready_timeout,
+        [self, instance_pool, backend, port, next_token, discard](bool ready) {
+            const ChallengeConfig& challenge = instance_pool->challenge.config;
+            if (!ready) {
+                log_error("Instance ", next_token, " not ready after its reset: timeout", LogField("challenge", challenge.name));
+                boost::asio::post(self->blocking_pool_, [discard, next_token]() {
+                    discard(next_token);
+                });
+                return;
+            }
+            std::unique_lock<std::mutex> lock(instance_pool->ready_mutex);
+            if (instance_pool->ready.size() >= challenge.recycle_pool) {
+                lock.unlock();
+                boost::asio::post(self->blocking_pool_, [discard, next_token]() {
+                    discard(next_token);
+                });
+                return;
+            }
+            instance_pool->ready.push_back({backend, port, next_token});
+        });
+    return true;
+}
+
+bool InstancesServer::trackInstance(const std::string& token) {
+    std::lock_guard<std::mutex> lock(instances_mutex_);
+    return instances_.insert(token).second;
+}
+
+void InstancesServer::untrackInstance(const std::string& token) {
+    std::lock_guard<std::mutex> lock(instances_mutex_);
+    instances_.erase(token);
+}
+
+bool InstancesServer::isTracked(const std::string& token) {
+    std::lock_guard<std::mutex> lock(instances_mutex_);
+    return instances_.count(token) != 0;
+}
+
+void InstancesServer::reconcileInstances() {
+    APIClient& api_client = get_thread_api_client(api_address_, api_port_);
+    for (const auto& backend : scheduler_->getBackends()) {
+        auto names = backend->listInstances();
+        if (!names) {
+            continue;
+        }
+        std::vector<std::string> orphans;
+        std::size_t adopted = 0;
+        for (const auto& name : *names) {
+            // Instances are named after their token, anything else is not ours
+            try {
+                UUID uuid(name);
+            } catch (const std::invalid_argument&) {
+                continue;
+            }
+            if (isTracked(name)) {
+                continue;
+            }
+            auto info = api_client.apiGetInfo(name);
+            if (!info) {
+                // Expired, revoked or unknown: nobody can use it anymore
+                orphans.push_back(name);
+                continue;
+            }
+            if (std::get<0>(*info) == 0) {
+                // The API could not be reached, decide next time
+                continue;
+            }
+            // Still valid: supervise it again until its token expires
+            if (!trackInstance(name)) {
+                continue;
+            }
+            // The challenge of the instance isn't known, it only counts on its backend
+            backend->adopt();
+            auto token = std::make_shared<std::string>(name);
+            superviseInstance(nullptr, token, std::get<1>(*info), dockerTeardown(backend, token));
+            ++adopted;
+        }
+        if (!orphans.empty()) {
+            backend->stopAll(orphans);
+        }
+        if (adopted != 0 || !orphans.empty()) {
+            log_info("[", backend->getName(), "] Adopted ", adopted, " instances and reaped ",
+                     orphans.size(), " orphaned instances.");
+        }
+    }
+}
+
+void InstancesServer::scheduleReconciliation() {
+    auto self = shared_from_this();
+    reconcile_timer_->expires_after(std::chrono::seconds(reconcile_interval_));
+    reconcile_timer_->async_wait([self](const boost::system::error_code& ec) {
+        if (!ec) {
+            // Listing and stopping the instances wait on docker
+            boost::asio::post(self->blocking_pool_, [self]() {
+                self->reconcileInstances();
+                self->scheduleReconciliation();
+            });
+        }
+    });
+}
+
+void InstancesServer::superviseInstance(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket,
+    std::shared_ptr<std::string> token, long timeout, std::function<bool()> teardown, std::shared_ptr<Cgroup> cgroup) {
+    auto self = shared_from_this();
+    // The token checks and the user's commands run on the same strand
+    struct Supervision {
+        boost::asio::strand<boost::asio::any_io_executor> strand;
+        boost::asio::steady_timer timer;
+        boost::asio::steady_timer limits_timer;
+        boost::asio::streambuf buffer;
+        std::chrono::steady_clock::time_point deadline;
+        bool done = false;
+        Supervision(boost::asio::any_io_executor executor)
+            : strand(boost::asio::make_strand(executor)), timer(strand), limits_timer(strand) {}
+    };
+    // Adopted instances have no client
+    auto state = std::make_shared<Supervision>(client_socket ? client_socket->get_executor() : pool_.getIOContext().get_executor());
+    state->deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+
+    // The reason is told to the user once the instance is terminated
+    auto terminate = [self, client_socket, state, token, teardown, cgroup](const std::string& reason) {
+        if (state->done) {
+            return;
+        }
+        state->done = true;
+        state->timer.cancel();
+        state->limits_timer.cancel();
+        self->unwatchToken(*token);
+        if (cgroup) {
+            auto usage = cgroup->usage();
+            if (usage) {
+                log_info("Instance ", *token, " used ", format_usage(*usage));
+            }
+        }
+        self->runBlocking(state->strand, teardown, [client_socket, reason](bool stopped) {
+            if (!client_socket) {
+                return;
+            }
+            std::string msg = reason + "Terminating the instance...\n";
+            if (!stopped) {
+                msg += "Failed to stop the instance\n";
+            }
+            auto buffer = std::make_shared<std::string>(msg);
+            boost::asio::async_write(*client_socket, boost::asio::buffer(*buffer),
+                [client_socket, buffer](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (ec) {
+                        log_error("Failed to write to client socket: ", ec.message());
+                    }
+                    client_socket->close();
+                });
+        });
+    };
+
+    // Answers of the API about the token, handled on the strand. The periodic checks push the deadline
+    // back when the token was extended, and the token is looked up one last time at the deadline
+    auto check = std::make_shared<std::function<void(TokenInfo)>>();
+    auto answer = [state, check](TokenInfo info) {
+        boost::asio::post(state->strand, [state, check, info]() {
+            if (!*check) {
+                return;
+            }
+            (*check)(info);
+            if (state->done) {
+                // Break the self-reference of the checks
+                *check = nullptr;
+            }
+        });
+    };
+    auto expire = [self, state, token, check, answer]() {
+        state->timer.expires_at(state->deadline);
+        state->timer.async_wait(boost::asio::bind_executor(state->strand,
+            [self, state, token, check, answer](const boost::system::error_code& ec) {
+                if (state->done) {
+                    *check = nullptr;
+                    return;
+                }
+                if (ec) {
+                    return;
+                }
+                boost::asio::post(self->blocking_pool_, [self, token, answer]() {
+                    answer(get_thread_api_client(self->api_address_, self->api_port_).apiGetInfo(*token));
+                });
+            }));
+    };
+    *check = [state, terminate, expire](TokenInfo info) {
+        if (state->done) {
+            return;
+        }
+        if (!info) {
+            // The token expired or was revoked
+            terminate("");
+            return;
+        }
+        // A port of 0 means that the API could not be reached, keep the last known deadline
+        if (std::get<0>(*info) != 0) {
+            state->deadline = std::chrono::steady_clock::now() + std::chrono::seconds(std::get<1>(*info));
+        }
+        if (std::chrono::steady_clock::now() >= state->deadline) {
+            terminate("");
+            return;
+        }
+        expire();
+    };
+    boost::asio::post(state->strand, expire);
+    watchToken(*token, answer);
+
+    // Kill the instance as soon as it goes over its limits, or exits
+    if (cgroup) {
+        auto limits = std::make_shared<std::function<void()>>();
+        *limits = [self, state, token, cgroup, terminate, limits]() {
+            state->limits_timer.expires_after(std::chrono::seconds(LIMITS_CHECK_INTERVAL));
+            state->limits_timer.async_wait(boost::asio::bind_executor(state->strand,
+                [self, state, token, cgroup, terminate, limits](const boost::system::error_code& ec) {
+                    if (ec || state->done) {
+                        *limits = nullptr;
+                        return;
+                    }
+                    std::string reason = cgroup->limitExceeded();
+                    if (reason.empty()) {
+                        (*limits)();
+                        return;
+                    }
+                    log_error("Instance ", *token, " killed: ", reason);
+                    APIClient& api_client = get_thread_api_client(self->api_address_, self->api_port_);
+                    api_client.apiRevokeService(*token);
+                    *limits = nullptr;
+                    terminate("The instance " + reason + ".\n");
+                }));
+        };
+        boost::asio::post(state->strand, [limits]() {
+            (*limits)();
+        });
+    }
+
+    if (!client_socket) {
+        return;
+    }
+    // Read the user's commands until the connection is closed
+    auto read = std::make_shared<std::function<void()>>();
+    *read = [self, client_socket, state, token, cgroup, terminate, read]() {
+        boost::asio::async_read_until(*client_socket, state->buffer, '\n', boost::asio::bind_executor(state->strand,
+            [self, client_socket, state, token, cgroup, terminate, read](boost::system::error_code ec, std::size_t /*length*/) {
+                if (ec || state->done) {
+                    *read = nullptr;
+                    return;
+                }
+                std::istream is(&state->buffer);
+                std::string line;
+                std::getline(is, line);
+                std::vector<std::string> tokens = split_command(line);
+                if (!tokens.empty() && tokens[0] == "stop") {
+                    // Release the token right away, the tunnel stops accepting it
+                    APIClient& api_client = get_thread_api_client(self->api_address_, self->api_port_);
+                    api_client.apiRevokeService(*token);
+                    *read = nullptr;
+                    terminate("");
+                    return;
+                }
+                if (!tokens.empty() && tokens[0] == "stats" && cgroup) {
+                    auto usage = cgroup->usage();
+                    auto msg = std::make_shared<std::string>(usage ? format_usage(*usage) + "\n" : "No usage available\n");
+                    boost::asio::async_write(*client_socket, boost::asio::buffer(*msg), boost::asio::bind_executor(state->strand,
+                        [client_socket, msg, read](boost::system::error_code ec, std::size_t /*length*/) {
                             if (ec) {
-                                std::cerr << "Failed to write to client socket: " << ec.message() << std::endl;
+                                *read = nullptr;
+                                return;
                             }
-                            client_socket->close();
-                        });
+                            (*read)();
+                        }));
+                    return;
                 }
-            });
-        });
+                (*read)();
+            }));
+    };
+    boost::asio::post(state->strand, [read]() {
+        (*read)();
+    });
+}
+
+void InstancesServer::watchToken(const std::string& token, std::function<void(TokenInfo)> on_info) {
+    std::lock_guard<std::mutex> lock(token_checks_mutex_);
+    token_checks_[token] = std::move(on_info);
+}
+
+void InstancesServer::unwatchToken(const std::string& token) {
+    std::lock_guard<std::mutex> lock(token_checks_mutex_);
+    token_checks_.erase(token);
+}
+
+void InstancesServer::runTokenChecks() {
+    APIClient& api_client = get_thread_api_client(api_address_, api_port_);
+    std::vector<std::pair<std::string, std::function<void(TokenInfo)>>> batch;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(token_checks_mutex_);
+            if (token_checks_cv_.wait_for(lock, std::chrono::seconds(TOKEN_CHECK_INTERVAL), [this]() {
+                    return token_checks_stopped_;
+                })) {
+                return;
+            }
+            batch.assign(token_checks_.begin(), token_checks_.end());
+        }
+        // The lookups block on the API, outside of the lock and of the io threads
+        for (auto& check : batch) {
+            check.second(api_client.apiGetInfo(check.first));
+        }
+        batch.clear();
+    }
 }
 
 // Start method to run the server and handle incoming connections
 void InstancesServer::start() {
-    std::cout << "Server started." << std::endl;
-    std::cout << "Using " << num_threads_ << " threads." << std::endl;
-    std::cout << "Waiting for incoming connections on port " << port_ << "." << std::endl;
-    doAccept();
-    for (unsigned int i = 0; i < num_threads_; ++i) {
-        threads_.emplace_back([this]() {
-            io_context_.run();
-        });
+    log_info("Server started.");
+    log_info("Using ", pool_.getNumThreads(), " threads and ", challenges_.front()->acceptors.size(), " acceptors per challenge.");
+    for (const auto& pool : challenges_) {
+        log_info("Waiting for incoming connections on port ", pool->challenge.config.port, ".",
+                 LogField("challenge", pool->challenge.config.name));
     }
+    token_check_thread_ = std::thread([this]() {
+        runTokenChecks();
+    });
+    if (scheduler_) {
+        // Instances left over by a previous run are adopted or reaped before serving new ones
+        reconcileInstances();
+        if (reconcile_interval_ > 0) {
+            log_info("Looking for orphaned instances every ", reconcile_interval_, " seconds.");
+            reconcile_timer_ = std::make_shared<boost::asio::steady_timer>(pool_.getIOContext());
+            scheduleReconciliation();
+        }
+    }
+    for (auto& pool : challenges_) {
+        for (auto& acceptor : pool->acceptors) {
+            doAccept(*acceptor, *pool);
+        }
+    }
+    pool_.run();
 }
 
 void InstancesServer::stop() {
-    io_context_.stop();
-    for (auto& t : threads_) {
-        if (t.joinable()) {
-            t.join();
-        }
+    pool_.stop();
+    {
+        std::lock_guard<std::mutex> lock(token_checks_mutex_);
+        token_checks_stopped_ = true;
     }
+    token_checks_cv_.notify_all();
+    if (token_check_thread_.joinable()) {
+        token_check_thread_.join();
+    }
+    // The commands in flight complete, no instance is left half torn down
+    blocking_pool_.join();
 }
 
-void InstancesServer::doAccept() {
+void InstancesServer::doAccept(boost::asio::ip::tcp::acceptor& acceptor, ChallengePool& pool) {
     auto self = shared_from_this();
-    acceptor_.async_accept(
-        [this, self](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+    acceptor.async_accept(
+        [this, self, &acceptor, &pool](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
             if (!ec) {
                 // Handle the client connection
-                handleClient(std::move(socket));
+                handleClient(std::move(socket), pool);
             } else {
-                std::cerr << "Accept error: " << ec.message() << std::endl;
+                log_error("Accept error: ", ec.message());
                 socket.close();
             }
             // Continue accepting new connections
-            doAccept();
+            doAccept(acceptor, pool);
         });
 }
 
-void InstancesServer::handleClient(boost::asio::ip::tcp::socket client_socket_) {
+void InstancesServer::handleClient(boost::asio::ip::tcp::socket client_socket_, ChallengePool& pool) {
     // Creating a shared pointer for the client socket
     auto client_socket = std::make_shared<boost::asio::ip::tcp::socket>(std::move(client_socket_));
     client_socket->write_some(boost::asio::buffer("Initializing private instance...\n"));
-    // Getting the API client
-    run_command(client_socket);
+    if (pool.challenge.config.cmd_type == CommandType::Docker) {
+        runDockerCommand(client_socket, pool);
+    } else {
+        runBashCommand(client_socket, pool);
+    }
 }
\ No newline at end of file
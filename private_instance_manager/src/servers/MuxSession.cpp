@@ -0,0 +1,359 @@
+#include "servers/MuxSession.hpp"
+#include "common/Logger.hpp"
+
+static void encode_header(char* header, std::uint32_t stream_id, MuxSession::FrameType type, std::size_t length) {
+    header[0] = static_cast<char>((stream_id >> 24) & 0xff);
+    header[1] = static_cast<char>((stream_id >> 16) & 0xff);
+    header[2] = static_cast<char>((stream_id >> 8) & 0xff);
+    header[3] = static_cast<char>(stream_id & 0xff);
+    header[4] = static_cast<char>(type);
+    header[5] = static_cast<char>((length >> 8) & 0xff);
+    header[6] = static_cast<char>(length & 0xff);
+}
+
+MuxSession::Stream::Stream(std::uint32_t stream_id, boost::asio::ip::tcp::socket stream_socket)
+    : id(stream_id), socket(std::move(stream_socket)), throttle_timer(socket.get_executor()) {}
+
+MuxSession::MuxSession(std::shared_ptr<TunnelSession> session, boost::asio::ip::tcp::resolver::results_type endpoints,
+                       std::size_t max_streams, std::size_t spare_connections)
+    : session_(std::move(session)),
+      endpoints_(std::move(endpoints)),
+      max_streams_(max_streams),
+      spare_connections_(spare_connections),
+      connecting_spares_(0),
+      throttle_timer_(session_->getStrand()),
+      writing_(false),
+      read_on_flush_(false),
+      closed_(false) {}
+
+void MuxSession::start() {
+    replenishSpares();
+    readHeader();
+}
+
+void MuxSession::readHeader() {
+    auto self = shared_from_this();
+    session_->withClientStream([this, self](auto& client_stream) {
+        boost::asio::async_read(client_stream, boost::asio::buffer(header_),
+            boost::asio::bind_executor(session_->getStrand(),
+                [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (closed_) {
+                        return;
+                    }
+                    if (ec) {
+                        if (ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted) {
+                            log_error("Mux read error: ", ec.message(),
+                                      LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                        }
+                        shutdown();
+                        return;
+                    }
+                    const auto* header = reinterpret_cast<const unsigned char*>(header_.data());
+                    std::uint32_t stream_id = (std::uint32_t(header[0]) << 24) | (std::uint32_t(header[1]) << 16)
+                                            | (std::uint32_t(header[2]) << 8) | std::uint32_t(header[3]);
+                    auto type = static_cast<FrameType>(header[4]);
+                    std::size_t length = (std::size_t(header[5]) << 8) | std::size_t(header[6]);
+                    session_->touch();
+                    if (length > 0) {
+                        readPayload(stream_id, type, length);
+                    } else {
+                        handleFrame(stream_id, type, 0);
+                    }
+                }));
+    });
+}
+
+void MuxSession::readPayload(std::uint32_t stream_id, FrameType type, std::size_t length) {
+    auto self = shared_from_this();
+    session_->withClientStream([this, self, stream_id, type, length](auto& client_stream) {
+        boost::asio::async_read(client_stream, boost::asio::buffer(payload_, length),
+            boost::asio::bind_executor(session_->getStrand(),
+                [this, self, stream_id, type, length](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (closed_) {
+                        return;
+                    }
+                    if (ec) {
+                        if (ec != boost::asio::error::operation_aborted) {
+                            log_error("Mux read error: ", ec.message(),
+                                      LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                        }
+                        shutdown();
+                        return;
+                    }
+                    handleFrame(stream_id, type, length);
+                }));
+    });
+}
+
+void MuxSession::handleFrame(std::uint32_t stream_id, FrameType type, std::size_t length) {
+    auto it = streams_.find(stream_id);
+    switch (type) {
+        case FrameType::Open:
+            openStream(stream_id);
+            return;
+        case FrameType::Data:
+            // Data of a stream that is already closed is dropped
+            if (it == streams_.end() || it->second->client_closed) {
+                resume(TunnelSession::Clock::duration::zero());
+                return;
+            }
+            writeToInstance(it->second, length);
+            return;
+        case FrameType::Close:
+            if (it != streams_.end() && !it->second->client_closed) {
+                closeFromClient(it->second);
+            }
+            resume(TunnelSession::Clock::duration::zero());
+            return;
+    }
+    log_error("Mux protocol error: unknown frame type ", static_cast<int>(type),
+              LogField("session", session_->getId()), LogField("token", session_->getToken()));
+    shutdown();
+}
+
+void MuxSession::openStream(std::uint32_t stream_id) {
+    if (streams_.count(stream_id)) {
+        log_error("Mux protocol error: OPEN of stream ", stream_id, " which is still open",
+                  LogField("session", session_->getId()), LogField("token", session_->getToken()));
+        shutdown();
+        return;
+    }
+    if (streams_.size() >= max_streams_) {
+        // A client that doesn't read its refusals can't make them pile up
+        sendClose(stream_id);
+        resumeAfterFlush();
+        return;
+    }
+    if (!spares_.empty()) {
+        auto stream = std::make_shared<Stream>(stream_id, std::move(spares_.back()));
+        spares_.pop_back();
+        streams_.emplace(stream_id, stream);
+        readInstance(stream);
+        replenishSpares();
+        resume(TunnelSession::Clock::duration::zero());
+        return;
+    }
+    auto stream = std::make_shared<Stream>(stream_id, boost::asio::ip::tcp::socket(session_->getIOContext()));
+    streams_.emplace(stream_id, stream);
+    // The frames that follow are likely for this stream, wait for the connection before reading them
+    auto self = shared_from_this();
+    boost::asio::async_connect(stream->socket, endpoints_,
+        boost::asio::bind_executor(session_->getStrand(),
+            [this, self, stream](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+                if (closed_) {
+                    return;
+                }
+                if (ec) {
+                    log_error("Mux connect to instance error: ", ec.message(),
+                              LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                    stream->instance_closed = true;
+                    sendClose(stream->id);
+                } else {
+                    readInstance(stream);
+                }
+                resume(TunnelSession::Clock::duration::zero());
+            }));
+}
+
+void MuxSession::writeToInstance(std::shared_ptr<Stream> stream, std::size_t length) {
+    // Charge the payload to the session and token budgets
+    auto delay = session_->chargeBytes(true, length);
+    auto self = shared_from_this();
+    boost::asio::async_write(stream->socket, boost::asio::buffer(payload_, length),
+        boost::asio::bind_executor(session_->getStrand(),
+            [this, self, stream, delay](boost::system::error_code ec, std::size_t /*length*/) {
+                if (closed_) {
+                    return;
+                }
+                if (ec && !stream->instance_closed) {
+                    // The pending read fails as well, and closes the stream on the client side
+                    log_error("Mux write error: ", ec.message(),
+                              LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                    boost::system::error_code ignored;
+                    stream->socket.close(ignored);
+                }
+                resume(delay);
+            }));
+}
+
+void MuxSession::closeFromClient(std::shared_ptr<Stream> stream) {
+    stream->client_closed = true;
+    // The instance sees the end of its input, and may still answer
+    boost::system::error_code ignored;
+    stream->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+    release(stream);
+}
+
+void MuxSession::resume(TunnelSession::Clock::duration delay) {
+    if (delay <= TunnelSession::Clock::duration::zero()) {
+        readHeader();
+        return;
+    }
+    // Over budget, wait before reading the next frame
+    auto self = shared_from_this();
+    throttle_timer_.expires_after(delay);
+    throttle_timer_.async_wait(boost::asio::bind_executor(session_->getStrand(),
+        [this, self](boost::system::error_code ec) {
+            if (!ec && !closed_) {
+                readHeader();
+            }
+        }));
+}
+
+void MuxSession::readInstance(std::shared_ptr<Stream> stream) {
+    auto self = shared_from_this();
+    stream->socket.async_read_some(boost::asio::buffer(stream->frame.data() + HEADER_SIZE, MAX_PAYLOAD),
+        boost::asio::bind_executor(session_->getStrand(),
+            [this, self, stream](boost::system::error_code ec, std::size_t bytes_transferred) {
+                if (closed_) {
+                    return;
+                }
+                if (ec || bytes_transferred == 0) {
+                    if (ec && ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted) {
+                        log_error("Mux read from instance error: ", ec.message(),
+                                  LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                    }
+                    stream->instance_closed = true;
+                    sendClose(stream->id);
+                    release(stream);
+                    return;
+                }
+                session_->touch();
+                encode_header(stream->frame.data(), stream->id, FrameType::Data, bytes_transferred);
+                stream->frame_size = HEADER_SIZE + bytes_transferred;
+                stream->delay = session_->chargeBytes(false, bytes_transferred);
+                Outgoing outgoing;
+                outgoing.stream = stream;
+                outgoing.data = true;
+                enqueue(std::move(outgoing));
+            }));
+}
+
+void MuxSession::sendClose(std::uint32_t stream_id) {
+    Outgoing outgoing;
+    encode_header(outgoing.header.data(), stream_id, FrameType::Close, 0);
+    outgoing.data = false;
+    enqueue(std::move(outgoing));
+}
+
+void MuxSession::enqueue(Outgoing outgoing) {
+    outgoing_.push_back(std::move(outgoing));
+    if (!writing_) {
+        writeToClient();
+    }
+}
+
+void MuxSession::writeToClient() {
+    if (outgoing_.empty() || closed_) {
+        writing_ = false;
+        if (read_on_flush_ && !closed_) {
+            read_on_flush_ = false;
+            readHeader();
+        }
+        return;
+    }
+    writing_ = true;
+    // Elements of a deque don't move when others are added, the buffer stays valid
+    Outgoing& next = outgoing_.front();
+    auto buffer = next.data ? boost::asio::buffer(next.stream->frame.data(), next.stream->frame_size)
+                            : boost::asio::buffer(next.header);
+    auto self = shared_from_this();
+    session_->withClientStream([this, self, buffer](auto& client_stream) {
+        boost::asio::async_write(client_stream, buffer,
+            boost::asio::bind_executor(session_->getStrand(),
+                [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (closed_) {
+                        return;
+                    }
+                    if (ec) {
+                        if (ec != boost::asio::error::operation_aborted) {
+                            log_error("Mux write error: ", ec.message(),
+                                      LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                        }
+                        shutdown();
+                        return;
+                    }
+                    Outgoing done = std::move(outgoing_.front());
+                    outgoing_.pop_front();
+                    if (done.data) {
+                        // The stream can read again once its frame is out, and within its budget
+                        auto stream = done.stream;
+                        if (stream->delay > TunnelSession::Clock::duration::zero()) {
+                            stream->throttle_timer.expires_after(stream->delay);
+                            stream->throttle_timer.async_wait(boost::asio::bind_executor(session_->getStrand(),
+                                [this, self, stream](boost::system::error_code ec) {
+                                    if (!ec && !closed_) {
+                                        readInstance(stream);
+                                    }
+                                }));
+                        } else {
+                            readInstance(stream);
+                        }
+                    }
+                    writeToClient();
+                }));
+    });
+}
+
+void MuxSession::resumeAfterFlush() {
+    if (!writing_) {
+        readHeader();
+        return;
+    }
+    read_on_flush_ = true;
+}
+
+void MuxSession::release(std::shared_ptr<Stream> stream) {
+    if (!stream->client_closed || !stream->instance_closed) {
+        return;
+    }
+    auto it = streams_.find(stream->id);
+    if (it != streams_.end() && it->second == stream) {
+        streams_.erase(it);
+    }
+    boost::system::error_code ignored;
+    stream->socket.close(ignored);
+    stream->throttle_timer.cancel();
+}
+
+void MuxSession::replenishSpares() {
+    auto self = shared_from_this();
+    while (!closed_ && spares_.size() + connecting_spares_ < spare_connections_) {
+        ++connecting_spares_;
+        auto socket = std::make_shared<boost::asio::ip::tcp::socket>(session_->getIOContext());
+        boost::asio::async_connect(*socket, endpoints_,
+            boost::asio::bind_executor(session_->getStrand(),
+                [this, self, socket](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+                    --connecting_spares_;
+                    if (closed_) {
+                        return;
+                    }
+                    if (ec) {
+                        // Tried again when the next stream is opened
+                        log_error("Mux spare connection error: ", ec.message(),
+                                  LogField("session", session_->getId()), LogField("token", session_->getToken()));
+                        return;
+                    }
+                    spares_.push_back(std::move(*socket));
+                }));
+    }
+}
+
+void MuxSession::shutdown() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    boost::system::error_code ignored;
+    for (auto& entry : streams_) {
+        entry.second->socket.close(ignored);
+        entry.second->throttle_timer.cancel();
+    }
+    streams_.clear();
+    for (auto& spare : spares_) {
+        spare.close(ignored);
+    }
+    spares_.clear();
+    throttle_timer_.cancel();
+    session_->close();
+}
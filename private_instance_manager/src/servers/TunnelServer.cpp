@@ -1,7 +1,37 @@
 #include "servers/TunnelServer.hpp"
 #include <iostream>
+#include <sstream>
 #include <boost/asio.hpp>
+#include <ctime>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include "common/UUID.hpp"
+#include "utils/http.hpp"
+#include "common/Logger.hpp"
 
+// Time given to a client to send its token before the session is reaped
+static constexpr std::chrono::seconds TOKEN_TIMEOUT(30);
+// The shared token table is trusted while its heartbeat is younger than this, in seconds
+static constexpr std::int64_t TOKEN_TABLE_MAX_AGE = 30;
+// Delay between two attempts at opening the shared token table, in seconds
+static constexpr std::int64_t TOKEN_TABLE_RETRY = 1;
+// Time given to the new process to start serving during an upgrade
+static constexpr std::chrono::seconds UPGRADE_READY_TIMEOUT(30);
+// Length of a token in the first label of the Host of an HTTP request
+static constexpr std::size_t TOKEN_SIZE = 36;
+// Threads resolving the tokens through the API when the shared table doesn't have them
+static constexpr std::size_t LOOKUP_THREADS = 4;
+
+// Protocol of a socket handed over by another process
+static boost::asio::ip::tcp socket_protocol(int fd) {
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == 0 && address.ss_family == AF_INET6) {
+        return boost::asio::ip::tcp::v6();
+    }
+    return boost::asio::ip::tcp::v4();
+}
 
 static APIClient& get_thread_api_client(const std::string& api_endpoint, unsigned short api_port) {
     thread_local std::unique_ptr<APIClient> api_client = nullptr;
@@ -11,206 +41,737 @@ static APIClient& get_thread_api_client(const std::string& api_endpoint, unsigne
     return *api_client;
 }
 
-TunnelServer::TunnelServer(unsigned short port, std::string& api_address, unsigned short api_port, unsigned short num_threads)
-    : io_context_(),
-      acceptor_(io_context_, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-      resolver_(io_context_),
-      port_(port),
-      api_address_(api_address),
-      api_port_(api_port),
-      num_threads_(num_threads) {
-    if (num_threads_ == 0) {
-        num_threads_ = std::thread::hardware_concurrency();
-        if (num_threads_ == 0) {
-            num_threads_ = 1;
-        }
+TunnelServer::TunnelServer(const TunnelServerConfig& config)
+    : pool_(config.mode, config.num_threads, config.pin_threads),
+      acceptors_(pool_.createAcceptors(config.port, config.listen_fds)),
+      port_(config.port),
+      api_address_(config.api_address),
+      api_port_(config.api_port),
+      idle_timeout_(config.idle_timeout),
+      shaper_(config.session_rate, config.token_rate, config.global_rate),
+      stats_port_(config.stats_port),
+      token_table_name_(config.token_table_name),
+      token_table_retry_(0),
+      tls_(config.tls),
+      mux_max_streams_(config.mux_max_streams),
+      mux_spare_connections_(config.mux_spare_connections),
+      udp_port_(config.udp_port),
+      http_port_(config.http_port),
+      http_token_cookie_(config.http_token_cookie),
+      draining_(false),
+      next_pool_(0),
+      lookup_pool_(LOOKUP_THREADS) {
+    for (std::size_t i = 0; i < pool_.size(); ++i) {
+        wheels_.emplace_back(std::make_unique<TimerWheel>(pool_.getIOContext(i)));
+        session_pools_.emplace_back(std::make_shared<TunnelSessionPool>(pool_.getIOContext(i)));
+    }
+    if (config.stats_fd >= 0) {
+        stats_acceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(boost::asio::make_strand(pool_.getIOContext()));
+        stats_acceptor_->assign(boost::asio::ip::tcp::v4(), config.stats_fd);
+    } else if (stats_port_ != 0) {
+        stats_acceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(boost::asio::make_strand(pool_.getIOContext()),
+            boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), stats_port_));
+    }
+    if (udp_port_ != 0 || !config.udp_fds.empty()) {
+        udp_relay_ = std::make_shared<UdpRelay>(pool_, udp_port_,
+            [this](const std::string& token, std::function<void(UdpRelay::TokenInfo)> done) {
+                resolveTokenAsync(token, std::move(done));
+            }, shaper_, idle_timeout_, config.udp_fds);
+    }
+    if (http_port_ != 0 || !config.http_fds.empty()) {
+        http_acceptors_ = pool_.createAcceptors(http_port_, config.http_fds);
     }
 }
 
 void TunnelServer::start() {
-    std::cout << "Server started." << std::endl;
-    std::cout << "Using " << num_threads_ << " threads." << std::endl;
-    std::cout << "Waiting for incoming connections on port " << port_ << "." << std::endl;
-    doAccept();
+    log_info("Server started.");
+    log_info("Using ", pool_.getNumThreads(), " threads and ", acceptors_.size(), " acceptors.");
+    log_info("Idle timeout set to ", idle_timeout_.count(), " seconds.");
+    log_info("Waiting for incoming connections on port ", port_, ".");
+    if (tls_) {
+        log_info("Terminating TLS", tls_->ktls() ? ", with kernel TLS when available." : ".");
+    }
+    if (mux_max_streams_ > 0) {
+        log_info("Multiplexing up to ", mux_max_streams_, " streams per connection.");
+    }
+    if (!token_table_name_.empty()) {
+        log_info("Resolving tokens from the shared token table ", token_table_name_, ".");
+    }
+    if (stats_acceptor_) {
+        log_info("Serving usage statistics on port ", stats_port_, ".");
+        doAcceptStats();
+    }
+    if (udp_relay_) {
+        log_info("Relaying UDP on port ", udp_port_, " with ", udp_relay_->getNumWorkers(), " sockets",
+                 udp_relay_->hasGro() ? ", with GRO." : ".");
+        udp_relay_->start();
+    }
+    if (!http_acceptors_.empty()) {
+        log_info("Routing HTTP requests by Host or \"", http_token_cookie_, "\" cookie on port ", http_port_, ".");
+    }
+    for (auto& wheel : wheels_) {
+        wheel->start();
+    }
+    for (auto& acceptor : acceptors_) {
+        doAccept(*acceptor, false);
+    }
+    for (auto& acceptor : http_acceptors_) {
+        doAccept(*acceptor, true);
+    }
     // Start the thread pool
-    for (unsigned int i = 0; i < num_threads_; ++i) {
-        threads_.emplace_back([this]() {
-            io_context_.run();
-        });
-    }}
+    pool_.run();
+}
 
 void TunnelServer::stop() {
-    io_context_.stop();
-    for (auto& t : threads_) {
-        if (t.joinable()) {
-            t.join();
+    pool_.stop();
+    lookup_pool_.stop();
+}
+
+bool TunnelServer::upgrade(const std::string& binary, bool handoff_sessions, std::chrono::seconds drain_timeout) {
+    std::shared_ptr<Handoff> handoff = Handoff::spawn(binary);
+    if (!handoff) {
+        log_error("Upgrade failed: cannot start the new binary.");
+        return false;
+    }
+    // Both processes accept connections until this one stops
+    std::vector<int> fds;
+    std::string roles;
+    for (auto& acceptor : acceptors_) {
+        fds.push_back(acceptor->native_handle());
+        roles += "tunnel ";
+    }
+    for (auto& acceptor : http_acceptors_) {
+        fds.push_back(acceptor->native_handle());
+        roles += "http ";
+    }
+    if (stats_acceptor_) {
+        fds.push_back(stats_acceptor_->native_handle());
+        roles += "stats ";
+    }
+    if (udp_relay_) {
+        for (int fd : udp_relay_->getListenFds()) {
+            fds.push_back(fd);
+            roles += "udp ";
         }
     }
+    Handoff::Message message;
+    if (!handoff->send(Handoff::MessageType::Listeners, roles, fds)
+        || !handoff->receive(message, UPGRADE_READY_TIMEOUT) || message.type != Handoff::MessageType::Ready) {
+        log_error("Upgrade failed: the new process didn't start serving.");
+        handoff->terminate();
+        return false;
+    }
+    log_info("Process ", handoff->getPeer(), " took over the listening sockets, draining.");
+    draining_.store(true);
+    for (auto& acceptor : acceptors_) {
+        cancel_acceptor(*acceptor);
+    }
+    for (auto& acceptor : http_acceptors_) {
+        cancel_acceptor(*acceptor);
+    }
+    if (stats_acceptor_) {
+        cancel_acceptor(*stats_acceptor_);
+    }
+    // UDP flows are not handed over, their clients send their token again to the new process
+    if (udp_relay_) {
+        udp_relay_->stop();
+    }
+    auto deadline = std::chrono::steady_clock::now() + drain_timeout;
+    std::size_t active;
+    while ((active = getActiveCount()) > 0 && std::chrono::steady_clock::now() < deadline) {
+        // Sessions that were still authenticating start forwarding in the meantime, and are
+        // parked on the next round
+        if (handoff_sessions) {
+            for (auto& pool : session_pools_) {
+                for (auto& session : pool->getActiveSessions()) {
+                    handOff(session, handoff);
+                }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (active > 0) {
+        log_error("Drain timeout reached, closing ", active, " sessions.");
+    }
+    return true;
+}
+
+void TunnelServer::handOff(std::shared_ptr<TunnelSession> session, std::shared_ptr<Handoff> handoff) {
+    boost::asio::post(session->getStrand(), [session, handoff]() {
+        session->park([handoff](TunnelSession& session, const std::string& pending_up, const std::string& pending_down) {
+            // "<token> <milliseconds remaining> <pending up> <pending down>\n" and the pending bytes
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(session.getDeadline() - TunnelSession::Clock::now());
+            std::string state = session.getToken() + " " + std::to_string(remaining.count()) + " "
+                + std::to_string(pending_up.size()) + " " + std::to_string(pending_down.size()) + "\n"
+                + pending_up + pending_down;
+            if (!handoff->send(Handoff::MessageType::Session, state,
+                               {session.getClientSocket().native_handle(), session.getInstanceSocket().native_handle()})) {
+                log_error("Failed to hand over a tunnel session.");
+            }
+        });
+    });
 }
 
-void TunnelServer::doAccept() {
-    acceptor_.async_accept(
-        [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+void TunnelServer::adoptSession(const std::string& state, const std::vector<int>& fds) {
+    auto header_end = state.find('\n');
+    std::istringstream header(state.substr(0, header_end));
+    std::string token;
+    long long remaining;
+    std::size_t up_size, down_size;
+    header >> token >> remaining >> up_size >> down_size;
+    if (fds.size() != 2 || header.fail() || header_end == std::string::npos
+        || up_size > TunnelSession::BUFFER_SIZE || down_size > TunnelSession::BUFFER_SIZE
+        || state.size() != header_end + 1 + up_size + down_size) {
+        log_error("Invalid tunnel session handed over.");
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        return;
+    }
+    auto& session_pool = *session_pools_[next_pool_.fetch_add(1, std::memory_order_relaxed) % session_pools_.size()];
+    boost::system::error_code ec;
+    boost::asio::ip::tcp::socket client_socket(session_pool.getIOContext());
+    client_socket.assign(socket_protocol(fds[0]), fds[0], ec);
+    if (ec) {
+        log_error("Adopt tunnel session error: ", ec.message());
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return;
+    }
+    auto session = session_pool.acquire(std::move(client_socket));
+    session->getInstanceSocket().assign(socket_protocol(fds[1]), fds[1], ec);
+    if (ec) {
+        log_error("Adopt tunnel session error: ", ec.message());
+        ::close(fds[1]);
+        return;
+    }
+    auto deadline = TunnelSession::Clock::now() + std::chrono::milliseconds(remaining);
+    session->setDeadline(deadline);
+    session->setShaper(shaper_, token, deadline);
+    watchSession(session);
+    auto pending_up = state.substr(header_end + 1, up_size);
+    auto pending_down = state.substr(header_end + 1 + up_size, down_size);
+    boost::asio::post(session->getStrand(), [session, pending_up, pending_down]() {
+        session->resumeForwarding(pending_up, pending_down);
+    });
+}
+
+std::size_t TunnelServer::getActiveCount() {
+    std::size_t active = 0;
+    for (auto& pool : session_pools_) {
+        active += pool->getActiveCount();
+    }
+    return active;
+}
+
+std::optional<TokenUsageSnapshot> TunnelServer::getTokenUsage(const std::string& token) {
+    return shaper_.getUsage(token);
+}
+
+void TunnelServer::doAcceptStats() {
+    auto self = shared_from_this();
+    stats_acceptor_->async_accept(
+        [this, self](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (!ec) {
+                handleStatsRequest(std::move(socket));
+            } else if (!draining_.load()) {
+                log_error("Stats accept error: ", ec.message());
+            }
+            if (!draining_.load()) {
+                doAcceptStats();
+            }
+        });
+}
+
+void TunnelServer::handleStatsRequest(boost::asio::ip::tcp::socket socket) {
+    auto self = shared_from_this();
+    auto socket_ptr = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+    auto buffer_ptr = std::make_shared<boost::asio::streambuf>();
+    boost::asio::async_read_until(*socket_ptr, *buffer_ptr, '\n',
+        [this, self, buffer_ptr, socket_ptr](boost::system::error_code ec, std::size_t /*length*/) {
+            if (ec) {
+                log_error("Stats read error: ", ec.message());
+                socket_ptr->close();
+                return;
+            }
+            std::istream stream(buffer_ptr.get());
+            std::string command;
+            std::getline(stream, command);
+            auto response = std::make_shared<std::string>(processStatsCommand(command));
+            boost::asio::async_write(*socket_ptr, boost::asio::buffer(*response),
+                [socket_ptr, response](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (ec) {
+                        log_error("Stats write error: ", ec.message());
+                    }
+                    socket_ptr->close();
+                });
+        });
+}
+
+std::string TunnelServer::processStatsCommand(const std::string& command) {
+    std::stringstream ss(command);
+    std::string action, token;
+    ss >> action;
+    if (ss.fail() || action != "STATS") {
+        return "400 Invalid command\n";
+    }
+    TokenUsageSnapshot usage;
+    ss >> token;
+    if (ss.fail()) {
+        // No token, sum of all the tokens
+        usage = shaper_.getTotalUsage();
+    } else {
+        auto result = shaper_.getUsage(token);
+        if (!result) {
+            return "404 Token not found\n";
+        }
+        usage = *result;
+    }
+    // Returning "200 BytesUp: <bytes> - BytesDown: <bytes> - Sessions: <count> - Rate: <bytes/s>\n"
+    std::ostringstream response;
+    response << "200 BytesUp: " << usage.bytes_up
+             << " - BytesDown: " << usage.bytes_down
+             << " - Sessions: " << usage.sessions
+             << " - Rate: " << usage.rate << "\n";
+    return response.str();
+}
+
+void TunnelServer::doAccept(boost::asio::ip::tcp::acceptor& acceptor, bool http) {
+    acceptor.async_accept(
+        [this, &acceptor, http](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
             if (!ec) {
                 // Handle the client connection
-                handleClient(std::move(socket));
-            } else {
-                std::cerr << "Accept error: " << ec.message() << std::endl;
+                handleClient(std::move(socket), http);
+            } else if (!draining_.load()) {
+                log_error("Accept error: ", ec.message());
                 socket.close();
             }
+            // Once the new process took over, the connections are left in the backlog for it
+            if (draining_.load()) {
+                return;
+            }
             // Continue accepting new connections
-            doAccept();
+            doAccept(acceptor, http);
         });
 }
 
-void TunnelServer::handleClient(boost::asio::ip::tcp::socket socket) {
-    // Creating a new shared pointer for the socket
-    auto client_socket = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
-    // Creating a new strand for this connection (Is this correct?)
-    auto strand = std::make_shared<boost::asio::strand<boost::asio::io_context::executor_type>>(boost::asio::make_strand(io_context_));
-    doReadToken(client_socket, strand);
+void TunnelServer::handleClient(boost::asio::ip::tcp::socket socket, bool http) {
+    // Taking a session from the pool of the io_context that accepted the connection,
+    // it owns the sockets, the strand and the buffers
+    std::size_t index = 0;
+    for (std::size_t i = 0; i < session_pools_.size(); ++i) {
+        if (&session_pools_[i]->getIOContext() == &socket.get_executor().context()) {
+            index = i;
+            break;
+        }
+    }
+    auto session = session_pools_[index]->acquire(std::move(socket));
+    // Until the token is validated the session only lives for TOKEN_TIMEOUT
+    session->setDeadline(TunnelSession::Clock::now() + TOKEN_TIMEOUT);
+    watchSession(session);
+    if (tls_) {
+        doHandshake(session, http);
+    } else if (http) {
+        doReadHttpRequest(session, 0);
+    } else {
+        doReadToken(session);
+    }
 }
 
-void TunnelServer::doReadToken(std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand) {
+void TunnelServer::doHandshake(std::shared_ptr<TunnelSession> session, bool http) {
+    if (!session->startTls(*tls_)) {
+        log_error("TLS setup error.",
+                  LogField("session", session->getId()), LogField("stage", "handshake"));
+        session->close();
+        return;
+    }
     auto self(shared_from_this());
-        
-    boost::asio::async_write(*client_socket, boost::asio::buffer("Token: "),
-        boost::asio::bind_executor(*strand,
-            [this, self, client_socket, strand](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    auto token_buffer = std::make_shared<boost::asio::streambuf>();
-                    boost::asio::async_read_until(*client_socket, *token_buffer, '\n',
-                        boost::asio::bind_executor(*strand,
-                            [this, self, token_buffer, client_socket, strand](boost::system::error_code ec, std::size_t /*length*/) {
-                                if (!ec) {
-                                    std::istream is(token_buffer.get());
-                                    std::string token;
-                                    std::getline(is, token);
-                                    doResolveInstance(token, client_socket, strand);
-                                } else {
-                                    std::cerr << "Read token error: " << ec.message() << std::endl;
-                                    client_socket->close();
-                                }
-                            }));
-                } else {
-                    std::cerr << "Write token prompt error: " << ec.message() << std::endl;
-                    client_socket->close();
+    session->getTlsStream().async_handshake(boost::asio::bind_executor(session->getStrand(),
+        [this, self, session, http](boost::system::error_code ec) {
+            if (!ec && http) {
+                doReadHttpRequest(session, 0);
+            } else if (!ec) {
+                doReadToken(session);
+            } else {
+                log_error("TLS handshake error: ", ec.message(),
+                          LogField("session", session->getId()), LogField("stage", "handshake"));
+                session->close();
+            }
+        }));
+}
+
+void TunnelServer::watchSession(std::shared_ptr<TunnelSession> session) {
+    TimerWheel* wheel = wheels_.front().get();
+    for (std::size_t i = 0; i < wheels_.size(); ++i) {
+        if (&pool_.getIOContext(i) == &session->getIOContext()) {
+            wheel = wheels_[i].get();
+            break;
+        }
+    }
+    auto idle_timeout = idle_timeout_;
+    auto when = session->nextExpiry(TunnelSession::Clock::now(), idle_timeout).value_or(TunnelSession::Clock::now());
+    session->setNextCheck(when);
+    std::weak_ptr<TunnelSession> weak_session = session;
+    // The wheel only holds a weak reference, sessions closed by their peers just drop out. An entry
+    // follows the later deadlines of its session, and drops out once an earlier one replaced it
+    wheel->schedule(when, [this, weak_session, idle_timeout, when]() mutable -> std::optional<TimerWheel::Clock::time_point> {
+        auto session = weak_session.lock();
+        if (!session || session->isClosed()) {
+            return std::nullopt;
+        }
+        auto next = session->nextExpiry(TunnelSession::Clock::now(), idle_timeout);
+        if (!session->advanceCheck(when, next.value_or(TunnelSession::Clock::time_point::max()))) {
+            return std::nullopt;
+        }
+        if (next) {
+            when = *next;
+        } else {
+            // Sockets can only be closed from the strand running the session handlers
+            boost::asio::post(session->getStrand(), [this, session]() {
+                if (session->isClosed()) {
+                    return;
+                }
+                if (session->getToken().empty() || session->getDeadline() > TunnelSession::Clock::now()) {
+                    expireSession(session);
+                    return;
                 }
+                // The token may have been extended since the session was opened, the session then
+                // lives until its new expiry. The API is never waited for on the io thread
+                resolveTokenAsync(session->getToken(), [this, session](auto result) {
+                    boost::asio::post(session->getStrand(), [this, session, result]() {
+                        if (session->isClosed()) {
+                            return;
+                        }
+                        if (result && std::get<0>(*result) != 0 && std::get<1>(*result) > 0) {
+                            session->setDeadline(TunnelSession::Clock::now() + std::chrono::seconds(std::get<1>(*result)));
+                        }
+                        expireSession(session);
+                    });
+                });
+            });
+        }
+        return next;
+    });
+}
+
+void TunnelServer::expireSession(std::shared_ptr<TunnelSession> session) {
+    auto next = session->nextExpiry(TunnelSession::Clock::now(), idle_timeout_);
+    if (next) {
+        if (*next < session->getNextCheck()) {
+            watchSession(session);
+        }
+        return;
+    }
+    log_error("Closing tunnel session: token expired or idle timeout reached.",
+              LogField("session", session->getId()), LogField("token", session->getToken()), LogField("stage", "expiry"));
+    session->close();
+}
+
+void TunnelServer::doReadToken(std::shared_ptr<TunnelSession> session) {
+    auto self(shared_from_this());
+    session->withClientStream([this, self, session](auto& client_stream) {
+        boost::asio::async_write(client_stream, boost::asio::buffer("Token: "),
+            boost::asio::bind_executor(session->getStrand(),
+                [this, self, session, &client_stream](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (!ec) {
+                        boost::asio::async_read_until(client_stream, session->getTokenBuffer(), '\n',
+                            boost::asio::bind_executor(session->getStrand(),
+                                [this, self, session](boost::system::error_code ec, std::size_t /*length*/) {
+                                    if (!ec) {
+                                        std::istream is(&session->getTokenBuffer());
+                                        std::string token;
+                                        std::getline(is, token);
+                                        bool mux = mux_max_streams_ > 0 && token.rfind("MUX ", 0) == 0;
+                                        doResolveInstance(mux ? token.substr(4) : token, session, mux);
+                                    } else {
+                                        log_error("Read token error: ", ec.message(),
+                                                  LogField("session", session->getId()), LogField("stage", "token"));
+                                        session->close();
+                                    }
+                                }));
+                    } else {
+                        log_error("Write token prompt error: ", ec.message(),
+                                  LogField("session", session->getId()), LogField("stage", "token"));
+                        session->close();
+                    }
+                }));
+    });
+}
+
+void TunnelServer::doReadHttpRequest(std::shared_ptr<TunnelSession> session, std::size_t filled) {
+    auto self(shared_from_this());
+    auto& buffer = session->getUpstreamBuffer();
+    session->withClientStream([&](auto& client_stream) {
+        client_stream.async_read_some(boost::asio::buffer(buffer.data() + filled, buffer.size() - filled),
+            boost::asio::bind_executor(session->getStrand(),
+                [this, self, session, filled](boost::system::error_code ec, std::size_t length) {
+                    if (ec) {
+                        if (ec != boost::asio::error::eof) {
+                            log_error("Read request error: ", ec.message(),
+                                      LogField("session", session->getId()), LogField("stage", "http"));
+                        }
+                        session->close();
+                        return;
+                    }
+                    std::size_t size = filled + length;
+                    HttpRequestHead head;
+                    auto result = parse_http_request(std::string_view(session->getUpstreamBuffer().data(), size), head);
+                    if (result == HttpParseResult::Incomplete && size < TunnelSession::BUFFER_SIZE) {
+                        doReadHttpRequest(session, size);
+                        return;
+                    }
+                    if (result == HttpParseResult::Incomplete) {
+                        sendHttpError(session, 431, "Request Header Fields Too Large", "Request head too large.\n");
+                        return;
+                    }
+                    if (result == HttpParseResult::Invalid) {
+                        sendHttpError(session, 400, "Bad Request", "Invalid request!\n");
+                        return;
+                    }
+                    // "<token>.chall.example", or any host with the token in a cookie
+                    std::string_view host = http_host_name(head.host);
+                    std::string_view token = host.substr(0, host.find('.'));
+                    if (token.size() != TOKEN_SIZE) {
+                        token = http_cookie(head.cookie, http_token_cookie_);
+                    }
+                    if (token.empty()) {
+                        sendHttpError(session, 400, "Bad Request", "No token in the host or the cookies.\n");
+                        return;
+                    }
+                    // The whole buffer goes to the instance, along with the body or the next
+                    // requests that came with the head
+                    doRouteHttpRequest(std::string(token), session, size);
+                }));
+    });
+}
+
+void TunnelServer::doRouteHttpRequest(const std::string& token, std::shared_ptr<TunnelSession> session, std::size_t buffered) {
+    auto result = resolveToken(token);
+    if (!result) {
+        sendHttpError(session, 404, "Not Found", "Invalid Token!\n");
+        return;
+    }
+    unsigned short port = std::get<0>(*result);
+    long time_remaining = std::get<1>(*result);
+    auto address = std::make_shared<std::string>(std::get<2>(*result));
+    if (port == 0) {
+        sendHttpError(session, 502, "Bad Gateway", "Invalid request!\n");
+        return;
+    }
+    if (time_remaining <= 0) {
+        sendHttpError(session, 410, "Gone", "Token has expired!\n");
+        return;
+    }
+    // The session cannot outlive the token it was opened with
+    auto deadline = TunnelSession::Clock::now() + std::chrono::seconds(time_remaining);
+    session->setDeadline(deadline);
+    session->setShaper(shaper_, token, deadline);
+    // The session is watched since it was accepted, its check only comes too late for an earlier deadline
+    if (deadline < session->getNextCheck()) {
+        watchSession(session);
+    }
+    // The connection is spliced to the instance, the following requests of the connection go
+    // through unparsed
+    auto self(shared_from_this());
+    session->getResolver().async_resolve(*address, std::to_string(port),
+        boost::asio::bind_executor(session->getStrand(),
+            [this, self, session, address, buffered](boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+                if (ec) {
+                    log_error("Resolve instance error: ", ec.message(),
+                              LogField("session", session->getId()), LogField("token", session->getToken()), LogField("stage", "connect"));
+                    sendHttpError(session, 502, "Bad Gateway", "Cannot reach the instance.\n");
+                    return;
+                }
+                boost::asio::async_connect(session->getInstanceSocket(), endpoints,
+                    boost::asio::bind_executor(session->getStrand(),
+                        [this, self, session, buffered](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+                            if (!ec) {
+                                session->startForwarding(buffered);
+                            } else {
+                                log_error("Connect to instance error: ", ec.message(),
+                                          LogField("session", session->getId()), LogField("token", session->getToken()), LogField("stage", "connect"));
+                                sendHttpError(session, 502, "Bad Gateway", "Cannot reach the instance.\n");
+                            }
+                        }));
             }));
 }
 
+void TunnelServer::sendHttpError(std::shared_ptr<TunnelSession> session, int status, const std::string& reason, const std::string& body) {
+    auto response = std::make_shared<std::string>(http_error_response(status, reason, body));
+    session->withClientStream([&](auto& client_stream) {
+        boost::asio::async_write(client_stream, boost::asio::buffer(*response),
+            boost::asio::bind_executor(session->getStrand(),
+                [session, response](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (ec) {
+                        log_error("[Write error] HTTP error response: ", ec.message(),
+                                  LogField("session", session->getId()), LogField("stage", "http"));
+                    }
+                    session->close();
+                }));
+    });
+}
+
+std::optional<std::tuple<unsigned short, long, std::string>> TunnelServer::resolveToken(const std::string& token) {
+    auto result = lookupSharedTable(token);
+    if (result) {
+        return result;
+    }
+    APIClient& client = get_thread_api_client(api_address_, api_port_);
+    return client.apiGetInfo(token);
+}
 
+void TunnelServer::resolveTokenAsync(const std::string& token,
+    std::function<void(std::optional<std::tuple<unsigned short, long, std::string>>)> done) {
+    auto result = lookupSharedTable(token);
+    if (result) {
+        done(result);
+        return;
+    }
+    boost::asio::post(lookup_pool_, [this, token, done]() {
+        APIClient& client = get_thread_api_client(api_address_, api_port_);
+        done(client.apiGetInfo(token));
+    });
+}
 
-void TunnelServer::doResolveInstance(const std::string& token, std::shared_ptr<boost::asio::ip::tcp::socket> client_socket, 
-                                     std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand) {
+std::optional<std::tuple<unsigned short, long, std::string>> TunnelServer::lookupSharedTable(const std::string& token) {
+    if (token_table_name_.empty()) {
+        return std::nullopt;
+    }
+    std::int64_t now = static_cast<std::int64_t>(std::time(nullptr));
+    std::shared_ptr<const SharedTokenTable> table = std::atomic_load(&token_table_);
+    if (!table || !table->isAlive(TOKEN_TABLE_MAX_AGE)) {
+        // The API server is not started yet or was restarted with a new segment, one thread
+        // at a time tries to map it again while the others ask the API
+        std::int64_t retry = token_table_retry_.load(std::memory_order_relaxed);
+        if (now < retry || !token_table_retry_.compare_exchange_strong(retry, now + TOKEN_TABLE_RETRY)) {
+            return std::nullopt;
+        }
+        table = SharedTokenTable::open(token_table_name_);
+        std::atomic_store(&token_table_, table);
+        if (!table || !table->isAlive(TOKEN_TABLE_MAX_AGE)) {
+            return std::nullopt;
+        }
+    }
+    boost::uuids::uuid uuid;
+    try {
+        uuid = UUID(token).getUUID();
+    } catch (const std::invalid_argument& e) {
+        return std::nullopt;
+    }
+    auto entry = table->lookup(uuid);
+    // Unknown and expired tokens are left to the API, which knows how to answer them
+    if (!entry || entry->expires_at <= now) {
+        return std::nullopt;
+    }
+    return std::make_tuple(entry->port, static_cast<long>(entry->expires_at - now), entry->address);
+}
+
+void TunnelServer::doResolveInstance(const std::string& token, std::shared_ptr<TunnelSession> session, bool mux) {
     // Retrieve the instance port using the token
     unsigned long port;
     long time_remaining;
     std::shared_ptr<std::string> address;
 
     auto self(shared_from_this());
-    APIClient& client = get_thread_api_client(api_address_, api_port_);
-    auto result = client.apiGetInfo(token);
+    auto& strand = session->getStrand();
+    auto result = resolveToken(token);
     if (result)
     {
         port = std::get<0>(*result);
         time_remaining = std::get<1>(*result);
         address = std::make_shared<std::string>(std::get<2>(*result));
         if (port == 0) {
-            boost::asio::async_write(*client_socket, boost::asio::buffer("Invalid Token!\n"),
-                boost::asio::bind_executor(*strand,
-                    [this, self, client_socket](boost::system::error_code ec, std::size_t /*length*/) {
-                        if (ec) {
-                            std::cerr << "[Write error] \"Invalid Token!\": " << ec.message() << std::endl;
-                            client_socket->close();
-                        }
-                    }));
+            session->withClientStream([&](auto& client_stream) {
+                boost::asio::async_write(client_stream, boost::asio::buffer("Invalid Token!\n"),
+                    boost::asio::bind_executor(strand,
+                        [this, self, session](boost::system::error_code ec, std::size_t /*length*/) {
+                            if (ec) {
+                                log_error("[Write error] \"Invalid Token!\": ", ec.message(),
+                                          LogField("session", session->getId()), LogField("stage", "resolve"));
+                                session->close();
+                            }
+                        }));
+            });
             return;
         }
         if (time_remaining <= 0) {
-            boost::asio::async_write(*client_socket, boost::asio::buffer("Token has expired!\n"),
-                boost::asio::bind_executor(*strand,
-                    [this, self, client_socket](boost::system::error_code ec, std::size_t /*length*/) {
-                        if (ec) {
-                            std::cerr << "[Write error] \"Token has expired!\": " << ec.message() << std::endl;
-                            client_socket->close();
-                        }
-                    }));
+            session->withClientStream([&](auto& client_stream) {
+                boost::asio::async_write(client_stream, boost::asio::buffer("Token has expired!\n"),
+                    boost::asio::bind_executor(strand,
+                        [this, self, session](boost::system::error_code ec, std::size_t /*length*/) {
+                            if (ec) {
+                                log_error("[Write error] \"Token has expired!\": ", ec.message(),
+                                          LogField("session", session->getId()), LogField("stage", "resolve"));
+                                session->close();
+                            }
+                        }));
+            });
             return;
         }
+        // The session cannot outlive the token it was opened with
+        auto deadline = TunnelSession::Clock::now() + std::chrono::seconds(time_remaining);
+        session->setDeadline(deadline);
+        session->setShaper(shaper_, token, deadline);
+        // The session is watched since it was accepted, its check only comes too late for an earlier deadline
+        if (deadline < session->getNextCheck()) {
+            watchSession(session);
+        }
     }
     else
     {
-        boost::asio::async_write(*client_socket, boost::asio::buffer("Invalid request!\n"),
-            boost::asio::bind_executor(*strand,
-                [this, self, client_socket](boost::system::error_code ec, std::size_t /*length*/) {
-                    if (ec) {
-                        std::cerr << "[Write error] \"Invalid request!\": " << ec.message() << std::endl;
-                        client_socket->close();
-                    }
-                }));
+        session->withClientStream([&](auto& client_stream) {
+            boost::asio::async_write(client_stream, boost::asio::buffer("Invalid request!\n"),
+                boost::asio::bind_executor(strand,
+                    [this, self, session](boost::system::error_code ec, std::size_t /*length*/) {
+                        if (ec) {
+                            log_error("[Write error] \"Invalid request!\": ", ec.message(),
+                                      LogField("session", session->getId()), LogField("stage", "resolve"));
+                            session->close();
+                        }
+                    }));
+        });
         return;
     }
-    boost::asio::async_write(*client_socket, boost::asio::buffer("Token is correct. Connecting to private instance...\n"),
-        boost::asio::bind_executor(*strand,
-            [this, self, address, port, client_socket, strand](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    // Resolve and connect to the instance
-                    resolver_.async_resolve(*address, std::to_string(port),
-                        boost::asio::bind_executor(*strand,
-                            [this, self, client_socket, address, strand](boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
-                                if (!ec) {
-                                    auto instance_socket = std::make_shared<boost::asio::ip::tcp::socket>(io_context_);
-                                    boost::asio::async_connect(*instance_socket, endpoints,
-                                        boost::asio::bind_executor(*strand,
-                                            [this, self, client_socket, instance_socket, strand](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
-                                                if (!ec) {
-                                                    // Start forwarding data
-                                                    startForwarding(client_socket, instance_socket, strand);
-                                                    startForwarding(instance_socket, client_socket, strand);
-                                                } else {
-                                                    std::cerr << "Connect to instance error: " << ec.message() << std::endl;
-                                                    client_socket->close();
-                                                    instance_socket->close();
-                                                }
-                                            }));
-                                } else {
-                                    std::cerr << "Resolve instance error: " << ec.message() << std::endl;
-                                    client_socket->close();
-                                }
-                            }));
-                } else {
-                    std::cerr << "Write confirmation error: " << ec.message() << std::endl;
-                    client_socket->close();
-                }
-            }));
-}
-
-void TunnelServer::startForwarding(std::shared_ptr<boost::asio::ip::tcp::socket> from_socket,
-                                   std::shared_ptr<boost::asio::ip::tcp::socket> to_socket, 
-                                   std::shared_ptr<boost::asio::strand<boost::asio::io_context::executor_type>> strand) {
-    auto buffer = std::make_shared<std::vector<char>>(8192);
-    auto self(shared_from_this());
-    from_socket->async_read_some(boost::asio::buffer(*buffer),
-        boost::asio::bind_executor(*strand,
-            [this, self, buffer, from_socket, to_socket, strand](boost::system::error_code ec, std::size_t bytes_transferred) {
-                if (!ec && bytes_transferred > 0) {
-                    boost::asio::async_write(*to_socket, boost::asio::buffer(*buffer, bytes_transferred),
-                        boost::asio::bind_executor(*strand,
-                            [this, self, buffer, from_socket, to_socket, strand](boost::system::error_code write_ec, std::size_t /*bytes_written*/) {
-                                if (!write_ec) {
-                                    startForwarding(from_socket, to_socket, strand);
-                                } else {
-                                    std::cerr << "Write error: " << write_ec.message() << std::endl;
-                                    from_socket->close();
-                                    to_socket->close();
-                                }
-                            }));
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    std::cerr << "Read error: " << ec.message() << std::endl;
-                    from_socket->close();
-                    to_socket->close();
-                }
-            }));
+    // Frames follow right after the line confirming a multiplexed session
+    static const char MUX_CONFIRMATION[] = "Token is correct. Multiplexing streams to private instance...\n";
+    auto confirmation = mux ? boost::asio::buffer(MUX_CONFIRMATION, sizeof(MUX_CONFIRMATION) - 1)
+                            : boost::asio::buffer("Token is correct. Connecting to private instance...\n");
+    session->withClientStream([&](auto& client_stream) {
+        boost::asio::async_write(client_stream, confirmation,
+            boost::asio::bind_executor(strand,
+                [this, self, address, port, session, mux](boost::system::error_code ec, std::size_t /*length*/) {
+                    if (!ec) {
+                        // Resolve and connect to the instance using the io_context of the session
+                        session->getResolver().async_resolve(*address, std::to_string(port),
+                            boost::asio::bind_executor(session->getStrand(),
+                                [this, self, session, address, mux](boost::system::error_code ec, boost::asio::ip::tcp::resolver::results_type endpoints) {
+                                    if (!ec && mux) {
+                                        // Every stream connects to the instance on its own
+                                        std::make_shared<MuxSession>(session, endpoints, mux_max_streams_, mux_spare_connections_)->start();
+                                    } else if (!ec) {
+                                        boost::asio::async_connect(session->getInstanceSocket(), endpoints,
+                                            boost::asio::bind_executor(session->getStrand(),
+                                                [this, self, session](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint& /*endpoint*/) {
+                                                    if (!ec) {
+                                                        // Start forwarding data
+                                                        session->startForwarding();
+                                                    } else {
+                                                        log_error("Connect to instance error: ", ec.message(),
+                                                                  LogField("session", session->getId()), LogField("token", session->getToken()), LogField("stage", "connect"));
+                                                        session->close();
+                                                    }
+                                                }));
+                                    } else {
+                                        log_error("Resolve instance error: ", ec.message(),
+                                                  LogField("session", session->getId()), LogField("token", session->getToken()), LogField("stage", "connect"));
+                                        session->close();
+                                    }
+                                }));
+                    } else {
+                        log_error("Write confirmation error: ", ec.message(),
+                                  LogField("session", session->getId()), LogField("stage", "resolve"));
+                        session->close();
+                    }
+                }));
+    });
 }
-
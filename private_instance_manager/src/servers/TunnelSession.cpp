@@ -0,0 +1,468 @@
+#include "servers/TunnelSession.hpp"
+#include "common/Logger.hpp"
+
+// Numbers of the connections served by the sessions
+static std::atomic<std::uint64_t> next_session_id(0);
+
+// Allocator of the shared_ptr control blocks of the sessions, backed by their pool
+template <typename T>
+class ControlBlockAllocator {
+public:
+    using value_type = T;
+
+    explicit ControlBlockAllocator(std::shared_ptr<TunnelSessionPool> pool) : pool_(std::move(pool)) {}
+    template <typename U>
+    ControlBlockAllocator(const ControlBlockAllocator<U>& other) noexcept : pool_(other.pool_) {}
+
+    T* allocate(std::size_t n) const {
+        return static_cast<T*>(pool_->allocateBlock(sizeof(T) * n));
+    }
+
+    void deallocate(T* pointer, std::size_t n) const {
+        pool_->deallocateBlock(pointer, sizeof(T) * n);
+    }
+
+    template <typename U>
+    bool operator==(const ControlBlockAllocator<U>& other) const noexcept {
+        return pool_ == other.pool_;
+    }
+
+    template <typename U>
+    bool operator!=(const ControlBlockAllocator<U>& other) const noexcept {
+        return pool_ != other.pool_;
+    }
+
+private:
+    template <typename> friend class ControlBlockAllocator;
+    std::shared_ptr<TunnelSessionPool> pool_;
+};
+
+TunnelSession::TunnelSession(boost::asio::io_context& io_context)
+    : strand_(boost::asio::make_strand(io_context)),
+      id_(0),
+      client_socket_(io_context),
+      instance_socket_(io_context),
+      tls_stream_(client_socket_),
+      tls_(false),
+      resolver_(io_context),
+      deadline_(Clock::time_point::max().time_since_epoch().count()),
+      last_activity_(Clock::now().time_since_epoch().count()),
+      next_check_(Clock::time_point::max().time_since_epoch().count()),
+      closed_(false),
+      shaper_(nullptr),
+      up_(strand_),
+      down_(strand_),
+      bytes_up_(0),
+      bytes_down_(0),
+      forwarding_(false),
+      pool_index_(0) {}
+
+TunnelSession::~TunnelSession() {
+    releaseShaper();
+}
+
+void TunnelSession::reset(boost::asio::ip::tcp::socket socket) {
+    id_ = next_session_id.fetch_add(1, std::memory_order_relaxed) + 1;
+    tls_stream_.clear();
+    tls_ = false;
+    client_socket_ = std::move(socket);
+    token_buffer_.consume(token_buffer_.size());
+    deadline_.store(Clock::time_point::max().time_since_epoch().count(), std::memory_order_relaxed);
+    last_activity_.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    next_check_.store(Clock::time_point::max().time_since_epoch().count(), std::memory_order_relaxed);
+    closed_.store(false, std::memory_order_relaxed);
+    bytes_up_ = 0;
+    bytes_down_ = 0;
+    forwarding_ = false;
+    park_handler_ = nullptr;
+}
+
+std::uint64_t TunnelSession::getId() const {
+    return id_;
+}
+
+boost::asio::ip::tcp::socket& TunnelSession::getClientSocket() {
+    return client_socket_;
+}
+
+boost::asio::ip::tcp::socket& TunnelSession::getInstanceSocket() {
+    return instance_socket_;
+}
+
+TunnelSession::Strand& TunnelSession::getStrand() {
+    return strand_;
+}
+
+boost::asio::io_context& TunnelSession::getIOContext() const {
+    return strand_.get_inner_executor().context();
+}
+
+boost::asio::streambuf& TunnelSession::getTokenBuffer() {
+    return token_buffer_;
+}
+
+boost::asio::ip::tcp::resolver& TunnelSession::getResolver() {
+    return resolver_;
+}
+
+bool TunnelSession::startTls(TlsContext& context) {
+    tls_ = tls_stream_.reset(context);
+    return tls_;
+}
+
+bool TunnelSession::isTls() const {
+    return tls_;
+}
+
+TlsStream& TunnelSession::getTlsStream() {
+    return tls_stream_;
+}
+
+void TunnelSession::setDeadline(Clock::time_point deadline) {
+    deadline_.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+void TunnelSession::touch() {
+    last_activity_.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+std::optional<TunnelSession::Clock::time_point> TunnelSession::nextExpiry(Clock::time_point now, Clock::duration idle_timeout) const {
+    Clock::time_point next(Clock::duration(deadline_.load(std::memory_order_relaxed)));
+    if (idle_timeout > Clock::duration::zero()) {
+        Clock::time_point last_activity(Clock::duration(last_activity_.load(std::memory_order_relaxed)));
+        next = std::min(next, last_activity + idle_timeout);
+    }
+    if (next <= now) {
+        return std::nullopt;
+    }
+    return next;
+}
+
+void TunnelSession::setNextCheck(Clock::time_point when) {
+    next_check_.store(when.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+TunnelSession::Clock::time_point TunnelSession::getNextCheck() const {
+    return Clock::time_point(Clock::duration(next_check_.load(std::memory_order_relaxed)));
+}
+
+bool TunnelSession::advanceCheck(Clock::time_point from, Clock::time_point to) {
+    Clock::rep expected = from.time_since_epoch().count();
+    return next_check_.compare_exchange_strong(expected, to.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+void TunnelSession::close() {
+    boost::system::error_code ec;
+    closed_.store(true, std::memory_order_relaxed);
+    if (tls_) {
+        tls_stream_.shutdown();
+    }
+    client_socket_.close(ec);
+    instance_socket_.close(ec);
+    up_.throttle_timer.cancel();
+    down_.throttle_timer.cancel();
+    // A session closed while being parked is not handed over
+    park_handler_ = nullptr;
+}
+
+bool TunnelSession::isClosed() const {
+    return closed_.load(std::memory_order_relaxed);
+}
+
+void TunnelSession::setShaper(TrafficShaper& shaper, const std::string& token, Clock::time_point deadline) {
+    releaseShaper();
+    shaper_ = &shaper;
+    token_ = token;
+    bucket_.setRate(shaper.getSessionRate(), shaper.getBurst());
+    usage_ = shaper.acquire(token, deadline);
+}
+
+void TunnelSession::releaseShaper() {
+    if (shaper_) {
+        shaper_->release(token_);
+        shaper_ = nullptr;
+    }
+    usage_.reset();
+}
+
+TunnelSession::Clock::duration TunnelSession::chargeBytes(bool upstream, std::size_t bytes) {
+    if (upstream) {
+        bytes_up_ += bytes;
+    } else {
+        bytes_down_ += bytes;
+    }
+    if (!usage_) {
+        return Clock::duration::zero();
+    }
+    (upstream ? usage_->bytes_up : usage_->bytes_down).fetch_add(bytes, std::memory_order_relaxed);
+    // Both directions share the session and the token budgets
+    Clock::time_point now = Clock::now();
+    return std::max(bucket_.charge(bytes, now), usage_->bucket.charge(bytes, now));
+}
+
+std::array<char, TunnelSession::BUFFER_SIZE>& TunnelSession::getUpstreamBuffer() {
+    return up_.buffer;
+}
+
+void TunnelSession::startForwarding(std::size_t buffered_up) {
+    forwarding_ = true;
+    touch();
+    if (buffered_up > 0) {
+        // Already read from the client, it goes out as is
+        write(instance_socket_, true, std::min(buffered_up, BUFFER_SIZE), chargeBytes(true, buffered_up));
+    } else {
+        forward(true);
+    }
+    forward(false);
+}
+
+bool TunnelSession::park(ParkHandler handler) {
+    if (!forwarding_ || tls_ || park_handler_ || isClosed()) {
+        return false;
+    }
+    park_handler_ = std::move(handler);
+    up_.parked = false;
+    down_.parked = false;
+    // Every direction has exactly one operation pending, its handler parks the direction
+    boost::system::error_code ignored;
+    client_socket_.cancel(ignored);
+    instance_socket_.cancel(ignored);
+    up_.throttle_timer.cancel();
+    down_.throttle_timer.cancel();
+    return true;
+}
+
+void TunnelSession::parkDirection(bool upstream, std::size_t pending_offset, std::size_t pending_size) {
+    Direction& direction = upstream ? up_ : down_;
+    direction.parked = true;
+    direction.pending_offset = pending_offset;
+    direction.pending_size = pending_size;
+    if (!up_.parked || !down_.parked) {
+        return;
+    }
+    ParkHandler handler = std::move(park_handler_);
+    park_handler_ = nullptr;
+    handler(*this, std::string(up_.buffer.data() + up_.pending_offset, up_.pending_size),
+            std::string(down_.buffer.data() + down_.pending_offset, down_.pending_size));
+    // The other process has its own copies of the sockets, the connections stay open
+    close();
+}
+
+void TunnelSession::resumeForwarding(const std::string& pending_up, const std::string& pending_down) {
+    forwarding_ = true;
+    touch();
+    // The bytes were charged by the previous process already
+    if (pending_up.empty()) {
+        forward(true);
+    } else {
+        std::copy(pending_up.begin(), pending_up.begin() + std::min(pending_up.size(), BUFFER_SIZE), up_.buffer.begin());
+        write(instance_socket_, true, std::min(pending_up.size(), BUFFER_SIZE), Clock::duration::zero());
+    }
+    if (pending_down.empty()) {
+        forward(false);
+    } else {
+        std::copy(pending_down.begin(), pending_down.begin() + std::min(pending_down.size(), BUFFER_SIZE), down_.buffer.begin());
+        write(client_socket_, false, std::min(pending_down.size(), BUFFER_SIZE), Clock::duration::zero());
+    }
+}
+
+const std::string& TunnelSession::getToken() const {
+    return token_;
+}
+
+TunnelSession::Clock::time_point TunnelSession::getDeadline() const {
+    return Clock::time_point(Clock::duration(deadline_.load(std::memory_order_relaxed)));
+}
+
+void TunnelSession::forward(bool upstream) {
+    if (park_handler_) {
+        parkDirection(upstream, 0, 0);
+        return;
+    }
+    // The client side goes through OpenSSL unless kernel TLS handles that direction
+    if (tls_ && upstream && !tls_stream_.kernelReceive()) {
+        forward(tls_stream_, instance_socket_, upstream);
+    } else if (tls_ && !upstream && !tls_stream_.kernelSend()) {
+        forward(instance_socket_, tls_stream_, upstream);
+    } else if (upstream) {
+        forward(client_socket_, instance_socket_, upstream);
+    } else {
+        forward(instance_socket_, client_socket_, upstream);
+    }
+}
+
+template <typename FromStream, typename ToStream>
+void TunnelSession::forward(FromStream& from_stream, ToStream& to_stream, bool upstream) {
+    // Every handler of a direction comes from its HandlerMemory: read, write and throttling
+    // follow each other, so the forwarding loop doesn't allocate
+    Direction& direction = upstream ? up_ : down_;
+    auto self = shared_from_this();
+    from_stream.async_read_some(boost::asio::buffer(direction.buffer),
+        boost::asio::bind_executor(strand_, make_alloc_handler(direction.memory,
+            [this, self, &to_stream, upstream](boost::system::error_code ec, std::size_t bytes_transferred) {
+                if (park_handler_ && (!ec || ec == boost::asio::error::operation_aborted)) {
+                    parkDirection(upstream, 0, ec ? 0 : bytes_transferred);
+                    return;
+                }
+                if (ec || bytes_transferred == 0) {
+                    if (ec != boost::asio::error::operation_aborted) {
+                        // A peer closing its side is ordinary traffic, not worth a log line
+                        if (ec && ec != boost::asio::error::eof) {
+                            log_error("Read error: ", ec.message(), LogField("session", id_), LogField("token", token_),
+                                      LogField("stage", upstream ? "forward_up" : "forward_down"));
+                        }
+                        close();
+                    }
+                    return;
+                }
+                touch();
+                // Charge the chunk to the session and token budgets
+                auto delay = chargeBytes(upstream, bytes_transferred);
+                write(to_stream, upstream, bytes_transferred, delay);
+            })));
+}
+
+template <typename ToStream>
+void TunnelSession::write(ToStream& to_stream, bool upstream, std::size_t size, Clock::duration delay) {
+    Direction& direction = upstream ? up_ : down_;
+    auto self = shared_from_this();
+    boost::asio::async_write(to_stream, boost::asio::buffer(direction.buffer, size),
+        boost::asio::bind_executor(strand_, make_alloc_handler(direction.memory,
+            [this, self, upstream, size, delay](boost::system::error_code write_ec, std::size_t bytes_written) {
+                if (park_handler_ && (!write_ec || write_ec == boost::asio::error::operation_aborted)) {
+                    parkDirection(upstream, bytes_written, size - bytes_written);
+                    return;
+                }
+                if (write_ec) {
+                    if (write_ec != boost::asio::error::operation_aborted) {
+                        log_error("Write error: ", write_ec.message(), LogField("session", id_), LogField("token", token_),
+                                  LogField("stage", upstream ? "forward_up" : "forward_down"));
+                        close();
+                    }
+                    return;
+                }
+                if (delay <= Clock::duration::zero()) {
+                    forward(upstream);
+                    return;
+                }
+                // Over budget, wait before reading the next chunk
+                Direction& direction = upstream ? up_ : down_;
+                direction.throttle_timer.expires_after(delay);
+                direction.throttle_timer.async_wait(boost::asio::bind_executor(strand_, make_alloc_handler(direction.memory,
+                    [this, self, upstream](boost::system::error_code timer_ec) {
+                        if (park_handler_) {
+                            parkDirection(upstream, 0, 0);
+                        } else if (!timer_ec) {
+                            forward(upstream);
+                        }
+                    })));
+            })));
+}
+
+std::uint64_t TunnelSession::getBytesUp() const {
+    return bytes_up_;
+}
+
+std::uint64_t TunnelSession::getBytesDown() const {
+    return bytes_down_;
+}
+
+TunnelSessionPool::TunnelSessionPool(boost::asio::io_context& io_context, std::size_t max_idle)
+    : io_context_(io_context), max_idle_(max_idle), block_size_(0) {}
+
+TunnelSessionPool::~TunnelSessionPool() {
+    for (TunnelSession* session : idle_sessions_) {
+        delete session;
+    }
+    for (void* block : idle_blocks_) {
+        ::operator delete(block);
+    }
+}
+
+std::shared_ptr<TunnelSession> TunnelSessionPool::acquire(boost::asio::ip::tcp::socket socket) {
+    TunnelSession* session = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_sessions_.empty()) {
+            session = idle_sessions_.back();
+            idle_sessions_.pop_back();
+        }
+    }
+    if (!session) {
+        session = new TunnelSession(io_context_);
+    }
+    session->reset(std::move(socket));
+    auto self = shared_from_this();
+    // The session goes back to the pool instead of being deleted
+    std::shared_ptr<TunnelSession> result(session, [self](TunnelSession* session) {
+        self->release(session);
+    }, ControlBlockAllocator<TunnelSession>(self));
+    std::lock_guard<std::mutex> lock(mutex_);
+    session->pool_index_ = active_sessions_.size();
+    active_sessions_.push_back(session);
+    return result;
+}
+
+boost::asio::io_context& TunnelSessionPool::getIOContext() const {
+    return io_context_;
+}
+
+std::size_t TunnelSessionPool::getActiveCount() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return active_sessions_.size();
+}
+
+std::vector<std::shared_ptr<TunnelSession>> TunnelSessionPool::getActiveSessions() {
+    std::vector<std::shared_ptr<TunnelSession>> sessions;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (TunnelSession* session : active_sessions_) {
+        // Empty once the last reference is gone, the session is about to be released
+        if (auto shared = session->weak_from_this().lock()) {
+            sessions.push_back(std::move(shared));
+        }
+    }
+    return sessions;
+}
+
+void TunnelSessionPool::release(TunnelSession* session) {
+    // Nothing refers to the session anymore, its sockets and timers are idle once closed
+    session->close();
+    session->releaseShaper();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_sessions_[session->pool_index_] = active_sessions_.back();
+        active_sessions_[session->pool_index_]->pool_index_ = session->pool_index_;
+        active_sessions_.pop_back();
+        if (idle_sessions_.size() < max_idle_) {
+            idle_sessions_.push_back(session);
+            return;
+        }
+    }
+    delete session;
+}
+
+void* TunnelSessionPool::allocateBlock(std::size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (block_size_ == 0) {
+            block_size_ = size;
+        }
+        if (size == block_size_ && !idle_blocks_.empty()) {
+            void* block = idle_blocks_.back();
+            idle_blocks_.pop_back();
+            return block;
+        }
+    }
+    return ::operator new(size);
+}
+
+void TunnelSessionPool::deallocateBlock(void* block, std::size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size == block_size_ && idle_blocks_.size() < max_idle_) {
+            idle_blocks_.push_back(block);
+            return;
+        }
+    }
+    ::operator delete(block);
+}
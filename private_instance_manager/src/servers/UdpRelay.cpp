@@ -0,0 +1,603 @@
+#include "servers/UdpRelay.hpp"
+#include "common/Logger.hpp"
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+#include <unordered_set>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Datagrams sent per system call
+static constexpr std::size_t SEND_BATCH_SIZE = 64;
+// Batches read from a socket before the other sockets of the worker get their turn
+static constexpr int MAX_ROUNDS = 8;
+// Kernel buffers of the sockets, so that bursts are queued rather than dropped
+static constexpr int SOCKET_BUFFER_SIZE = 4 * 1024 * 1024;
+// Interval of the sweep closing the expired and idle flows
+static constexpr std::chrono::seconds SWEEP_INTERVAL(1);
+// Tokens are UUIDs, the other datagrams of unknown clients are not looked up
+static constexpr std::size_t TOKEN_SIZE = 36;
+// Token lookups in flight per worker, further tokens are dropped until one of them is answered
+static constexpr std::size_t MAX_PENDING_LOOKUPS = 64;
+// Token lookups per client address and per SWEEP_INTERVAL, and addresses counted per interval
+static constexpr unsigned LOOKUPS_PER_SOURCE = 4;
+static constexpr std::size_t MAX_LOOKUP_SOURCES = 4096;
+
+static const std::string TOKEN_ACCEPTED = "Token is correct.\n";
+static const std::string INVALID_TOKEN = "Invalid Token!\n";
+static const std::string TOKEN_EXPIRED = "Token has expired!\n";
+static const std::string INVALID_REQUEST = "Invalid request!\n";
+
+// Token of a datagram: the payload without the trailing newline or NUL
+static std::string parse_token(const char* data, std::size_t size) {
+    while (size > 0 && (data[size - 1] == '\n' || data[size - 1] == '\r' || data[size - 1] == '\0')) {
+        --size;
+    }
+    if (size != TOKEN_SIZE) {
+        return "";
+    }
+    return std::string(data, size);
+}
+
+struct EndpointHash {
+    std::size_t operator()(const boost::asio::ip::udp::endpoint& endpoint) const {
+        const auto& address = endpoint.address();
+        if (address.is_v4()) {
+            return std::hash<std::uint64_t>()((std::uint64_t(address.to_v4().to_uint()) << 16) | endpoint.port());
+        }
+        auto bytes = address.to_v6().to_bytes();
+        return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()))
+            ^ endpoint.port();
+    }
+};
+
+// Datagrams waiting to be sent. Consecutive datagrams for the same socket go out with a single
+// sendmmsg, and a train of same-size datagrams received with GRO leaves as a single GSO buffer
+class DatagramBatch {
+public:
+    explicit DatagramBatch(bool gso) : gso_(gso), fd_(-1), count_(0) {}
+
+    void add(int fd, const char* data, std::size_t size, std::size_t segment_size, const sockaddr* destination,
+             socklen_t destination_size) {
+        if (fd != fd_) {
+            flush();
+            fd_ = fd;
+        }
+        if (segment_size > 0 && size > segment_size && !gso_) {
+            for (std::size_t offset = 0; offset < size; offset += segment_size) {
+                add(fd, data + offset, std::min(segment_size, size - offset), 0, destination, destination_size);
+            }
+            return;
+        }
+        if (count_ == SEND_BATCH_SIZE) {
+            flush();
+        }
+        iovs_[count_] = {const_cast<char*>(data), size};
+        msghdr& header = messages_[count_].msg_hdr;
+        std::memset(&header, 0, sizeof(header));
+        header.msg_name = const_cast<sockaddr*>(destination);
+        header.msg_namelen = destination ? destination_size : 0;
+        header.msg_iov = &iovs_[count_];
+        header.msg_iovlen = 1;
+        if (segment_size > 0 && size > segment_size) {
+            header.msg_control = controls_[count_].data();
+            header.msg_controllen = controls_[count_].size();
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+            std::uint16_t segment = static_cast<std::uint16_t>(segment_size);
+            std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+        ++count_;
+    }
+
+    void flush() {
+        std::size_t sent = 0;
+        while (sent < count_) {
+            int result = sendmmsg(fd_, messages_.data() + sent, count_ - sent, MSG_DONTWAIT);
+            if (result > 0) {
+                sent += static_cast<std::size_t>(result);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The socket buffer is full, the rest is dropped as on a congested link
+                break;
+            }
+            msghdr& header = messages_[sent].msg_hdr;
+            if (header.msg_control && (errno == EIO || errno == EINVAL)) {
+                // The route can't segment, the trains are split from now on
+                gso_ = false;
+                sendSegments(header);
+            }
+            // Errors such as ECONNREFUSED only concern this datagram
+            ++sent;
+        }
+        count_ = 0;
+    }
+
+private:
+    void sendSegments(const msghdr& header) {
+        std::uint16_t segment_size;
+        std::memcpy(&segment_size, CMSG_DATA(CMSG_FIRSTHDR(&header)), sizeof(segment_size));
+        const char* data = static_cast<const char*>(header.msg_iov->iov_base);
+        std::size_t size = header.msg_iov->iov_len;
+        for (std::size_t offset = 0; offset < size; offset += segment_size) {
+            sendto(fd_, data + offset, std::min<std::size_t>(segment_size, size - offset), MSG_DONTWAIT,
+                   static_cast<const sockaddr*>(header.msg_name), header.msg_namelen);
+        }
+    }
+
+    bool gso_;
+    int fd_;
+    std::size_t count_;
+    std::array<mmsghdr, SEND_BATCH_SIZE> messages_;
+    std::array<iovec, SEND_BATCH_SIZE> iovs_;
+    std::array<std::array<char, CMSG_SPACE(sizeof(std::uint16_t))>, SEND_BATCH_SIZE> controls_;
+};
+
+// Relay of the clients reaching one socket. Everything runs on the strand of the worker, which
+// owns its flows and a single set of buffers: every handler receives and sends a whole batch
+// before returning
+class UdpRelay::Worker : public std::enable_shared_from_this<UdpRelay::Worker> {
+public:
+    Worker(boost::asio::io_context& io_context, unsigned short port, int listen_fd, TokenResolver resolve_token,
+           TrafficShaper& shaper, std::chrono::seconds idle_timeout);
+    void start();
+    void stop();
+    int getListenFd();
+    bool hasGro() const;
+
+private:
+    using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+    struct Flow {
+        boost::asio::ip::udp::endpoint client;
+        // Connected to the instance
+        boost::asio::ip::udp::socket socket;
+        std::string token;
+        Clock::time_point deadline;
+        Clock::time_point last_activity;
+        TrafficShaper& shaper;
+        TokenBucket bucket;
+        std::shared_ptr<TokenUsage> usage;
+        // Set once the socket is connected to the instance
+        bool ready = false;
+        bool closed = false;
+        Flow(const boost::asio::ip::udp::endpoint& client_endpoint, const Strand& strand, TrafficShaper& flow_shaper,
+             const std::string& flow_token)
+            : client(client_endpoint), socket(strand), token(flow_token), shaper(flow_shaper) {}
+        ~Flow() {
+            if (usage) {
+                shaper.release(token);
+            }
+        }
+    };
+
+    void waitClients();
+    void relayUp();
+    void authenticate(const boost::asio::ip::udp::endpoint& client, const char* data, std::size_t size);
+    // Answer the token of the client once it is resolved, and connect its flow if it is valid
+    void openFlow(const boost::asio::ip::udp::endpoint& client, const std::string& token, const TokenInfo& result);
+    void waitInstance(std::shared_ptr<Flow> flow);
+    void relayDown(Flow& flow);
+    // Account for the bytes of a flow, false if they are over its budget and must be dropped
+    bool charge(Flow& flow, bool upstream, std::size_t bytes, Clock::time_point now);
+    void reply(const boost::asio::ip::udp::endpoint& client, const std::string& message);
+    void closeFlow(std::shared_ptr<Flow> flow);
+    void scheduleSweep();
+    // Receive a batch from the socket, returns the number of datagrams
+    int receive(int fd);
+    // Size of the datagrams of a GRO train, 0 for a single datagram
+    std::size_t segmentSize(std::size_t index);
+
+    Strand strand_;
+    boost::asio::ip::udp::socket socket_;
+    boost::asio::ip::udp::resolver resolver_;
+    boost::asio::steady_timer sweep_timer_;
+    TokenResolver resolve_token_;
+    TrafficShaper& shaper_;
+    Clock::duration idle_timeout_;
+    bool gro_;
+    bool stopped_;
+    std::unordered_map<boost::asio::ip::udp::endpoint, std::shared_ptr<Flow>, EndpointHash> flows_;
+    // Clients whose token is being resolved, and lookups per client address (port 0) in this interval
+    std::unordered_set<boost::asio::ip::udp::endpoint, EndpointHash> pending_;
+    std::unordered_map<boost::asio::ip::udp::endpoint, unsigned, EndpointHash> lookups_;
+    std::vector<char> buffers_;
+    std::array<mmsghdr, BATCH_SIZE> messages_;
+    std::array<iovec, BATCH_SIZE> iovs_;
+    std::array<sockaddr_storage, BATCH_SIZE> names_;
+    std::array<std::array<char, CMSG_SPACE(sizeof(int))>, BATCH_SIZE> controls_;
+    DatagramBatch batch_;
+};
+
+static bool enable_gro(int fd) {
+    int one = 1;
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+}
+
+static bool supports_gso(int fd) {
+    // No default segment size, it is given per message
+    int zero = 0;
+    return setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+}
+
+UdpRelay::Worker::Worker(boost::asio::io_context& io_context, unsigned short port, int listen_fd,
+                         TokenResolver resolve_token, TrafficShaper& shaper, std::chrono::seconds idle_timeout)
+    : strand_(boost::asio::make_strand(io_context)),
+      socket_(strand_),
+      resolver_(strand_),
+      sweep_timer_(strand_),
+      resolve_token_(std::move(resolve_token)),
+      shaper_(shaper),
+      idle_timeout_(idle_timeout),
+      gro_(false),
+      stopped_(false),
+      buffers_(BATCH_SIZE * MAX_DATAGRAM),
+      batch_(false) {
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    if (listen_fd >= 0) {
+        socket_.assign(boost::asio::ip::udp::v4(), listen_fd);
+    } else {
+        // The kernel spreads the clients over the sockets of the workers, by address
+        socket_.open(boost::asio::ip::udp::v4());
+        socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+        socket_.set_option(reuse_port(true));
+        socket_.bind(boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port));
+    }
+    boost::system::error_code ignored;
+    socket_.set_option(boost::asio::socket_base::receive_buffer_size(SOCKET_BUFFER_SIZE), ignored);
+    socket_.set_option(boost::asio::socket_base::send_buffer_size(SOCKET_BUFFER_SIZE), ignored);
+    gro_ = enable_gro(socket_.native_handle());
+    batch_ = DatagramBatch(supports_gso(socket_.native_handle()));
+}
+
+void UdpRelay::Worker::start() {
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [this, self]() {
+        waitClients();
+        scheduleSweep();
+    });
+}
+
+void UdpRelay::Worker::stop() {
+    auto self = shared_from_this();
+    boost::asio::post(strand_, [this, self]() {
+        stopped_ = true;
+        boost::system::error_code ignored;
+        socket_.cancel(ignored);
+        sweep_timer_.cancel();
+        std::vector<std::shared_ptr<Flow>> flows;
+        for (auto& entry : flows_) {
+            flows.push_back(entry.second);
+        }
+        for (auto& flow : flows) {
+            closeFlow(flow);
+        }
+    });
+}
+
+int UdpRelay::Worker::getListenFd() {
+    return socket_.native_handle();
+}
+
+bool UdpRelay::Worker::hasGro() const {
+    return gro_;
+}
+
+void UdpRelay::Worker::waitClients() {
+    auto self = shared_from_this();
+    socket_.async_wait(boost::asio::ip::udp::socket::wait_read, boost::asio::bind_executor(strand_,
+        [this, self](boost::system::error_code ec) {
+            if (stopped_) {
+                return;
+            }
+            if (ec) {
+                log_error("UDP wait error: ", ec.message());
+                return;
+            }
+            relayUp();
+            waitClients();
+        }));
+}
+
+void UdpRelay::Worker::relayUp() {
+    for (int round = 0; round < MAX_ROUNDS; ++round) {
+        int count = receive(socket_.native_handle());
+        if (count <= 0) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        for (int i = 0; i < count; ++i) {
+            const msghdr& header = messages_[i].msg_hdr;
+            if (header.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+            boost::asio::ip::udp::endpoint client;
+            std::memcpy(client.data(), &names_[i], header.msg_namelen);
+            client.resize(header.msg_namelen);
+            const char* data = buffers_.data() + i * MAX_DATAGRAM;
+            std::size_t size = messages_[i].msg_len;
+            auto it = flows_.find(client);
+            if (it == flows_.end()) {
+                authenticate(client, data, size);
+                continue;
+            }
+            Flow& flow = *it->second;
+            if (!flow.ready) {
+                continue;
+            }
+            // A client that missed the confirmation sends its token again
+            if (size <= TOKEN_SIZE + 2 && parse_token(data, size) == flow.token) {
+                reply(client, TOKEN_ACCEPTED);
+                continue;
+            }
+            if (!charge(flow, true, size, now)) {
+                continue;
+            }
+            batch_.add(flow.socket.native_handle(), data, size, segmentSize(i), nullptr, 0);
+        }
+        batch_.flush();
+        if (static_cast<std::size_t>(count) < BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+void UdpRelay::Worker::authenticate(const boost::asio::ip::udp::endpoint& client, const char* data, std::size_t size) {
+    std::string token = parse_token(data, size);
+    if (token.empty() || pending_.count(client) || pending_.size() >= MAX_PENDING_LOOKUPS) {
+        return;
+    }
+    boost::asio::ip::udp::endpoint source(client.address(), 0);
+    auto lookups = lookups_.find(source);
+    if (lookups == lookups_.end()) {
+        if (lookups_.size() >= MAX_LOOKUP_SOURCES) {
+            return;
+        }
+        lookups = lookups_.emplace(source, 0).first;
+    }
+    if (lookups->second >= LOOKUPS_PER_SOURCE) {
+        return;
+    }
+    ++lookups->second;
+    pending_.insert(client);
+    auto self = shared_from_this();
+    resolve_token_(token, [this, self, client, token](TokenInfo result) {
+        boost::asio::post(strand_, [this, self, client, token, result]() {
+            pending_.erase(client);
+            if (!stopped_ && !flows_.count(client)) {
+                openFlow(client, token, result);
+            }
+        });
+    });
+}
+
+void UdpRelay::Worker::openFlow(const boost::asio::ip::udp::endpoint& client, const std::string& token,
+                                const TokenInfo& result) {
+    if (!result) {
+        reply(client, INVALID_REQUEST);
+        return;
+    }
+    unsigned short port = std::get<0>(*result);
+    long time_remaining = std::get<1>(*result);
+    if (port == 0) {
+        reply(client, INVALID_TOKEN);
+        return;
+    }
+    if (time_remaining <= 0) {
+        reply(client, TOKEN_EXPIRED);
+        return;
+    }
+    auto flow = std::make_shared<Flow>(client, strand_, shaper_, token);
+    // The flow cannot outlive the token it was opened with
+    flow->deadline = Clock::now() + std::chrono::seconds(time_remaining);
+    flow->last_activity = Clock::now();
+    flows_.emplace(client, flow);
+    auto self = shared_from_this();
+    // Datagrams of the client are dropped until the flow is connected to the instance
+    resolver_.async_resolve(std::get<2>(*result), std::to_string(port), boost::asio::bind_executor(strand_,
+        [this, self, flow](boost::system::error_code ec, boost::asio::ip::udp::resolver::results_type endpoints) {
+            if (flow->closed) {
+                return;
+            }
+            if (!ec) {
+                auto endpoint = endpoints.begin()->endpoint();
+                flow->socket.open(endpoint.protocol(), ec);
+                if (!ec) {
+                    flow->socket.connect(endpoint, ec);
+                }
+            }
+            if (ec) {
+                log_error("UDP flow to instance error: ", ec.message());
+                closeFlow(flow);
+                return;
+            }
+            boost::system::error_code ignored;
+            flow->socket.set_option(boost::asio::socket_base::receive_buffer_size(SOCKET_BUFFER_SIZE), ignored);
+            if (gro_) {
+                enable_gro(flow->socket.native_handle());
+            }
+            flow->bucket.setRate(shaper_.getSessionRate(), shaper_.getBurst());
+            flow->usage = shaper_.acquire(flow->token, flow->deadline);
+            flow->ready = true;
+            reply(flow->client, TOKEN_ACCEPTED);
+            waitInstance(flow);
+        }));
+}
+
+void UdpRelay::Worker::waitInstance(std::shared_ptr<Flow> flow) {
+    auto self = shared_from_this();
+    flow->socket.async_wait(boost::asio::ip::udp::socket::wait_read, boost::asio::bind_executor(strand_,
+        [this, self, flow](boost::system::error_code ec) {
+            if (flow->closed) {
+                return;
+            }
+            if (ec) {
+                log_error("UDP wait error: ", ec.message());
+                closeFlow(flow);
+                return;
+            }
+            relayDown(*flow);
+            waitInstance(flow);
+        }));
+}
+
+void UdpRelay::Worker::relayDown(Flow& flow) {
+    for (int round = 0; round < MAX_ROUNDS; ++round) {
+        // Errors such as ECONNREFUSED, when nothing listens on the instance port yet, end the batch
+        int count = receive(flow.socket.native_handle());
+        if (count <= 0) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        for (int i = 0; i < count; ++i) {
+            std::size_t size = messages_[i].msg_len;
+            if ((messages_[i].msg_hdr.msg_flags & MSG_TRUNC) || !charge(flow, false, size, now)) {
+                continue;
+            }
+            batch_.add(socket_.native_handle(), buffers_.data() + i * MAX_DATAGRAM, size, segmentSize(i),
+                       flow.client.data(), static_cast<socklen_t>(flow.client.size()));
+        }
+        batch_.flush();
+        if (static_cast<std::size_t>(count) < BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+bool UdpRelay::Worker::charge(Flow& flow, bool upstream, std::size_t bytes, Clock::time_point now) {
+    if (!flow.bucket.tryCharge(bytes, now) || (flow.usage && !flow.usage->bucket.tryCharge(bytes, now))) {
+        return false;
+    }
+    flow.last_activity = now;
+    if (flow.usage) {
+        (upstream ? flow.usage->bytes_up : flow.usage->bytes_down).fetch_add(bytes, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void UdpRelay::Worker::reply(const boost::asio::ip::udp::endpoint& client, const std::string& message) {
+    sendto(socket_.native_handle(), message.data(), message.size(), MSG_DONTWAIT, client.data(),
+           static_cast<socklen_t>(client.size()));
+}
+
+void UdpRelay::Worker::closeFlow(std::shared_ptr<Flow> flow) {
+    flow->closed = true;
+    boost::system::error_code ignored;
+    flow->socket.close(ignored);
+    auto it = flows_.find(flow->client);
+    if (it != flows_.end() && it->second == flow) {
+        flows_.erase(it);
+    }
+}
+
+void UdpRelay::Worker::scheduleSweep() {
+    auto self = shared_from_this();
+    sweep_timer_.expires_after(SWEEP_INTERVAL);
+    sweep_timer_.async_wait(boost::asio::bind_executor(strand_, [this, self](boost::system::error_code ec) {
+        if (ec || stopped_) {
+            return;
+        }
+        // The lookup budgets of the client addresses start over
+        lookups_.clear();
+        Clock::time_point now = Clock::now();
+        std::vector<std::shared_ptr<Flow>> expired;
+        for (auto& entry : flows_) {
+            const Flow& flow = *entry.second;
+            bool idle = idle_timeout_ > Clock::duration::zero() && now - flow.last_activity >= idle_timeout_;
+            if (now >= flow.deadline || idle) {
+                expired.push_back(entry.second);
+            }
+        }
+        for (auto& flow : expired) {
+            log_error("Closing UDP flow: token expired or idle timeout reached.");
+            closeFlow(flow);
+        }
+        scheduleSweep();
+    }));
+}
+
+int UdpRelay::Worker::receive(int fd) {
+    // The kernel overwrites the lengths, the headers are set up again for every batch
+    for (std::size_t i = 0; i < BATCH_SIZE; ++i) {
+        iovs_[i] = {buffers_.data() + i * MAX_DATAGRAM, MAX_DATAGRAM};
+        msghdr& header = messages_[i].msg_hdr;
+        header.msg_name = &names_[i];
+        header.msg_namelen = sizeof(names_[i]);
+        header.msg_iov = &iovs_[i];
+        header.msg_iovlen = 1;
+        header.msg_control = controls_[i].data();
+        header.msg_controllen = controls_[i].size();
+        header.msg_flags = 0;
+    }
+    int count;
+    do {
+        count = recvmmsg(fd, messages_.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    } while (count < 0 && errno == EINTR);
+    return count;
+}
+
+std::size_t UdpRelay::Worker::segmentSize(std::size_t index) {
+    msghdr& header = messages_[index].msg_hdr;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment_size;
+            std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            return static_cast<std::size_t>(segment_size);
+        }
+    }
+    return 0;
+}
+
+UdpRelay::UdpRelay(IOContextPool& pool, unsigned short port, TokenResolver resolver, TrafficShaper& shaper,
+                   std::chrono::seconds idle_timeout, const std::vector<int>& listen_fds) {
+    // Inherited sockets all get a worker, or the clients hashed to them would be lost
+    std::size_t num_workers = std::max<std::size_t>(pool.getNumThreads(), listen_fds.size());
+    for (std::size_t i = 0; i < num_workers; ++i) {
+        int listen_fd = i < listen_fds.size() ? listen_fds[i] : -1;
+        workers_.push_back(std::make_shared<Worker>(pool.getIOContext(i), port, listen_fd, resolver, shaper,
+                                                    idle_timeout));
+    }
+}
+
+void UdpRelay::start() {
+    for (auto& worker : workers_) {
+        worker->start();
+    }
+}
+
+void UdpRelay::stop() {
+    for (auto& worker : workers_) {
+        worker->stop();
+    }
+}
+
+std::vector<int> UdpRelay::getListenFds() const {
+    std::vector<int> fds;
+    for (auto& worker : workers_) {
+        fds.push_back(worker->getListenFd());
+    }
+    return fds;
+}
+
+std::size_t UdpRelay::getNumWorkers() const {
+    return workers_.size();
+}
+
+bool UdpRelay::hasGro() const {
+    return !workers_.empty() && workers_.front()->hasGro();
+}
@@ -0,0 +1,122 @@
+#include "utils/http.hpp"
+
+static bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.size(); ++i) {
+        char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] - 'A' + 'a' : a[i];
+        char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] - 'A' + 'a' : b[i];
+        if (x != y) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string_view trim(std::string_view value) {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+        value.remove_prefix(1);
+    }
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+        value.remove_suffix(1);
+    }
+    return value;
+}
+
+static bool parse_request_line(std::string_view line, HttpRequestHead& head) {
+    std::size_t method_end = line.find(' ');
+    if (method_end == 0 || method_end == std::string_view::npos) {
+        return false;
+    }
+    std::size_t target_end = line.find(' ', method_end + 1);
+    if (target_end == method_end + 1 || target_end == std::string_view::npos) {
+        return false;
+    }
+    head.method = line.substr(0, method_end);
+    head.target = line.substr(method_end + 1, target_end - method_end - 1);
+    head.version = line.substr(target_end + 1);
+    return head.version.size() == 8 && head.version.compare(0, 7, "HTTP/1.") == 0;
+}
+
+HttpParseResult parse_http_request(std::string_view data, HttpRequestHead& head) {
+    head = HttpRequestHead();
+    std::size_t offset = 0;
+    // Empty lines before the request line are ignored
+    while (data.compare(offset, 2, "\r\n") == 0) {
+        offset += 2;
+    }
+    bool request_line = true;
+    while (true) {
+        std::size_t line_end = data.find("\r\n", offset);
+        if (line_end == std::string_view::npos) {
+            return HttpParseResult::Incomplete;
+        }
+        std::string_view line = data.substr(offset, line_end - offset);
+        offset = line_end + 2;
+        if (request_line) {
+            // Checked as soon as it is there, so that other protocols are turned away early
+            if (!parse_request_line(line, head)) {
+                return HttpParseResult::Invalid;
+            }
+            request_line = false;
+            continue;
+        }
+        if (line.empty()) {
+            head.size = offset;
+            return HttpParseResult::Complete;
+        }
+        std::size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos) {
+            return HttpParseResult::Invalid;
+        }
+        std::string_view name = line.substr(0, colon);
+        if (name.find_first_of(" \t") != std::string_view::npos) {
+            return HttpParseResult::Invalid;
+        }
+        std::string_view value = trim(line.substr(colon + 1));
+        if (equals_ignore_case(name, "host")) {
+            // Two hosts could route the request to a different instance than the one it is meant for
+            if (!head.host.empty()) {
+                return HttpParseResult::Invalid;
+            }
+            head.host = value;
+        } else if (equals_ignore_case(name, "cookie") && head.cookie.empty()) {
+            head.cookie = value;
+        }
+    }
+}
+
+std::string_view http_cookie(std::string_view cookies, std::string_view name) {
+    while (!cookies.empty()) {
+        std::size_t end = cookies.find(';');
+        std::string_view pair = trim(cookies.substr(0, end));
+        cookies = end == std::string_view::npos ? std::string_view() : cookies.substr(end + 1);
+        std::size_t equals = pair.find('=');
+        if (equals == std::string_view::npos || pair.substr(0, equals) != name) {
+            continue;
+        }
+        std::string_view value = pair.substr(equals + 1);
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+        return value;
+    }
+    return std::string_view();
+}
+
+std::string_view http_host_name(std::string_view host) {
+    // IPv6 literals keep their brackets
+    if (!host.empty() && host.front() == '[') {
+        return host.substr(0, host.find(']') + 1);
+    }
+    return host.substr(0, host.find(':'));
+}
+
+std::string http_error_response(int status, const std::string& reason, const std::string& body) {
+    return "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n"
+        "\r\n" + body;
+}
@@ -0,0 +1,83 @@
+#include "utils/network.hpp"
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+unsigned short get_random_port() {
+    int sockfd;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int opt = 1;
+    unsigned short port;
+
+    // Create socket (IPv4, TCP)
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return 0;
+    }
+    // Optional: Set socket options
+    // SO_REUSEADDR allows the socket to be bound to an address that is already in use
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(sockfd);
+        return 0;
+    }
+    // Define the address
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY; // Bind to all interfaces
+    addr.sin_port = 0;                  // Let the OS assign a random free port
+    // Bind the socket
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(sockfd);
+        return 0;
+    }
+    // Retrieve the assigned port number
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("getsockname");
+        close(sockfd);
+        return 0;
+    }
+    port = ntohs(addr.sin_port);
+    close(sockfd);
+    return port;
+}
+
+int create_listen_socket(unsigned short& port) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int opt = 1;
+
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        close(sockfd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0;
+    // The socket stays bound until the instance exits, no other process can take the port
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sockfd, SOMAXCONN) < 0) {
+        perror("bind");
+        close(sockfd);
+        return -1;
+    }
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("getsockname");
+        close(sockfd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return sockfd;
+}
@@ -0,0 +1,22 @@
+#include "utils/process.hpp"
+#include <cstdio>
+#include <grp.h>
+#include <unistd.h>
+
+bool drop_privileges(uid_t user_id, gid_t group_id) {
+    // The supplementary groups of root, gid 0 among them, must not be inherited
+    if (setgroups(0, nullptr) != 0) {
+        perror("setgroups failed");
+        return false;
+    }
+    // The group must be changed first, the user would not be allowed to do it anymore
+    if (setgid(group_id) != 0) {
+        perror("setgid failed");
+        return false;
+    }
+    if (setuid(user_id) != 0) {
+        perror("setuid failed");
+        return false;
+    }
+    return true;
+}